@@ -0,0 +1,154 @@
+#include "batch.h"
+#include "environment.h"
+#include "cartridge.h"
+#include "defines.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Ten seconds of DMG time.
+#define BATCH_DEFAULT_CYCLES (10 * 4194304ULL)
+#define BATCH_PROFILE_SIZE   20
+
+struct BatchJob {
+  string path;
+  uint64_t cycles;
+  Cartridge cart;
+
+  // Filled in by the worker.
+  bool started;  // False when it failed before running.
+  uint64_t ran;
+  double secs;
+  uint64_t register_hash;
+  uint64_t memory_hash;
+  string crash;
+};
+
+// The profile goes next to the ROM: hot spots in <rom>.profile and folded
+// stacks in <rom>.folded.
+static bool save_profile(Environment &env, const string &path) {
+  FILE *report = fopen((path + ".profile").c_str(), "w");
+  if (!report) return false;
+  env.report_profile(report, BATCH_PROFILE_SIZE);
+  fclose(report);
+  return env.save_profile(path + ".folded");
+}
+
+static void run_job(BatchJob &job, bool jit, bool jit_check, bool profile) {
+  Environment env{nullptr};
+  env.insert_cartridge(&job.cart);
+  env.reset();
+  if (jit && !env.enable_jit(true, jit_check)) {
+    job.crash = "JIT not available";
+    return;
+  }
+  if (profile && !env.enable_profiler(true)) {
+    job.crash = "Profiler not built in";
+    return;
+  }
+
+  job.started = true;
+  auto start = chrono::steady_clock::now();
+  env.run_for(job.cycles);
+  auto end = chrono::steady_clock::now();
+
+  job.ran = env.cycles();
+  job.secs = chrono::duration<double>(end - start).count();
+  job.register_hash = env.register_hash();
+  job.memory_hash = env.memory_hash();
+  if (env.crash_message()) job.crash = env.crash_message();
+  if (profile && !save_profile(env, job.path) && job.crash.empty()) job.crash = "Cannot write the profile";
+}
+
+// Usage: main batch [-j threads] [-c cycles] [-J | -D] [-P] <list>
+//
+// Every line of the list is a ROM path, optionally followed by its cycle
+// budget. The ROMs run headless on a pool of worker threads, one
+// Environment each, and the results are printed in list order once all are
+// done. -J runs them with the JIT, -D with the JIT checked against the
+// interpreter. -P profiles them on the interpreter, see save_profile().
+int run_batch(int argc, char **argv) {
+  unsigned int threads = thread::hardware_concurrency();
+  uint64_t default_cycles = BATCH_DEFAULT_CYCLES;
+  const char *list_path = nullptr;
+  bool jit = false, jit_check = false, profile = false;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      default_cycles = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "-J") == 0) {
+      jit = true;
+    } else if (strcmp(argv[i], "-D") == 0) {
+      jit = jit_check = true;
+    } else if (strcmp(argv[i], "-P") == 0) {
+      profile = true;
+    } else {
+      list_path = argv[i];
+    }
+  }
+  if (!list_path) {
+    printf("Usage: %s batch [-j threads] [-c cycles] [-J | -D] [-P] <list>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (threads == 0) threads = 1;
+
+  fstream list(list_path, ios::in);
+  if (!list) {
+    ERR(printf("Cannot open %s", list_path));
+    return EXIT_FAILURE;
+  }
+
+  // Cartridges are loaded up front, so only the main thread prints.
+  vector<unique_ptr<BatchJob>> jobs;
+  string line;
+  while (getline(list, line)) {
+    istringstream iss(line);
+    unique_ptr<BatchJob> job(new BatchJob());
+    if (!(iss >> job->path) || job->path[0] == '#') continue;
+    if (!(iss >> job->cycles)) job->cycles = default_cycles;
+    if (!job->cart.load(job->path)) return EXIT_FAILURE;
+    jobs.push_back(move(job));
+  }
+
+  atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    for (size_t i = next_job++; i < jobs.size(); i = next_job++) run_job(*jobs[i], jit, jit_check, profile);
+  };
+
+  auto start = chrono::steady_clock::now();
+  vector<thread> pool;
+  for (unsigned int i = 0; i < threads && i < jobs.size(); i++) pool.emplace_back(worker);
+  for (thread &th : pool) th.join();
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  uint64_t total = 0;
+  int crashed = 0;
+  for (auto &job : jobs) {
+    if (!job->started) {
+      printf("%s: not run: %s\n", job->path.c_str(), job->crash.c_str());
+      crashed++;
+      continue;
+    }
+    printf("%s: %lu cycles in %.3fs, %.2f Mcycles/s, regs %.16lx, mem %.16lx%s%s\n",
+      job->path.c_str(), (unsigned long) job->ran, job->secs, job->ran / job->secs / 1e6,
+      (unsigned long) job->register_hash, (unsigned long) job->memory_hash,
+      job->crash.empty() ? "" : ", stopped: ", job->crash.c_str());
+    total += job->ran;
+    if (!job->crash.empty()) crashed++;
+  }
+  printf("%zu ROMs on %u threads: %.2f Mcycles/s in total, %d stopped early\n",
+    jobs.size(), threads, total / secs / 1e6, crashed);
+
+  return crashed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
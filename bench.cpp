@@ -0,0 +1,386 @@
+#include "bench.h"
+#include "environment.h"
+#include "cartridge.h"
+#include "defines.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Same shape as the start of the DMG boot ROM: clear VRAM backwards with
+// LD (HL-),A until bit 7 of H drops, then restart the loop forever.
+static const uint8_t boot_loop[] = {
+  0x31, 0xFE, 0xFF, // 0x00 LD SP,$FFFE
+  0xAF,             // 0x03 XOR A
+  0x21, 0xFF, 0x9F, // 0x04 LD HL,$9FFF
+  0x32,             // 0x07 LD (HL-),A
+  0xCB, 0x7C,       // 0x08 BIT 7,H
+  0x20, 0xFB,       // 0x0A JR NZ,$07
+  0x21, 0xFF, 0x9F, // 0x0C LD HL,$9FFF
+  0xCB, 0x7C,       // 0x0F BIT 7,H
+  0x20, 0xF4,       // 0x11 JR NZ,$07
+};
+
+// The sound/IO setup part of the boot ROM: opcodes from the end of the page
+// (LD (C),A, LDH, CALL, PUSH/POP) that sat at the tail of the old if chain.
+static const uint8_t io_loop[] = {
+  0x31, 0xFE, 0xFF, // 0x00 LD SP,$FFFE
+  0x0E, 0x11,       // 0x03 LD C,$11
+  0x3E, 0x80,       // 0x05 LD A,$80
+  0xE2,             // 0x07 LD (C),A
+  0xE0, 0x26,       // 0x08 LDH ($26),A
+  0xCD, 0x0E, 0x00, // 0x0A CALL $000E
+  0x00,             // 0x0D NOP
+  0xC5,             // 0x0E PUSH BC
+  0xC1,             // 0x0F POP BC
+  0xC1,             // 0x10 POP BC (drops the return address)
+  0x3C,             // 0x11 INC A
+  0x20, 0xF3,       // 0x12 JR NZ,$07
+  0x28, 0xF1,       // 0x14 JR Z,$07
+};
+
+// Flag-heavy ALU work: every instruction writes flags, and only the JRs read
+// them back.
+static const uint8_t flag_loop[] = {
+  0x06, 0x00,       // 0x00 LD B,$00
+  0x04,             // 0x02 INC B
+  0x0C,             // 0x03 INC C
+  0x15,             // 0x04 DEC D
+  0x17,             // 0x05 RLA
+  0x1D,             // 0x06 DEC E
+  0x3C,             // 0x07 INC A
+  0x17,             // 0x08 RLA
+  0x05,             // 0x09 DEC B
+  0x20, 0xF6,       // 0x0A JR NZ,$02
+  0x28, 0xF4,       // 0x0C JR Z,$02
+};
+
+// Register-only arithmetic, the part of a block the JIT translates.
+static const uint8_t alu_loop[] = {
+  0x06, 0x00,       // 0x00 LD B,$00
+  0x80,             // 0x02 ADD A,B
+  0xEE, 0x5A,       // 0x03 XOR $5A
+  0x4F,             // 0x05 LD C,A
+  0x89,             // 0x06 ADC A,C
+  0x13,             // 0x07 INC DE
+  0xB3,             // 0x08 OR E
+  0xCB, 0xDA,       // 0x09 SET 3,D
+  0x05,             // 0x0B DEC B
+  0x20, 0xF4,       // 0x0C JR NZ,$02
+  0x28, 0xF2,       // 0x0E JR Z,$02
+};
+
+
+#define BENCH_REPETITIONS 3          // Each result is the median of these.
+#define BENCH_CYCLES      100000000  // Per run of a whole program...
+#define BENCH_MICRO_CYCLES 20000000  // ...and of a loop over one kind of op.
+#define BENCH_CALLS       100000000
+#define BENCH_RESTORES    100000
+#define BENCH_BOOT_CYCLES 40000000   // A boot ROM that has not handed over by then never will.
+#define BENCH_BOOT_SLICE  1024
+
+// One timed run: how much work it did, and in how long.
+struct BenchSample {
+  uint64_t items;
+  double secs;
+};
+
+// Runs once and fills the sample, or returns why it cannot run.
+typedef function<string(BenchSample &)> BenchBody;
+
+struct BenchResult {
+  string name;
+  const char *unit;
+  uint64_t items;
+  double median, min, max;  // Seconds.
+};
+
+// Keeps whatever the CPU benchmarks compute, so it cannot be optimized out.
+static volatile uint64_t bench_sink;
+
+// Cleared by --no-blocks, so that the programs go through DISPATCH on every
+// instruction instead of the handlers cached in blocks.
+static bool bench_blocks = true;
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// `setup`, then `body` over and over in a loop on B.
+static vector<uint8_t> make_loop(const vector<uint8_t> &setup, const vector<uint8_t> &body) {
+  vector<uint8_t> program = setup;
+  program.push_back(0x06); // LD B,$00
+  program.push_back(0x00);
+  size_t loop = program.size();
+  program.insert(program.end(), body.begin(), body.end());
+  program.push_back(0x05); // DEC B
+  program.push_back(0x20); // JR NZ,loop
+  program.push_back(loop - (program.size() + 1));
+  program.push_back(0x28); // JR Z,loop
+  program.push_back(loop - (program.size() + 1));
+  return program;
+}
+
+static vector<uint8_t> repeat(const vector<uint8_t> &ops, int times) {
+  vector<uint8_t> body;
+  for (int i = 0; i < times; i++) body.insert(body.end(), ops.begin(), ops.end());
+  return body;
+}
+
+// Runs `program` from the boot ROM for `cycles`.
+static string run_program(const vector<uint8_t> &program, uint64_t cycles, bool jit, BenchSample &sample) {
+  unique_ptr<uint8_t[]> rom(new uint8_t[ROM_SIZE]);
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), program.data(), program.size());
+
+  unique_ptr<Environment> env(new Environment(move(rom)));
+  env->reset();
+  if (jit && !bench_blocks) return "the JIT needs blocks";
+  if (jit && !env->enable_jit(true)) return "JIT not available";
+  if (!bench_blocks) env->enable_blocks(false);
+
+  auto start = chrono::steady_clock::now();
+  env->run_for(cycles);
+  sample = { env->cycles(), seconds_since(start) };
+  return env->crash_message() ? env->crash_message() : "";
+}
+
+// The real boot ROM from rom.bin, up to the handoff to the cartridge at
+// 0x100. The cartridge is made up: the boot ROM only checks its logo, copied
+// from the boot ROM's own, and the header checksum.
+static string run_boot(BenchSample &sample) {
+  fstream rom_file("rom.bin", ios::binary | ios::in);
+  if (!rom_file) return "no rom.bin";
+  unique_ptr<uint8_t[]> rom(new uint8_t[ROM_SIZE]);
+  rom_file.read(reinterpret_cast<char *>(rom.get()), ROM_SIZE);
+
+  vector<uint8_t> image(2 * CART_BANK_SIZE, 0);
+  memcpy(&image[0x104], rom.get() + 0xA8, 48);
+  uint8_t sum = 0x19;
+  for (int addr = 0x134; addr < 0x14D; addr++) sum += image[addr];
+  image[0x14D] = -sum;
+
+  char cart_path[] = "/tmp/cppboy_bench_XXXXXX";
+  int fd = mkstemp(cart_path);
+  if (fd < 0) return "cannot write the cartridge";
+  bool written = write(fd, image.data(), image.size()) == (ssize_t) image.size();
+  close(fd);
+  Cartridge cart;
+  bool loaded = written && cart.load(cart_path);
+  unlink(cart_path);
+  if (!loaded) return "cannot load the cartridge";
+
+  unique_ptr<Environment> env(new Environment(move(rom)));
+  env->insert_cartridge(&cart);
+  env->reset();
+  auto start = chrono::steady_clock::now();
+  while (!env->peek_mem(ADDR_BOOT) && env->cycles() < BENCH_BOOT_CYCLES) {
+    if (!env->run_for(env->cycles() + BENCH_BOOT_SLICE)) break;
+  }
+  sample = { env->cycles(), seconds_since(start) };
+  if (env->crash_message()) return env->crash_message();
+  return env->peek_mem(ADDR_BOOT) ? "" : "no handoff";
+}
+
+static string run_step_dword_reg(BenchSample &sample) {
+  CPU cpu;
+  cpu.reg_h = cpu.reg_l = 0;
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < BENCH_CALLS; i++) cpu.step_dword_reg(&cpu.reg_h, &cpu.reg_l, (int) (i & 3) - 1);
+  sample = { BENCH_CALLS, seconds_since(start) };
+  bench_sink = cpu.hl();
+  return "";
+}
+
+// Seven calls per round.
+static string run_pair_accessors(BenchSample &sample) {
+  CPU cpu;
+  cpu.set_af(0);
+  cpu.set_bc(0);
+  cpu.set_de(0);
+  cpu.set_hl(0);
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < BENCH_CALLS; i++) {
+    cpu.set_bc(cpu.bc() + cpu.de());
+    cpu.set_de(cpu.hl() ^ i);
+    cpu.set_hl(cpu.af() + 1);
+  }
+  sample = { BENCH_CALLS * 7, seconds_since(start) };
+  bench_sink = cpu.bc();
+  return "";
+}
+
+// Save-state costs, as rewind and fuzzing pay them: restoring a full state,
+// and saving a delta after a frame of the boot loop.
+static string run_restore(bool delta, BenchSample &sample) {
+  unique_ptr<uint8_t[]> rom(new uint8_t[ROM_SIZE]);
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), boot_loop, sizeof(boot_loop));
+
+  unique_ptr<Environment> env(new Environment(move(rom)));
+  env->reset();
+  vector<uint8_t> state, changes;
+  env->save_state(state);
+  if (delta) env->run_for(70224);
+
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_RESTORES; i++) {
+    if (delta) {
+      env->save_delta(state, changes);
+    } else {
+      env->load_state(state);
+    }
+  }
+  sample = { BENCH_RESTORES, seconds_since(start) };
+  return "";
+}
+
+// Runs the benchmarks whose name contains the filter, and collects the
+// median of their repetitions.
+class BenchSuite {
+public:
+  BenchSuite(const string &_filter) : filter(_filter) {}
+
+  void run(const string &name, const char *unit, BenchBody body) {
+    if (name.find(filter) == string::npos) return;
+    vector<double> times;
+    BenchSample sample = { 0, 0 };
+    for (int i = 0; i < BENCH_REPETITIONS; i++) {
+      string error = body(sample);
+      if (!error.empty()) {
+        printf("%-26s skipped: %s\n", name.c_str(), error.c_str());
+        return;
+      }
+      times.push_back(sample.secs);
+    }
+    sort(times.begin(), times.end());
+    BenchResult result = { name, unit, sample.items, times[times.size() / 2], times.front(), times.back() };
+    results.push_back(result);
+    printf("%-26s %10.2f M%s/s, median %.3fs of %d", name.c_str(), result.items / result.median / 1e6, unit, result.median, BENCH_REPETITIONS);
+    if (strcmp(unit, "cycles") == 0) printf(" (%.1fx DMG speed)", result.items / result.median / 4194304.0);
+    printf("\n");
+  }
+
+  // Laid out like Google Benchmark's JSON, with times in ns for the whole
+  // run: the median, then the fastest and slowest repetition.
+  bool write_json(const string &path) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return false;
+    #ifdef DEBUG
+      const char *build = "debug";
+    #else
+      const char *build = "release";
+    #endif
+    #ifdef DISPATCH_TABLE
+      const char *dispatch = "table";
+    #else
+      const char *dispatch = "switch";
+    #endif
+    fprintf(out, "{\n  \"context\": {\"build\": \"%s\", \"dispatch\": \"%s\", \"blocks\": %s, \"num_cpus\": %u, \"repetitions\": %d},\n",
+      build, dispatch, bench_blocks ? "true" : "false", thread::hardware_concurrency(), BENCH_REPETITIONS);
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+      const BenchResult &result = results[i];
+      fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"items\": %lu, \"real_time\": %.0f, \"min_time\": %.0f, \"max_time\": %.0f, \"time_unit\": \"ns\", \"items_per_second\": %.0f}%s\n",
+        result.name.c_str(), result.unit, (unsigned long) result.items, result.median * 1e9, result.min * 1e9, result.max * 1e9,
+        result.items / result.median, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+  }
+
+private:
+  string filter;
+  vector<BenchResult> results;
+};
+
+// Usage: main bench [--json path] [--no-blocks] [filter]
+int run_bench(int argc, char **argv) {
+  const char *json_path = nullptr;
+  string filter;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--no-blocks") == 0) {
+      bench_blocks = false;
+    } else {
+      filter = argv[i];
+    }
+  }
+  BenchSuite suite(filter);
+
+  const struct { const char *name; const uint8_t *program; size_t size; bool jit; } programs[] = {
+    { "program/boot loop",     boot_loop, sizeof(boot_loop), false },
+    { "program/io loop",       io_loop,   sizeof(io_loop),   false },
+    { "program/flag loop",     flag_loop, sizeof(flag_loop), false },
+    { "program/alu loop",      alu_loop,  sizeof(alu_loop),  false },
+    { "program/alu loop, JIT", alu_loop,  sizeof(alu_loop),  true },
+  };
+  for (const auto &program : programs) {
+    vector<uint8_t> code(program.program, program.program + program.size);
+    bool jit = program.jit;
+    suite.run(program.name, "cycles", [=](BenchSample &sample) { return run_program(code, BENCH_CYCLES, jit, sample); });
+  }
+
+  // Dispatch by kind of opcode, eight at a time, none of them touching B.
+  const struct { const char *name; vector<uint8_t> setup, ops; } classes[] = {
+    { "dispatch/ld r,r",  {}, { 0x4A, 0x53, 0x5C, 0x65, 0x6F, 0x79, 0x4B, 0x57 } },
+    { "dispatch/alu r",   {}, { 0x81, 0x92, 0xA3, 0xAC, 0xB5, 0xB9, 0x8A, 0x9B } },
+    { "dispatch/alu d8",  {}, { 0xC6, 0x11, 0xD6, 0x22, 0xE6, 0x33, 0xEE, 0x44, 0xF6, 0x55, 0xFE, 0x66, 0xCE, 0x77, 0xDE, 0x88 } },
+    { "dispatch/inc r16", {}, { 0x13, 0x23, 0x1B, 0x2B, 0x13, 0x23, 0x1B, 0x2B } },
+    { "dispatch/cb",      {}, { 0xCB, 0x11, 0xCB, 0x7C, 0xCB, 0xDA, 0xCB, 0x9B, 0xCB, 0x3F, 0xCB, 0x37, 0xCB, 0x21, 0xCB, 0x0A } },
+    { "dispatch/stack",   { 0x31, 0xFE, 0xFF }, repeat({ 0xC5, 0xC1, 0xF5, 0xF1 }, 2) },
+    { "dispatch/jr",      {}, repeat({ 0x20, 0x00 }, 8) },
+  };
+  for (const auto &kind : classes) {
+    vector<uint8_t> code = make_loop(kind.setup, kind.ops);
+    suite.run(kind.name, "cycles", [=](BenchSample &sample) { return run_program(code, BENCH_MICRO_CYCLES, false, sample); });
+  }
+
+  // get_mem/set_mem through LD A,(HL) and LD (HL),A, region by region.
+  const struct { const char *name; uint16_t addr; } regions[] = {
+    { "rom", 0x0080 }, { "vram", 0x8000 }, { "cart_ram", 0xA000 }, { "wram", 0xC000 },
+    { "echo", 0xE000 }, { "oam", 0xFE00 }, { "io", ADDR_SCY }, { "hram", 0xFF90 },
+  };
+  for (int write = 0; write < 2; write++) {
+    for (const auto &region : regions) {
+      vector<uint8_t> setup = { 0x21, (uint8_t) (region.addr & 0xFF), (uint8_t) (region.addr >> 8) }; // LD HL,addr
+      vector<uint8_t> code = make_loop(setup, repeat({ (uint8_t) (write ? 0x77 : 0x7E) }, 8));
+      string name = string(write ? "bus/write " : "bus/read ") + region.name;
+      suite.run(name, "cycles", [=](BenchSample &sample) { return run_program(code, BENCH_MICRO_CYCLES, false, sample); });
+    }
+  }
+
+  // Reading TIMA brings the timer up to date first.
+  vector<uint8_t> timer_setup = {
+    0x3E, 0x05,       // LD A,$05
+    0xE0, 0x07,       // LDH (TAC),A: start, 16 cycles per increment
+    0x21, 0x05, 0xFF, // LD HL,TIMA
+  };
+  vector<uint8_t> timer_code = make_loop(timer_setup, repeat({ 0x7E }, 8));
+  suite.run("timer/read tima", "cycles", [=](BenchSample &sample) { return run_program(timer_code, BENCH_MICRO_CYCLES, false, sample); });
+
+  suite.run("cpu/step_dword_reg", "calls", run_step_dword_reg);
+  suite.run("cpu/pair accessors", "calls", run_pair_accessors);
+  suite.run("state/restore", "restores", [](BenchSample &sample) { return run_restore(false, sample); });
+  suite.run("state/delta", "saves", [](BenchSample &sample) { return run_restore(true, sample); });
+  suite.run("boot/to 0x100", "cycles", run_boot);
+
+  if (json_path) {
+    if (!suite.write_json(json_path)) {
+      ERR(printf("Cannot write %s", json_path));
+      return EXIT_FAILURE;
+    }
+    printf("Results written to %s\n", json_path);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+#include "blockcache.h"
+#include <algorithm>
+#include <cstring>
+#include "environment.h"
+#include "opcodes.h"
+
+using namespace std;
+
+// ROM, cartridge RAM and WRAM. VRAM and OAM are also written behind the
+// memory map (PPU, DMA) and HRAM bypasses it, so code there is interpreted.
+static bool cacheable_page(uint8_t page) {
+  return page < 0x80 || (page >= 0xA0 && page < 0xFE);
+}
+
+Environment::CodeGuard::CodeGuard(Environment *_env) : env(_env) {
+}
+
+// Guarded pages keep their read pointer, so reads never get here.
+uint8_t Environment::CodeGuard::read(uint16_t addr) {
+  return env->mem_read[addr >> 8][addr & 0xFF];
+}
+
+void Environment::CodeGuard::write(uint16_t addr, uint8_t val) {
+  // Only pages with a write pointer are guarded, and this puts it back.
+  env->unguard_page(addr >> 8);
+  env->mem_write[addr >> 8][addr & 0xFF] = val;
+}
+
+// The cache takes about 400 KiB, so it is only allocated on demand.
+void Environment::enable_blocks(bool on) {
+  if (on && !blocks) {
+    blocks.reset(new Block[BLOCK_SLOTS]);
+    for (size_t i = 0; i < BLOCK_SLOTS; i++) blocks[i].valid = false;
+    memset(page_blocks, 0, sizeof(page_blocks));
+    memset(code_write, 0, sizeof(code_write));
+    memset(code_invalidations, 0, sizeof(code_invalidations));
+  } else if (!on && blocks) {
+    for (int page = 0; page < 0x100; page++) unguard_page(page);
+    blocks.reset();
+  }
+}
+
+// Turns blocks on as well. Fails when the host cannot run generated code.
+bool Environment::enable_jit(bool on, bool check) {
+  if (on) {
+    enable_blocks(true);
+    if (!jit) jit.reset(new Jit());
+    if (!jit->ready()) {
+      jit.reset();
+      return false;
+    }
+    jit_check = check;
+  } else if (jit) {
+    jit.reset();
+    if (blocks) {
+      for (size_t i = 0; i < BLOCK_SLOTS; i++) blocks[i].native.code = nullptr;
+    }
+  }
+  return true;
+}
+
+// Runs the block at PC, or a single instruction where there is none, stopping
+// early at cycle `limit`. Returns the instructions executed, 0 when the CPU
+// stopped.
+//
+// This is step() with the opcode fetch and table lookup done ahead of time:
+// operands are still read by the handlers, from the cached fetch page.
+uint32_t Environment::run_block(uint64_t limit) {
+  if (irq_check || cpu.halted) return step();
+
+  Block *block = find_block(cpu.reg_pc);
+  if (!block) return step();
+
+  if (jit && block->hits < JIT_THRESHOLD && ++block->hits == JIT_THRESHOLD) compile_block(*block);
+
+  // Native code touches registers only, so it is exact as long as no event
+  // falls due before its last instruction.
+  uint32_t i = 0;
+  if (block->native.code && t + block->native.cycles <= min(sched.next, limit)) {
+    if (!run_native(*block)) return 0;
+    i = block->native.ops;
+    #ifdef STATS
+      stats.native_blocks++;
+      for (uint32_t j = 0; j < i; j++) stats.retire(block->ops[j].opcode);
+    #endif
+    if (t >= sched.next) run_events();
+    if (irq_check || t >= limit) return i;
+  }
+
+  STAT(stats.blocks++);
+  block_broken = false;
+  for (; i < block->count; i++) {
+    const BlockOp &op = block->ops[i];
+    uint8_t dur = 0;
+    cpu.reg_pc++;
+
+    #ifdef TRACE
+      trace.record(t, cpu.reg_pc - 1, op.opcode, cpu);
+    #endif
+
+    (this->*op.handler)(&dur);
+    if (crashed) return 0;
+    STAT(stats.retire(op.opcode));
+
+    t += dur;
+    if (t >= sched.next) run_events();
+    // An interrupt may be due, or the block overwrote its own code.
+    if (irq_check || block_broken || t >= limit) return i + 1;
+  }
+  return block->count;
+}
+
+Block *Environment::find_block(uint16_t pc) {
+  Block &block = blocks[pc & (BLOCK_SLOTS - 1)];
+  if (block.valid && block.start == pc) return &block;
+
+  uint8_t page = pc >> 8;
+  const uint8_t *mem = mem_read[page];
+  if (!mem || !cacheable_page(page) || watch_kinds[page] || code_invalidations[page] >= BLOCK_MAX_INVALIDATIONS) return nullptr;
+
+  // Decode up to the end of the page; an instruction whose operands run
+  // into the next page ends the block before it.
+  uint8_t count = 0;
+  uint16_t offs = pc & 0xFF;
+  while (count < BLOCK_MAX_OPS) {
+    uint8_t op = mem[offs];
+    const OpInfo &info = op_info[op];
+    if (offs + info.length > 0x100) break;
+    block.ops[count++] = { ops[op], op };
+    offs += info.length;
+    if (info.attrs || offs == 0x100) break;
+  }
+  if (!count) return nullptr;
+
+  if (block.valid) page_blocks[block.start >> 8]--;
+  block.start = pc;
+  block.count = count;
+  block.valid = true;
+  block.hits = 0;
+  block.native.code = nullptr;
+  page_blocks[page]++;
+  if (mem_write[page]) guard_page(page);
+  return &block;
+}
+
+// Takes the write pointer away from the page and every alias of it (echo RAM).
+void Environment::guard_page(uint8_t page) {
+  uint8_t *write = mem_write[page];
+  for (int other = 0; other < 0x100; other++) {
+    if (mem_write[other] != write) continue;
+    code_write[other] = write;
+    code_handler[other] = mem_handler[other];
+    mem_write[other] = nullptr;
+    mem_handler[other] = &code_guard;
+  }
+}
+
+void Environment::unguard_page(uint8_t page) {
+  uint8_t *write = code_write[page];
+  if (!write) return;
+  for (int other = 0; other < 0x100; other++) {
+    if (code_write[other] != write) continue;
+    mem_write[other] = write;
+    mem_handler[other] = code_handler[other];
+    code_write[other] = nullptr;
+    drop_blocks(other);
+    code_invalidations[other]++;
+  }
+}
+
+// Blocks of page p sit in the 256 slots its low address bits select.
+void Environment::drop_blocks(uint8_t page) {
+  if (!page_blocks[page]) return;
+  Block *slots = &blocks[(page << 8) & (BLOCK_SLOTS - 1)];
+  for (int i = 0; i < 0x100; i++) {
+    if (slots[i].valid && slots[i].start >> 8 == page) slots[i].valid = false;
+  }
+  page_blocks[page] = 0;
+  block_broken = true;
+}
+
+// A full code buffer is flushed, which takes the code of every block with it.
+void Environment::compile_block(Block &block) {
+  if (jit->full()) {
+    jit->flush();
+    for (size_t i = 0; i < BLOCK_SLOTS; i++) blocks[i].native.code = nullptr;
+  }
+  uint8_t offs = block.start & 0xFF;
+  jit->compile(mem_read[block.start >> 8] + offs, 0x100 - offs, block.count, block.native);
+}
+
+// In check mode the same instructions are then run again from the same state
+// by the interpreter, and any difference stops the CPU.
+bool Environment::run_native(const Block &block) {
+  const JitBlock &native = block.native;
+  if (!jit_check) {
+    native.code(&cpu);
+    cpu.reg_pc += native.bytes;
+    t += native.cycles;
+    return true;
+  }
+
+  CPU before = cpu;
+  native.code(&cpu);
+  CPU after = cpu;
+  cpu = before;
+
+  uint32_t cycles = 0;
+  for (uint32_t i = 0; i < native.ops; i++) {
+    uint8_t dur = 0;
+    cpu.reg_pc++;
+    (this->*block.ops[i].handler)(&dur);
+    if (crashed) return false;
+    cycles += dur;
+  }
+  t += cycles;
+
+  if (after.reg_a != cpu.reg_a || after.f() != cpu.f() ||
+      after.reg_b != cpu.reg_b || after.reg_c != cpu.reg_c ||
+      after.reg_d != cpu.reg_d || after.reg_e != cpu.reg_e ||
+      after.reg_h != cpu.reg_h || after.reg_l != cpu.reg_l ||
+      before.reg_pc + native.bytes != cpu.reg_pc || cycles != native.cycles) {
+    crash("JIT mismatch in the block at 0x%.4x: AF %.2x%.2x/%.2x%.2x BC %.2x%.2x/%.2x%.2x DE %.2x%.2x/%.2x%.2x HL %.2x%.2x/%.2x%.2x, %u/%u cycles",
+      block.start, after.reg_a, after.f(), cpu.reg_a, cpu.f(), after.reg_b, after.reg_c, cpu.reg_b, cpu.reg_c,
+      after.reg_d, after.reg_e, cpu.reg_d, cpu.reg_e, after.reg_h, after.reg_l, cpu.reg_h, cpu.reg_l,
+      native.cycles, cycles);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include "jit.h"
+
+using namespace std;
+
+class Environment;
+
+typedef void (Environment::*OpHandler)(uint8_t *);
+
+#define BLOCK_SLOTS    1024  // Direct-mapped on the start address.
+#define BLOCK_MAX_OPS  16
+#define BLOCK_MAX_INVALIDATIONS 8  // Per page, then its code is interpreted.
+
+// A straight run of instructions, decoded once: the handler of every opcode,
+// up to and including the first one that may jump, halt or stop (see
+// opcodes.h).
+//
+// Blocks never cross a page and only come from ROM, cartridge RAM and WRAM,
+// whose contents change either through the memory map (bank switches) or
+// through writes into a RAM page. A RAM page that holds cached code is mapped
+// without its write pointer, so the first write takes the slow path, drops
+// the page's blocks and restores the pointer.
+//
+// With the JIT on, a block that ran JIT_THRESHOLD times gets native code for
+// its leading register-only instructions, dropped along with the block.
+struct BlockOp {
+  OpHandler handler;
+  uint8_t opcode;
+};
+
+struct Block {
+  uint16_t start;
+  uint8_t count;
+  bool valid;
+  uint16_t hits;     // Runs, counted up to JIT_THRESHOLD.
+  JitBlock native;   // Code is null when not compiled.
+  BlockOp ops[BLOCK_MAX_OPS];
+};
@@ -0,0 +1,274 @@
+#include "cartridge.h"
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "environment.h"
+#include "defines.h"
+
+using namespace std;
+
+Cartridge::Cartridge() : mbc(Mbc::None), env(nullptr), rom(nullptr), rom_map_size(0), rom_banks(0), ram_banks(0),
+  ram_enabled(false), bank_lo(1), bank_hi(0), ram_bank(0), mode(false), rtc_latch(0xFF) {
+  memset(rtc, 0, sizeof(rtc));
+  memset(rtc_latched, 0, sizeof(rtc_latched));
+  rtc_base = time(nullptr);
+}
+
+Cartridge::~Cartridge() {
+  if (rom) munmap(rom, rom_map_size);
+}
+
+// Only once: the environment's memory map points into the mapped ROM.
+bool Cartridge::load(const string &path) {
+  if (rom) {
+    ERR(printf("Cannot load %s over the cartridge already loaded", path.c_str()));
+    return false;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ERR(printf("Cannot open cartridge %s", path.c_str()));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < CART_ADDR_RAM_SIZE + 1 || st.st_size > CART_MAX_ROM_SIZE) {
+    ERR(printf("Cartridge %s has an invalid size", path.c_str()));
+    close(fd);
+    return false;
+  }
+  size_t file_size = st.st_size;
+
+  uint8_t header[CART_ADDR_RAM_SIZE + 1];
+  if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+    ERR(printf("Cannot read the header of %s", path.c_str()));
+    close(fd);
+    return false;
+  }
+
+  uint8_t type = header[CART_ADDR_TYPE];
+  switch (type) {
+    case 0x00: case 0x08: case 0x09:
+      mbc = Mbc::None; break;
+    case 0x01: case 0x02: case 0x03:
+      mbc = Mbc::Mbc1; break;
+    case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+      mbc = Mbc::Mbc3; break;
+    case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+      mbc = Mbc::Mbc5; break;
+    default:
+      ERR(printf("Unsupported cartridge type 0x%.2x", type));
+      close(fd);
+      return false;
+  }
+
+  // The bank count is a power of two so bank numbers can be masked. Take the
+  // larger of the header and the file, as some dumps are trimmed.
+  rom_banks = 2;
+  if (header[CART_ADDR_ROM_SIZE] <= 8) rom_banks <<= header[CART_ADDR_ROM_SIZE];
+  while (rom_banks * CART_BANK_SIZE < file_size) rom_banks <<= 1;
+  rom_map_size = rom_banks * CART_BANK_SIZE;
+
+  // Reserve the whole bank range as zero pages, then map the file over its
+  // start, so banks past the end of a short file read as 0 instead of faulting.
+  void *area = mmap(nullptr, rom_map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (area == MAP_FAILED || mmap(area, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    ERR(printf("Cannot map cartridge %s", path.c_str()));
+    if (area != MAP_FAILED) munmap(area, rom_map_size);
+    close(fd);
+    return false;
+  }
+  close(fd);
+  rom = (uint8_t *) area;
+
+  switch (header[CART_ADDR_RAM_SIZE]) {
+    case 0x01: case 0x02: ram_banks = 1; break;
+    case 0x03: ram_banks = 4; break;
+    case 0x04: ram_banks = 16; break;
+    case 0x05: ram_banks = 8; break;
+    default: ram_banks = 0;
+  }
+  ram.assign(ram_banks * CART_RAM_BANK_SIZE, 0);
+
+  title = string((const char *) header + CART_ADDR_TITLE, 16);
+  title = title.substr(0, title.find('\0'));
+
+  LOG_INFO(printf("Cartridge \"%s\": type 0x%.2x, %zu ROM banks, %zu RAM banks\n", title.c_str(), type, rom_banks, ram_banks));
+  return true;
+}
+
+void Cartridge::attach(Environment *_env) {
+  env = _env;
+}
+
+void Cartridge::save_state(State &state) {
+  state.rtc_base = rtc_base;
+  state.bank_lo = bank_lo;
+  state.bank_hi = bank_hi;
+  state.ram_bank = ram_bank;
+  state.ram_enabled = ram_enabled;
+  state.mode = mode;
+  memcpy(state.rtc, rtc, sizeof(rtc));
+  memcpy(state.rtc_latched, rtc_latched, sizeof(rtc_latched));
+  state.rtc_latch = rtc_latch;
+}
+
+void Cartridge::load_state(const State &state) {
+  rtc_base = state.rtc_base;
+  bank_lo = state.bank_lo;
+  bank_hi = state.bank_hi;
+  ram_bank = state.ram_bank;
+  ram_enabled = state.ram_enabled;
+  mode = state.mode;
+  memcpy(rtc, state.rtc, sizeof(rtc));
+  memcpy(rtc_latched, state.rtc_latched, sizeof(rtc_latched));
+  rtc_latch = state.rtc_latch;
+}
+
+uint8_t *Cartridge::ram_data() {
+  return ram.data();
+}
+
+size_t Cartridge::ram_size() {
+  return ram.size();
+}
+
+// Points the whole cartridge area of the memory map at the current banks.
+void Cartridge::map() {
+  map_rom0();
+  map_rom();
+  map_ram();
+}
+
+// Bank 0 only moves in MBC1 mode 1. It is remapped separately from the
+// switchable bank, and page 0 is left alone while the boot ROM is over it.
+void Cartridge::map_rom0() {
+  size_t bank = 0;
+  if (mbc == Mbc::Mbc1 && mode) bank = (bank_hi << 5) & (rom_banks - 1);
+  size_t skip = env->boot_rom_mapped() ? 0x100 : 0;
+  env->map_mem(skip, CART_BANK_SIZE - skip, rom + bank * CART_BANK_SIZE + skip, nullptr, this);
+}
+
+void Cartridge::map_rom() {
+  size_t bank = 1;
+  if (mbc == Mbc::Mbc1) {
+    bank = (bank_hi << 5) | bank_lo;
+  } else if (mbc != Mbc::None) {
+    bank = bank_lo;
+  }
+  bank &= rom_banks - 1;
+  env->map_mem(0x4000, CART_BANK_SIZE, rom + bank * CART_BANK_SIZE, nullptr, this);
+}
+
+void Cartridge::map_ram() {
+  size_t bank = ram_bank;
+  if (mbc == Mbc::Mbc1) bank = mode ? bank_hi : 0;
+
+  // MBC3 clock registers are selected through the RAM bank register.
+  bool rtc_selected = mbc == Mbc::Mbc3 && ram_bank >= 0x08;
+
+  if (ram_enabled && ram_banks > 0 && !rtc_selected) {
+    uint8_t *mem = ram.data() + (bank % ram_banks) * CART_RAM_BANK_SIZE;
+    env->map_mem(0xA000, CART_RAM_BANK_SIZE, mem, mem, this);
+  } else {
+    env->map_mem(0xA000, CART_RAM_BANK_SIZE, nullptr, nullptr, this);
+  }
+}
+
+// Only reached for disabled RAM and the MBC3 clock; ROM and enabled RAM are
+// mapped directly.
+uint8_t Cartridge::read(uint16_t addr) {
+  if (addr >= 0xA000 && ram_enabled && mbc == Mbc::Mbc3 && ram_bank >= 0x08 && ram_bank <= 0x0C) {
+    return rtc_latched[ram_bank - 0x08];
+  }
+  return 0xFF;
+}
+
+void Cartridge::write(uint16_t addr, uint8_t val) {
+  if (addr >= 0xA000) {
+    if (ram_enabled && mbc == Mbc::Mbc3 && ram_bank >= 0x08 && ram_bank <= 0x0C) {
+      sync_rtc();
+      rtc[ram_bank - 0x08] = val;
+    }
+    return;
+  }
+
+  switch (mbc) {
+    case Mbc::None:
+      return;
+
+    case Mbc::Mbc1:
+      if (addr < 0x2000) {
+        ram_enabled = (val & 0x0F) == 0x0A;
+      } else if (addr < 0x4000) {
+        bank_lo = val & 0x1F;
+        if (bank_lo == 0) bank_lo = 1;
+      } else if (addr < 0x6000) {
+        bank_hi = val & 0x03;
+      } else {
+        mode = val & 0x01;
+      }
+      break;
+
+    case Mbc::Mbc3:
+      if (addr < 0x2000) {
+        ram_enabled = (val & 0x0F) == 0x0A;
+      } else if (addr < 0x4000) {
+        bank_lo = val & 0x7F;
+        if (bank_lo == 0) bank_lo = 1;
+      } else if (addr < 0x6000) {
+        ram_bank = val;
+      } else {
+        if (rtc_latch == 0x00 && val == 0x01) {
+          sync_rtc();
+          memcpy(rtc_latched, rtc, sizeof(rtc));
+        }
+        rtc_latch = val;
+      }
+      break;
+
+    case Mbc::Mbc5:
+      if (addr < 0x2000) {
+        ram_enabled = (val & 0x0F) == 0x0A;
+      } else if (addr < 0x3000) {
+        bank_lo = (bank_lo & 0x100) | val;
+      } else if (addr < 0x4000) {
+        bank_lo = (bank_lo & 0xFF) | ((val & 0x01) << 8);
+      } else if (addr < 0x6000) {
+        ram_bank = val & 0x0F;
+      }
+      break;
+  }
+
+  if (addr < 0x2000) {
+    map_ram();
+  } else if (addr < 0x4000) {
+    map_rom();
+  } else if (mbc == Mbc::Mbc1) {
+    map();
+  } else if (addr < 0x6000) {
+    map_ram();
+  }
+}
+
+// Advances the clock registers by the wall time elapsed since rtc_base.
+void Cartridge::sync_rtc() {
+  time_t now = time(nullptr);
+  time_t elapsed = now - rtc_base;
+  rtc_base = now;
+  if (ISBITN(rtc[4], 6) || elapsed <= 0) return; // Halted.
+
+  uint64_t days = rtc[3] | (BITN(rtc[4], 0) << 8);
+  uint64_t secs = rtc[0] + rtc[1] * 60 + rtc[2] * 3600 + days * 86400 + elapsed;
+
+  rtc[0] = secs % 60;
+  rtc[1] = secs / 60 % 60;
+  rtc[2] = secs / 3600 % 24;
+  days = secs / 86400;
+  if (days > 0x1FF) rtc[4] |= 0x80; // Day counter carry.
+  rtc[3] = days & 0xFF;
+  rtc[4] = (rtc[4] & 0xFE) | ((days >> 8) & 0x01);
+}
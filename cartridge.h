@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "memory.h"
+
+using namespace std;
+
+class Environment;
+
+#define CART_MAX_ROM_SIZE 0x800000 // 8 MiB, the largest MBC5 image.
+#define CART_BANK_SIZE    0x4000
+#define CART_RAM_BANK_SIZE 0x2000
+
+#define CART_ADDR_TITLE    0x134
+#define CART_ADDR_TYPE     0x147
+#define CART_ADDR_ROM_SIZE 0x148
+#define CART_ADDR_RAM_SIZE 0x149
+
+enum class Mbc {
+  None,
+  Mbc1,
+  Mbc3,
+  Mbc5,
+};
+
+// Game cartridge: the ROM image and the memory bank controller.
+//
+// The ROM is mmap-ed read-only, never copied. The MBC keeps the bank
+// registers and, when they change, points the environment's memory map at the
+// selected banks, so reads from 0x0000-0x7FFF and 0xA000-0xBFFF are plain
+// loads. Writes into ROM and accesses to disabled RAM or the MBC3 clock reach
+// this class through the handler slot.
+class Cartridge : public MemHandler {
+public:
+  Cartridge();
+  ~Cartridge();
+
+  bool load(const string &);  // Fails if a ROM is loaded already.
+  void attach(Environment *);
+  void map();
+
+  uint8_t read(uint16_t);
+  void write(uint16_t, uint8_t);
+
+  // Bank and clock registers, as kept in save states. The RAM is saved as
+  // memory pages.
+  struct State {
+    int64_t rtc_base;
+    uint16_t bank_lo;
+    uint8_t bank_hi;
+    uint8_t ram_bank;
+    uint8_t ram_enabled;
+    uint8_t mode;
+    uint8_t rtc[5];
+    uint8_t rtc_latched[5];
+    uint8_t rtc_latch;
+  };
+  void save_state(State &);
+  void load_state(const State &);  // Call map() afterwards.
+  uint8_t *ram_data();
+  size_t ram_size();
+
+  string title;
+  Mbc mbc;
+
+private:
+  Environment *env;
+
+  uint8_t *rom;
+  size_t rom_map_size;
+  size_t rom_banks;
+  vector<uint8_t> ram;
+  size_t ram_banks;
+
+  // Bank registers as last written by the game.
+  bool ram_enabled;
+  uint16_t bank_lo;  // ROM bank number (low 5 bits on MBC1).
+  uint8_t bank_hi;   // MBC1 2-bit upper bank register.
+  uint8_t ram_bank;  // RAM bank, or MBC3 clock register 0x08-0x0C.
+  bool mode;         // MBC1 banking mode.
+
+  // MBC3 real time clock: seconds, minutes, hours, days low, days high/flags.
+  // rtc holds the clock as of rtc_base and is brought up to date on access.
+  uint8_t rtc[5];
+  uint8_t rtc_latched[5];
+  uint8_t rtc_latch;
+  time_t rtc_base;
+
+  void map_rom0();
+  void map_rom();
+  void map_ram();
+  void sync_rtc();
+};
@@ -0,0 +1,205 @@
+#include "condition.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include "environment.h"
+
+using namespace std;
+
+// Pairs first, so that "AF" is not read as A followed by F.
+static const char *const reg_names[] = {
+  "AF", "BC", "DE", "HL", "SP", "PC", "A", "F", "B", "C", "D", "E", "H", "L",
+};
+
+static uint16_t reg_value(CPU &cpu, uint8_t reg) {
+  switch (reg) {
+    case 0:  return cpu.af();
+    case 1:  return cpu.bc();
+    case 2:  return cpu.de();
+    case 3:  return cpu.hl();
+    case 4:  return cpu.reg_sp;
+    case 5:  return cpu.reg_pc;
+    case 6:  return cpu.reg_a;
+    case 7:  return cpu.f();
+    case 8:  return cpu.reg_b;
+    case 9:  return cpu.reg_c;
+    case 10: return cpu.reg_d;
+    case 11: return cpu.reg_e;
+    case 12: return cpu.reg_h;
+    default: return cpu.reg_l;
+  }
+}
+
+Condition::Condition() : pos(nullptr), depth(0), max_depth(0), nesting(0) {
+}
+
+bool Condition::empty() const {
+  return code.empty();
+}
+
+// An empty or blank string compiles to the condition that always holds.
+bool Condition::compile(const string &text) {
+  source = text;
+  error.clear();
+  code.clear();
+  pos = source.c_str();
+  depth = max_depth = 0;
+  nesting = 0;
+
+  skip_space();
+  if (!*pos) return true;
+  if (!parse_or()) {
+    code.clear();
+    return false;
+  }
+  skip_space();
+  if (*pos) {
+    code.clear();
+    return fail("unexpected text");
+  }
+  return true;
+}
+
+bool Condition::test(CPU &cpu, Environment *env) const {
+  if (code.empty()) return true;
+
+  uint32_t stack[COND_STACK];
+  int top = -1;
+  for (size_t i = 0; i < code.size(); i++) {
+    uint32_t rhs;
+    switch (code[i]) {
+      case Const: stack[++top] = code[i + 1] | code[i + 2] << 8; i += 2; continue;
+      case Reg:   stack[++top] = reg_value(cpu, code[++i]); continue;
+      case Mem:   stack[top] = env->peek_mem(stack[top]); continue;
+      case Not:   stack[top] = !stack[top]; continue;
+    }
+    rhs = stack[top--];
+    switch (code[i]) {
+      case Eq:  stack[top] = stack[top] == rhs; break;
+      case Ne:  stack[top] = stack[top] != rhs; break;
+      case Lt:  stack[top] = stack[top] < rhs; break;
+      case Le:  stack[top] = stack[top] <= rhs; break;
+      case Gt:  stack[top] = stack[top] > rhs; break;
+      case Ge:  stack[top] = stack[top] >= rhs; break;
+      case And: stack[top] = stack[top] && rhs; break;
+      case Or:  stack[top] = stack[top] || rhs; break;
+    }
+  }
+  return stack[0];
+}
+
+void Condition::skip_space() {
+  while (isspace(*pos)) pos++;
+}
+
+bool Condition::accept(const char *token) {
+  skip_space();
+  size_t len = strlen(token);
+  if (strncmp(pos, token, len) != 0) return false;
+  pos += len;
+  return true;
+}
+
+// `change` is what the op does to the stack depth.
+void Condition::emit(uint8_t op, int change) {
+  code.push_back(op);
+  depth += change;
+  if (depth > max_depth) max_depth = depth;
+}
+
+bool Condition::fail(const char *message) {
+  error = string(message) + " at \"" + pos + "\"";
+  return false;
+}
+
+bool Condition::parse_or() {
+  if (!parse_and()) return false;
+  while (accept("||")) {
+    if (!parse_and()) return false;
+    emit(Or, -1);
+  }
+  return true;
+}
+
+bool Condition::parse_and() {
+  if (!parse_compare()) return false;
+  while (accept("&&")) {
+    if (!parse_compare()) return false;
+    emit(And, -1);
+  }
+  return true;
+}
+
+// Two-character operators come first, so that "<=" is not read as "<".
+bool Condition::parse_compare() {
+  static const struct { const char *token; Op op; } compares[] = {
+    { "==", Eq }, { "!=", Ne }, { "<=", Le }, { ">=", Ge }, { "<", Lt }, { ">", Gt },
+  };
+  if (!parse_operand()) return false;
+  for (const auto &compare : compares) {
+    if (accept(compare.token)) {
+      if (!parse_operand()) return false;
+      emit(compare.op, -1);
+      break;
+    }
+  }
+  return true;
+}
+
+// Operands nest through parse_or, so the depth is capped to keep the
+// recursion off the end of the stack.
+bool Condition::parse_operand() {
+  if (nesting == COND_NESTING) return fail("too deeply nested");
+  nesting++;
+  bool parsed = parse_term();
+  nesting--;
+  return parsed;
+}
+
+bool Condition::parse_term() {
+  skip_space();
+  if (accept("!")) {
+    if (!parse_operand()) return false;
+    emit(Not, 0);
+    return true;
+  }
+  if (accept("(")) {
+    if (!parse_or()) return false;
+    return accept(")") || fail("missing )");
+  }
+  if (accept("[")) {
+    if (!parse_or()) return false;
+    emit(Mem, 0);
+    return accept("]") || fail("missing ]");
+  }
+
+  if (isdigit(*pos) || *pos == '$') {
+    int base = 10;
+    if (*pos == '$') {
+      pos++;
+      base = 16;
+    } else if (pos[0] == '0' && (pos[1] == 'x' || pos[1] == 'X')) {
+      pos += 2;
+      base = 16;
+    }
+    char *end;
+    unsigned long val = strtoul(pos, &end, base);
+    if (end == pos || val > 0xFFFF) return fail("bad number");
+    pos = end;
+    emit(Const, 1);
+    code.push_back(val & 0xFF);
+    code.push_back(val >> 8);
+  } else {
+    uint8_t reg = 0;
+    for (; reg < sizeof(reg_names) / sizeof(reg_names[0]); reg++) {
+      size_t len = strlen(reg_names[reg]);
+      if (strncasecmp(pos, reg_names[reg], len) == 0 && !isalnum(pos[len])) break;
+    }
+    if (reg == sizeof(reg_names) / sizeof(reg_names[0])) return fail("expected a register or a number");
+    pos += strlen(reg_names[reg]);
+    emit(Reg, 1);
+    code.push_back(reg);
+  }
+  return max_depth <= COND_STACK || fail("too deeply nested");
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "cpu.h"
+
+using namespace std;
+
+class Environment;
+
+#define COND_STACK 16    // Deepest the evaluation stack may get.
+#define COND_NESTING 64  // Deepest the parser may recurse through !, ( and [.
+
+// Predicate over the machine, such as "A==0x10 && HL>0xC000", compiled once
+// into bytecode for a small stack machine and evaluated on every hit of the
+// breakpoint or watchpoint it belongs to.
+//
+// Operands are the registers (A F B C D E H L AF BC DE HL SP PC), numbers
+// (0x10, $10 or 16) and bytes of memory as [expr]. They combine with
+// == != < <= > >=, !, && and || and parentheses, as in C.
+class Condition {
+public:
+  Condition();
+  bool compile(const string &);
+  bool test(CPU &, Environment *) const;  // An empty condition always holds.
+  bool empty() const;
+
+  string source;
+  string error;  // Why compile() failed.
+
+private:
+  enum Op : uint8_t {
+    Const,  // Followed by the 16-bit value.
+    Reg,    // Followed by the register index.
+    Mem,
+    Not,
+    Eq, Ne, Lt, Le, Gt, Ge,
+    And, Or,
+  };
+
+  vector<uint8_t> code;
+
+  // Parser state.
+  const char *pos;
+  int depth, max_depth;
+  int nesting;  // Operands being parsed.
+
+  void skip_space();
+  bool accept(const char *);
+  void emit(uint8_t, int);
+  bool parse_or();
+  bool parse_and();
+  bool parse_compare();
+  bool parse_operand();
+  bool parse_term();
+  bool fail(const char *);
+};
@@ -0,0 +1,225 @@
+#include "conform.h"
+#include "environment.h"
+#include "defines.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const struct {
+  const char *name;
+  uint8_t CPU::*reg;
+} conform_regs[] = {
+  { "a", &CPU::reg_a }, { "b", &CPU::reg_b }, { "c", &CPU::reg_c }, { "d", &CPU::reg_d },
+  { "e", &CPU::reg_e }, { "h", &CPU::reg_h }, { "l", &CPU::reg_l },
+};
+
+// The field as an integer, -1 when missing.
+static int field(const JsonValue &state, const char *name) {
+  const JsonValue *value = state.get(name);
+  if (!value) return -1;
+  return value->type == JsonValue::Bool ? value->boolean : (int) value->number;
+}
+
+static void compare(string &diff, const char *name, int expected, int actual) {
+  if (expected < 0 || expected == actual) return;
+  char text[48];
+  snprintf(text, sizeof(text), "%s%s 0x%x (expected 0x%x)", diff.empty() ? "" : "; ", name, actual, expected);
+  diff += text;
+}
+
+ConformanceRunner::ConformanceRunner() : ram(new uint8_t[MEM_SIZE]), env(new Environment(nullptr)) {
+  memset(ram.get(), 0, MEM_SIZE);
+  reset();
+}
+
+ConformanceRunner::~ConformanceRunner() {
+}
+
+void ConformanceRunner::reset() {
+  env->reset();
+  env->map_mem(0, MEM_SIZE, ram.get(), ram.get());
+}
+
+void ConformanceRunner::clear_ram(const JsonValue &state) {
+  const JsonValue *cells = state.get("ram");
+  if (!cells) return;
+  for (const JsonValue &cell : cells->items) {
+    if (cell.items.size() == 2) ram[(uint16_t) cell.items[0].number] = 0;
+  }
+}
+
+bool ConformanceRunner::run(const JsonValue &test, string &diff) {
+  diff.clear();
+  const JsonValue *initial = test.get("initial"), *final = test.get("final"), *cycles = test.get("cycles");
+  if (!initial || !final) {
+    diff = "no initial or final state";
+    return false;
+  }
+
+  CPU &cpu = env->registers();
+  for (const auto &reg : conform_regs) cpu.*reg.reg = field(*initial, reg.name);
+  cpu.set_f(field(*initial, "f"));
+  cpu.reg_pc = field(*initial, "pc");
+  cpu.reg_sp = field(*initial, "sp");
+  cpu.ime = field(*initial, "ime") > 0;
+  cpu.ime_pending = field(*initial, "ei") > 0;
+  cpu.halted = false;
+  const JsonValue *cells = initial->get("ram");
+  if (cells) {
+    for (const JsonValue &cell : cells->items) {
+      if (cell.items.size() == 2) ram[(uint16_t) cell.items[0].number] = cell.items[1].number;
+    }
+  }
+  if (field(*initial, "ie") >= 0) ram[ADDR_IE] = field(*initial, "ie");
+
+  uint64_t start = env->cycles();
+  bool stepped = env->step();
+  if (!stepped) {
+    diff = env->crash_message();
+  } else {
+    for (const auto &reg : conform_regs) compare(diff, reg.name, field(*final, reg.name), cpu.*reg.reg);
+    compare(diff, "f", field(*final, "f"), cpu.f());
+    compare(diff, "pc", field(*final, "pc"), cpu.reg_pc);
+    compare(diff, "sp", field(*final, "sp"), cpu.reg_sp);
+    compare(diff, "ime", field(*final, "ime"), cpu.ime);
+    compare(diff, "ei", field(*final, "ei"), cpu.ime_pending);
+    compare(diff, "ie", field(*final, "ie"), ram[ADDR_IE]);
+    cells = final->get("ram");
+    if (cells) {
+      for (const JsonValue &cell : cells->items) {
+        if (cell.items.size() != 2) continue;
+        uint16_t addr = cell.items[0].number;
+        char name[16];
+        snprintf(name, sizeof(name), "[0x%.4x]", addr);
+        compare(diff, name, cell.items[1].number, ram[addr]);
+      }
+    }
+    if (cycles) compare(diff, "cycles", 4 * cycles->items.size(), env->cycles() - start);
+  }
+
+  clear_ram(*initial);
+  clear_ram(*final);
+  ram[ADDR_IE] = 0;
+  if (!stepped) reset();
+  return diff.empty();
+}
+
+struct ConformJob {
+  string path;
+
+  // Filled in by the worker.
+  size_t total;
+  size_t passed;
+  string failure;  // The first one.
+};
+
+static void run_job(ConformJob &job, ConformanceRunner &runner) {
+  ifstream file(job.path);
+  stringstream text;
+  text << file.rdbuf();
+  JsonValue tests;
+  string error;
+  if (!file || !parse_json(text.str(), tests, error)) {
+    job.failure = file ? error : "cannot read";
+    return;
+  }
+  if (tests.type != JsonValue::Array) {
+    job.failure = "not an array of tests";
+    return;
+  }
+
+  string diff;
+  for (const JsonValue &test : tests.items) {
+    job.total++;
+    if (runner.run(test, diff)) {
+      job.passed++;
+    } else if (job.failure.empty()) {
+      const JsonValue *name = test.get("name");
+      job.failure = (name ? name->text : "#" + to_string(job.total)) + ": " + diff;
+    }
+  }
+}
+
+// The .json files of a directory, by name, or the path itself.
+static void add_paths(const string &path, vector<string> &paths) {
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    paths.push_back(path);
+    return;
+  }
+  vector<string> names;
+  while (dirent *entry = readdir(dir)) {
+    string name = entry->d_name;
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0) names.push_back(path + "/" + name);
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+  paths.insert(paths.end(), names.begin(), names.end());
+}
+
+// Usage: main conform [-j threads] [-v] <file or directory>...
+//
+// Files run in parallel, one ConformanceRunner per worker thread. Files with
+// failures are listed with their first failure; -v lists the passing files
+// too.
+int run_conform(int argc, char **argv) {
+  unsigned int threads = thread::hardware_concurrency();
+  bool verbose = false;
+  vector<string> paths;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      add_paths(argv[i], paths);
+    }
+  }
+  if (paths.empty()) {
+    printf("Usage: %s conform [-j threads] [-v] <file or directory>...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (threads == 0) threads = 1;
+
+  vector<ConformJob> jobs(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) jobs[i] = { paths[i], 0, 0, "" };
+
+  atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    ConformanceRunner runner;
+    for (size_t i = next_job++; i < jobs.size(); i = next_job++) run_job(jobs[i], runner);
+  };
+
+  auto start = chrono::steady_clock::now();
+  vector<thread> pool;
+  for (unsigned int i = 0; i < threads && i < jobs.size(); i++) pool.emplace_back(worker);
+  for (thread &th : pool) th.join();
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  size_t total = 0, passed = 0, failed_files = 0;
+  for (const ConformJob &job : jobs) {
+    total += job.total;
+    passed += job.passed;
+    bool failed = job.passed < job.total || !job.failure.empty();
+    if (failed) failed_files++;
+    if (failed || verbose) {
+      printf("%s: %zu/%zu passed%s%s\n", job.path.c_str(), job.passed, job.total,
+        job.failure.empty() ? "" : ", ", job.failure.c_str());
+    }
+  }
+  printf("%zu files, %zu/%zu tests passed in %.2fs on %u threads, %zu files failing\n",
+    jobs.size(), passed, total, secs, threads, failed_files);
+
+  return failed_files ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "json.h"
+
+using namespace std;
+
+class Environment;
+
+// Runs single-step test vectors, as laid out by the SM83 SingleStepTests:
+// one file per opcode ("00.json" ... "cb ff.json"), each an array of
+//
+//   { "name": ..., "initial": state, "final": state, "cycles": [...] }
+//
+// where a state has the registers a b c d e f h l pc sp, ime, optionally ie
+// and ei (EI pending), and "ram" as [address, value] pairs; "cycles" has an
+// entry per machine cycle.
+//
+// Every test steps one instruction of an Environment whose whole address
+// space is mapped to plain RAM, so that I/O registers are plain bytes too.
+class ConformanceRunner {
+public:
+  ConformanceRunner();
+  ~ConformanceRunner();
+  bool run(const JsonValue &, string &);  // Fails with the differences.
+
+private:
+  unique_ptr<uint8_t[]> ram;
+  unique_ptr<Environment> env;
+
+  void reset();
+  void clear_ram(const JsonValue &);
+};
+
+int run_conform(int, char **);
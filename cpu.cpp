@@ -1,17 +1,17 @@
 #include "cpu.h"
 #include <iostream>
 #include "util.h"
+#include "defines.h"
 
 using namespace std;
 
 CPU::CPU() {
-  cout << "CPU has been created" << endl;
 }
 
 void CPU::dump_registers() {
   printf("  ┏━━━━━┳━━━━━┓\n");
-  printf(" A┃%5d┃%5d┃F=[", reg_a, reg_f);
-  dump_bin(reg_f);
+  printf(" A┃%5d┃%5d┃F=[", reg_a, f());
+  dump_bin(f());
   printf("]\n");
   printf(" B┃%5d┃%5d┃C\n", reg_b, reg_c);
   printf(" D┃%5d┃%5d┃E\n", reg_d, reg_e);
@@ -21,6 +21,13 @@ void CPU::dump_registers() {
   printf("  ┗━━━━━┻━━━━━┛\n");
 }
 
+void CPU::set_f(uint8_t val) {
+  flag_z = !ISBITN(val, BITFZ);
+  flag_n = ISBITN(val, BITFN);
+  flag_h = BITN(val, BITFH) << 4;
+  flag_c = BITN(val, BITFC) << 8;
+}
+
 void CPU::step_dword_reg(uint8_t *high, uint8_t *low, int step) {
   uint16_t val = *high << 8 | *low;
   val += step;
@@ -28,16 +35,16 @@ void CPU::step_dword_reg(uint8_t *high, uint8_t *low, int step) {
   *high = (val >> 8) & 0xFF;
 }
 
-void CPU::inc_af() { step_dword_reg(&reg_a, &reg_f,  1); }
+void CPU::inc_af() { set_af(af() + 1); }
 void CPU::inc_bc() { step_dword_reg(&reg_b, &reg_c,  1); }
 void CPU::inc_de() { step_dword_reg(&reg_d, &reg_e,  1); }
 void CPU::inc_hl() { step_dword_reg(&reg_h, &reg_l,  1); }
-void CPU::dec_af() { step_dword_reg(&reg_a, &reg_f, -1); }
+void CPU::dec_af() { set_af(af() - 1); }
 void CPU::dec_bc() { step_dword_reg(&reg_b, &reg_c, -1); }
 void CPU::dec_de() { step_dword_reg(&reg_d, &reg_e, -1); }
 void CPU::dec_hl() { step_dword_reg(&reg_h, &reg_l, -1); }
 
-uint16_t CPU::af() { return reg_a << 8 | reg_f; }
+uint16_t CPU::af() { return reg_a << 8 | f(); }
 uint16_t CPU::bc() { return reg_b << 8 | reg_c; }
 uint16_t CPU::de() { return reg_d << 8 | reg_e; }
 uint16_t CPU::hl() { return reg_h << 8 | reg_l; }
@@ -47,7 +54,10 @@ void CPU::set_reg_pair(uint8_t *reg_hi, uint8_t *reg_lo, uint16_t val) {
   *reg_lo = val & 0xFF;
 }
 
-void CPU::set_af(uint16_t val) { set_reg_pair(&reg_a, &reg_f, val); }
+void CPU::set_af(uint16_t val) {
+  reg_a = val >> 8;
+  set_f(val & 0xF0);
+}
 void CPU::set_bc(uint16_t val) { set_reg_pair(&reg_b, &reg_c, val); }
 void CPU::set_de(uint16_t val) { set_reg_pair(&reg_d, &reg_e, val); }
 void CPU::set_hl(uint16_t val) { set_reg_pair(&reg_h, &reg_l, val); }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include "defines.h"
 
 using namespace std;
 
@@ -14,14 +15,32 @@ public:
   // Bit 5 represents the half-carry flag.  It is set when a carry from bit 3 is produced in arithmetical instructions.  Otherwise it is cleared.  It has a very common use, that is, for the DAA (decimal adjust) instruction.  Games used it extensively for displaying decimal values on the screen.
   // Bit 6 represents the subtract flag.  When the instruction is a subtraction this bit is set.  Otherwise (the instruction is an addition) it is cleared.
   // Bit 7 represents the zero flag.  It is set when the instruction results in a value of 0.  Otherwise (result different to 0) it is cleared.
-  uint8_t reg_a, reg_f, // F bits: Z(7) zero, N(6) substract, H(5) half carry, C(4) carry.
+  //
+  // F is evaluated lazily: instructions only store the raw values the flags
+  // derive from and f() builds the register when something actually reads it.
+  uint8_t reg_a,
           reg_b, reg_c,
           reg_d, reg_e,
           reg_h, reg_l;
 
+  uint8_t  flag_z; // Z is set when this is 0 (usually the last result).
+  bool     flag_n;
+  uint16_t flag_h; // H is bit 4: lhs ^ rhs ^ result of the last add/sub.
+  uint16_t flag_c; // C is bit 8: the 9-bit result of the last add/sub/shift.
+
   uint16_t reg_sp, reg_pc;
 
+  bool ime;         // Interrupt master enable.
+  bool ime_pending; // EI was executed, IME is set after the next instruction.
+  bool halted;      // HALT or STOP, until an interrupt is pending.
+
   void dump_registers();
+
+  uint8_t f();
+  void set_f(uint8_t);
+  bool zero_flag();
+  bool carry_flag();
+
   void step_dword_reg(uint8_t *, uint8_t *, int);
   void inc_af();
   void inc_bc();
@@ -43,3 +62,13 @@ public:
   void set_de(uint16_t);
   void set_hl(uint16_t);
 };
+
+inline bool CPU::zero_flag() { return flag_z == 0; }
+inline bool CPU::carry_flag() { return flag_c & 0x100; }
+
+inline uint8_t CPU::f() {
+  return (flag_z == 0) << BITFZ |
+         flag_n << BITFN |
+         ((flag_h >> 4) & 0b1) << BITFH |
+         ((flag_c >> 8) & 0b1) << BITFC;
+}
@@ -1,36 +1,146 @@
 #include "debugger.h"
+#include "environment.h"
+#include "opcodes.h"
 #include "util.h"
 #include "defines.h"
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
 
 using namespace std;
 
-Debugger::Debugger(uint8_t *_ptr_env_mem) :
-  ptr_env_mem(_ptr_env_mem),
+#define DEBUG_POLL chrono::milliseconds(1)
+#define CONSOLE_POLL_MS 100 // How soon the console notices the emulation is over.
+#define PROFILE_REPORT_SIZE 10
+
+Debugger::Debugger(Environment *_env) :
+  env(_env),
+  attention(true),
+  handled(0),
+  closed(false),
+  stopped(false),
+  quit(false),
   cond_cycle_stop(0),
   cond_step_by_step(false),
-  cond_step_counter(0)
+  cond_step_counter(0),
+  breakpoint_count(0),
+  run_to(-1),
+  run_to_added(false),
+  watch_hit(-1),
+  watch_addr(0),
+  watch_kind(0)
 {
-  cout << "Debugger has been created\n";
+  memset(breakpoints, 0, sizeof(breakpoints));
+}
+
+// Console thread: reads commands until the end of the input, a quit or the
+// end of the emulation, each one only once the emulation ran the one before,
+// so their output stays in order.
+void Debugger::console() {
+  string line;
+  uint64_t sent = 0;
+  while (read_line(line)) {
+    DebugRequest request = parse_line(line);
+    while (!requests.push(request)) {
+      if (stopped) return;
+      this_thread::sleep_for(DEBUG_POLL);
+    }
+    attention = true;
+    sent++;
+    if (request.command == Quit) return;
+    while (handled < sent && !stopped) this_thread::sleep_for(DEBUG_POLL);
+  }
+  closed = true;
+  attention = true;
+}
+
+// Called once the emulation returned, so that console() does too.
+void Debugger::stop() {
+  stopped = true;
+}
+
+// A line of the standard input, without its newline. Polls rather than
+// blocks so that it gives up once the emulation is over.
+bool Debugger::read_line(string &line) {
+  for (;;) {
+    size_t end = input.find('\n');
+    if (end != string::npos) {
+      line = input.substr(0, end);
+      input.erase(0, end + 1);
+      return true;
+    }
+    if (stopped) return false;
+
+    pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+    int ready = poll(&fd, 1, CONSOLE_POLL_MS);
+    if (ready < 0 && errno != EINTR) return false;
+    if (ready <= 0) continue;
+
+    char buffer[256];
+    ssize_t size = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR) continue;
+    if (size <= 0) {
+      // The last line may have no newline.
+      if (input.empty()) return false;
+      line.swap(input);
+      input.clear();
+      return true;
+    }
+    input.append(buffer, size);
+  }
 }
 
-bool Debugger::prompt() {
-  string s;
-  BOLD(cout << "DBG>> ");
-  getline(cin, s);
+// Emulation thread, between two instructions: runs the queued commands, and
+// when a stop condition holds waits for commands until one resumes.
+bool Debugger::service(uint64_t cycle, CPU &cpu) {
+  DebugRequest request;
+  while (requests.pop(request)) {
+    run_request(request, cycle, cpu);
+    handled++;
+  }
+  if (quit) return false;
+
+  if (should_stop(cycle, cpu)) {
+    BOLD(cout << "DBG>> " << flush);
+    for (;;) {
+      if (!requests.pop(request)) {
+        if (closed) break;
+        this_thread::sleep_for(DEBUG_POLL);
+        continue;
+      }
+      bool resume = run_request(request, cycle, cpu);
+      handled++;
+      if (quit) return false;
+      if (resume) break;
+      BOLD(cout << "DBG>> " << flush);
+    }
+  }
 
-  DebugCommand command = parse_command(s);
-  uint16_t addr;
+  update_attention(cycle);
+  return true;
+}
+
+// Returns whether the command resumes a stopped CPU.
+bool Debugger::run_request(const DebugRequest &request, uint64_t cycle, CPU &cpu) {
+  uint16_t addr = request.arg;
   uint8_t val;
-  switch (command) {
+  size_t frames, count;
+  char text[32];
+  switch (request.command) {
     case Quit:
-      exit(EXIT_SUCCESS);
+      quit = true;
+      return true;
 
     case Cycle:
-    cond_step_by_step = false;
-      cond_cycle_stop = parse_param<size_t>(s, 1);
+      cond_step_by_step = false;
+      cond_cycle_stop = request.arg;
       cout << "Cycle stop set at " << cond_cycle_stop << endl;
       return false;
 
@@ -40,44 +150,151 @@ bool Debugger::prompt() {
       return false;
 
     case Step:
-    cond_step_by_step = false;
-      cond_step_counter = parse_param<size_t>(s, 1);
+      cond_step_by_step = false;
+      cond_step_counter = request.arg;
       cout << "Step " << cond_step_counter << endl;
       return true;
 
-    case Dump:
-      cond_dump = true;
+    case Dump: {
+      uint8_t bytes[3];
+      for (int j = 0; j < 3; j++) bytes[j] = env->peek_mem(cpu.reg_pc + j);
+      disassemble(bytes, cpu.reg_pc, text, sizeof(text));
+      printf("CMD 0x%.2x @ 0x%.2x (%d) CYCLE %lu: %s\n", bytes[0], cpu.reg_pc, cpu.reg_pc, (unsigned long) cycle, text);
+      cpu.dump_registers();
       return false;
+    }
 
     case PC:
-    cond_step_by_step = false;
-      cond_pc = parse_param<uint16_t>(s, 1, true);
+      cond_step_by_step = false;
+      end_run_to();
+      run_to_added = !(breakpoints[addr >> 6] >> (addr & 63) & 1);
+      if (run_to_added) add_breakpoint(addr, "");
+      run_to = addr;
       return true;
 
+    case Break:
+      if (add_breakpoint(addr, request.rest)) printf("Breakpoint at 0x%.4x\n", addr);
+      return false;
+
+    case BreakDelete:
+      delete_breakpoint(addr);
+      return false;
+
+    case BreakList:
+      list_breakpoints();
+      return false;
+
+    case Watch:
+      add_watchpoint(request);
+      return false;
+
+    case WatchDelete:
+      watch_hit = -1;
+      for (size_t i = 0; i < watchpoints.size();) {
+        if (watchpoints[i].start == addr) {
+          watchpoints.erase(watchpoints.begin() + i);
+        } else {
+          i++;
+        }
+      }
+      update_watched_pages();
+      return false;
+
     case MemRead:
-      addr = parse_param<uint16_t>(s, 1, true);
       printf("M[0x%x] => 0b", addr);
-      val = ptr_env_mem[addr];
+      val = env->peek_mem(addr);
       dump_bin(val);
       printf(" 0x%x %d\n", val, val);
       return false;
 
+    case Trace:
+      if (env->save_trace(request.path)) cout << "Trace written to " << request.path << endl;
+      return false;
+
+    case Back:
+      frames = request.arg ? request.arg : REWIND_FRAME_RATE;
+      if (env->rewind_frames(frames)) {
+        cout << "Rewound " << frames << " frames to cycle " << env->cycles() << endl;
+      } else {
+        cout << "Cannot rewind " << frames << " frames" << endl;
+      }
+      return false;
+
+    // prof on|off, or prof [path] for the hot spots and the folded stacks.
+    case Profile:
+      if (request.path == "on" || request.path == "off") {
+        bool on = request.path == "on";
+        if (env->enable_profiler(on)) {
+          cout << "Profiler is " << request.path << endl;
+        } else {
+          cout << "Profiler not built in" << endl;
+        }
+      } else if (!env->report_profile(stdout, PROFILE_REPORT_SIZE)) {
+        cout << "Profiler is off" << endl;
+      } else if (!request.path.empty()) {
+        if (env->save_profile(request.path)) cout << "Folded stacks written to " << request.path << endl;
+      }
+      return false;
+
+    case Counters:
+      if (request.path.empty()) {
+        if (!env->write_stats(stdout)) cout << "Counters not built in" << endl;
+      } else if (env->save_stats(request.path)) {
+        cout << "Counters written to " << request.path << endl;
+      }
+      return false;
+
+    case List:
+      count = request.arg2 ? request.arg2 : 8;
+      for (size_t i = 0; i < count; i++) {
+        uint8_t bytes[3];
+        for (int j = 0; j < 3; j++) bytes[j] = env->peek_mem(addr + j);
+        size_t length = disassemble(bytes, addr, text, sizeof(text));
+        printf("0x%.4x  %s\n", addr, text);
+        addr += length;
+      }
+      return false;
+
     default:
       return true;
   }
 }
 
-bool Debugger::should_stop(uint64_t cycle, uint8_t op, uint16_t pc) {
+bool Debugger::should_stop(uint64_t cycle, CPU &cpu) {
+  // Without a console nobody could resume the CPU.
+  if (closed) return false;
+
+  if (watch_hit >= 0) {
+    const Watchpoint &watch = watchpoints[watch_hit];
+    watch_hit = -1;
+    if (watch.condition.test(cpu, env)) {
+      printf("Watchpoint: %s 0x%.4x\n", watch_kind == WATCH_READ ? "read" : "write", watch_addr);
+      cond_step_by_step = true;
+      return true;
+    }
+  }
+
   if (cond_step_by_step) return true;
 
   if (cond_cycle_stop == cycle) {
     cond_step_by_step = true;
     return true;
   }
-  if (cond_pc == pc) {
+
+  uint16_t pc = cpu.reg_pc;
+  if (pc == run_to) {
+    end_run_to();
     cond_step_by_step = true;
     return true;
   }
+  if (breakpoints[pc >> 6] >> (pc & 63) & 1) {
+    auto condition = break_conditions.find(pc);
+    if (condition == break_conditions.end() || condition->second.test(cpu, env)) {
+      printf("Breakpoint: 0x%.4x\n", pc);
+      cond_step_by_step = true;
+      return true;
+    }
+  }
 
   if (cond_step_counter > 0) {
     cond_step_counter--;
@@ -90,17 +307,151 @@ bool Debugger::should_stop(uint64_t cycle, uint8_t op, uint16_t pc) {
   return false;
 }
 
-bool Debugger::should_dump() {
-  if (cond_dump) {
-    cond_dump = false;
-    return true;
+// The flag is cleared before the queue is checked: a command pushed in
+// between sets it again after the push.
+void Debugger::update_attention(uint64_t cycle) {
+  if (closed) {
+    attention = false;
+  } else {
+    bool armed = cond_step_by_step || cond_cycle_stop > cycle || cond_step_counter > 0;
+    if (armed) return;
+    attention = false;
+  }
+  if (!requests.empty()) attention = true;
+}
+
+// Called by the memory map during the access, in the middle of an
+// instruction: the stop waits for the next service().
+void Debugger::watch_access(uint16_t addr, uint8_t kind) {
+  for (size_t i = 0; i < watchpoints.size(); i++) {
+    const Watchpoint &watch = watchpoints[i];
+    if ((watch.kinds & kind) && addr >= watch.start && addr <= watch.end) {
+      watch_hit = i;
+      watch_addr = addr;
+      watch_kind = kind;
+      attention = true;
+      return;
+    }
+  }
+}
+
+void Debugger::set_break_bit(uint16_t addr) {
+  if (!(breakpoints[addr >> 6] >> (addr & 63) & 1)) breakpoint_count++;
+  breakpoints[addr >> 6] |= 1ULL << (addr & 63);
+}
+
+void Debugger::clear_break_bit(uint16_t addr) {
+  if (breakpoints[addr >> 6] >> (addr & 63) & 1) breakpoint_count--;
+  breakpoints[addr >> 6] &= ~(1ULL << (addr & 63));
+}
+
+bool Debugger::add_breakpoint(uint16_t addr, const string &text) {
+  Condition condition;
+  if (!condition.compile(text)) {
+    printf("Bad condition: %s\n", condition.error.c_str());
+    return false;
+  }
+  set_break_bit(addr);
+  if (addr == run_to) run_to_added = false;  // Kept once the pc command is done.
+  if (condition.empty()) {
+    break_conditions.erase(addr);
+  } else {
+    break_conditions[addr] = condition;
+  }
+  return true;
+}
+
+void Debugger::delete_breakpoint(uint16_t addr) {
+  break_conditions.erase(addr);
+  if (addr == run_to) {
+    run_to_added = true;  // The pc command still stops there.
+  } else {
+    clear_break_bit(addr);
+  }
+}
+
+void Debugger::end_run_to() {
+  if (run_to >= 0 && run_to_added) clear_break_bit(run_to);
+  run_to = -1;
+}
+
+// w <start>[-<end>] [r|w|rw] [condition]
+void Debugger::add_watchpoint(const DebugRequest &request) {
+  Watchpoint watch;
+  watch.start = request.arg;
+  size_t dash = request.path.find('-');
+  watch.end = dash == string::npos ? watch.start : strtoul(request.path.c_str() + dash + 1, nullptr, 16);
+  watch.kinds = WATCH_WRITE;
+
+  string text = request.rest;
+  size_t space = text.find(' ');
+  string word = text.substr(0, space);
+  if (word == "r" || word == "w" || word == "rw") {
+    watch.kinds = (word != "w" ? WATCH_READ : 0) | (word != "r" ? WATCH_WRITE : 0);
+    text = space == string::npos ? "" : text.substr(space + 1);
+  }
+  if (watch.end < watch.start) {
+    printf("Bad range: %s\n", request.path.c_str());
+    return;
+  }
+  if (!watch.condition.compile(text)) {
+    printf("Bad condition: %s\n", watch.condition.error.c_str());
+    return;
+  }
+  this->watch(watch);
+  printf("Watchpoint at 0x%.4x-0x%.4x\n", watch.start, watch.end);
+}
+
+void Debugger::watch(const Watchpoint &watch) {
+  watchpoints.push_back(watch);
+  update_watched_pages();
+}
+
+void Debugger::update_watched_pages() {
+  uint8_t kinds[0x100] = {};
+  for (const Watchpoint &watch : watchpoints) {
+    for (int page = watch.start >> 8; page <= watch.end >> 8; page++) kinds[page] |= watch.kinds;
+  }
+  for (int page = 0; page < 0x100; page++) env->watch_page(page, kinds[page]);
+}
+
+void Debugger::list_breakpoints() {
+  for (int word = 0; word < 0x10000 / 64; word++) {
+    for (uint64_t bits = breakpoints[word]; bits; bits &= bits - 1) {
+      uint16_t addr = word * 64 + __builtin_ctzll(bits);
+      if (addr == run_to && run_to_added) continue;
+      auto condition = break_conditions.find(addr);
+      printf("Breakpoint 0x%.4x %s\n", addr, condition == break_conditions.end() ? "" : condition->second.source.c_str());
+    }
+  }
+  for (const Watchpoint &watch : watchpoints) {
+    printf("Watchpoint 0x%.4x-0x%.4x %s%s %s\n", watch.start, watch.end,
+      watch.kinds & WATCH_READ ? "r" : "", watch.kinds & WATCH_WRITE ? "w" : "", watch.condition.source.c_str());
   }
-  return false;
 }
 
-DebugCommand Debugger::parse_command(string in) {
-  string command = parse_param<string>(in, 0);
+DebugRequest Debugger::parse_line(const string &line) {
+  istringstream iss(line);
+  string word;
+  DebugRequest request = { Nop, 0, 0, "", "" };
 
+  if (!(iss >> word)) return request;
+  request.command = parse_command(word);
+
+  bool hex = request.command == MemRead || request.command == PC || request.command == List ||
+    request.command == Break || request.command == BreakDelete || request.command == Watch || request.command == WatchDelete;
+  int base = hex ? 16 : 10;
+  if (iss >> word) {
+    request.path = word;
+    request.arg = strtoull(word.c_str(), nullptr, base);
+    getline(iss >> ws, request.rest);
+    request.arg2 = strtoull(request.rest.c_str(), nullptr, 10);
+  }
+  if (request.command == Trace && request.path.empty()) request.path = "trace.bin";
+  return request;
+}
+
+DebugCommand Debugger::parse_command(const string &command) {
   if (command == "q" || command == "quit" || command == "exit") {
     return Quit;
   } else if (command == "c" || command == "cycle") {
@@ -115,25 +466,27 @@ DebugCommand Debugger::parse_command(string in) {
     return MemRead;
   } else if (command == "pc") {
     return PC;
+  } else if (command == "t" || command == "trace") {
+    return Trace;
+  } else if (command == "r" || command == "rewind") {
+    return Back;
+  } else if (command == "l" || command == "list") {
+    return List;
+  } else if (command == "b" || command == "break") {
+    return Break;
+  } else if (command == "bd") {
+    return BreakDelete;
+  } else if (command == "bl") {
+    return BreakList;
+  } else if (command == "w" || command == "watch") {
+    return Watch;
+  } else if (command == "wd") {
+    return WatchDelete;
+  } else if (command == "prof" || command == "profile") {
+    return Profile;
+  } else if (command == "stats") {
+    return Counters;
   } else {
     return Nop;
   }
 }
-
-template<typename T>
-T Debugger::parse_param(string in, size_t idx, bool as_hex) {
-  istringstream iss(in);
-
-  for (int i = 0; i < idx; i++) {
-    string cmd;
-    iss >> cmd;
-  }
-
-  T out;
-  if (as_hex) {
-    iss >> hex >> out;
-  } else {
-    iss >> out;
-  }
-  return out;
-}
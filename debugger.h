@@ -1,9 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
+#include "condition.h"
+#include "cpu.h"
+#include "spscqueue.h"
 
 using namespace std;
 
+class Environment;
+
 enum DebugCommand {
   Nop,
   Cycle,
@@ -13,26 +22,112 @@ enum DebugCommand {
   Dump,
   MemRead,
   PC,
+  Trace,
+  Back,
+  List,
+  Break,
+  BreakDelete,
+  BreakList,
+  Watch,
+  WatchDelete,
+  Profile,
+  Counters,
+};
+
+// A command line, parsed once by the console thread.
+struct DebugRequest {
+  DebugCommand command;
+  uint64_t arg;   // Parameters, 0 when missing. Addresses are hex.
+  uint64_t arg2;
+  string path;
+  string rest;    // What follows the first parameter.
+};
+
+#define WATCH_READ  0x01
+#define WATCH_WRITE 0x02
+
+struct Watchpoint {
+  uint16_t start, end;  // Inclusive.
+  uint8_t kinds;
+  Condition condition;
 };
 
+#define DEBUG_QUEUE_SIZE 16
+
+// Interactive debugger. The console thread reads and parses commands and
+// queues them; the emulation thread runs them between two instructions,
+// since only it may touch the machine.
+//
+// The emulation loop only tests `attention`, which is set while a command is
+// queued or a stop condition other than a breakpoint is armed, and the
+// breakpoint bit of the PC, and calls service() then. Quit goes
+// through the queue too: service() fails and the loop returns, then the
+// console thread is told to stop() and joined. While traps() is false the
+// loop runs whole basic blocks between two tests.
+//
+// PC breakpoints are bits of a 64 Ki-bit map. Watchpoints put the pages they
+// cover behind a handler slot (see Environment::watch_page), so accesses to
+// other pages keep the fast path; a hit is noted during the access and the
+// CPU stops once the instruction is done. Both may carry a Condition.
 class Debugger {
 public:
-  Debugger(uint8_t *);
-  bool prompt();
-  bool should_stop(uint64_t, uint8_t, uint16_t);
-  bool should_dump();
+  Debugger(Environment *);
+  void console();
+  void stop();
+  inline bool pending(uint16_t);
+  inline bool traps();
+  bool service(uint64_t, CPU &);  // Fails once the console quit.
+  void watch_access(uint16_t, uint8_t);
+  void watch(const Watchpoint &);  // As the watch command, without its message.
 
 private:
-  DebugCommand parse_command(string);
-
-  uint8_t *ptr_env_mem;
+  Environment *env;
 
-  template<typename T>
-  T parse_param(string, size_t, bool as_hex = false);
+  SpscQueue<DebugRequest, DEBUG_QUEUE_SIZE> requests;
+  atomic<bool>     attention;
+  atomic<uint64_t> handled;  // Requests run so far.
+  atomic<bool>     closed;   // The console reached the end of its input.
+  atomic<bool>     stopped;  // The emulation is over.
+  string           input;    // Console thread only: read but not yet parsed.
 
-  size_t   cond_cycle_stop;
+  // Emulation thread only.
+  bool     quit;
+  uint64_t cond_cycle_stop;
   bool     cond_step_by_step;
-  size_t   cond_step_counter;
-  bool     cond_dump;
-  uint16_t cond_pc;
+  uint64_t cond_step_counter;
+
+  uint64_t breakpoints[0x10000 / 64];
+  uint32_t breakpoint_count;  // Bits set in breakpoints.
+  int      run_to;        // Where the pc command stops once, -1 for none.
+  bool     run_to_added;  // Its breakpoint goes away with it.
+  map<uint16_t, Condition> break_conditions;
+  vector<Watchpoint> watchpoints;
+  int      watch_hit;  // Index of the watchpoint last hit, -1 for none.
+  uint16_t watch_addr;
+  uint8_t  watch_kind;
+
+  bool read_line(string &);
+  static DebugRequest parse_line(const string &);
+  static DebugCommand parse_command(const string &);
+  bool should_stop(uint64_t, CPU &);
+  bool run_request(const DebugRequest &, uint64_t, CPU &);
+  void update_attention(uint64_t);
+  void set_break_bit(uint16_t);
+  void clear_break_bit(uint16_t);
+  bool add_breakpoint(uint16_t, const string &);
+  void delete_breakpoint(uint16_t);
+  void end_run_to();
+  void add_watchpoint(const DebugRequest &);
+  void update_watched_pages();
+  void list_breakpoints();
 };
+
+inline bool Debugger::pending(uint16_t pc) {
+  return attention.load(memory_order_relaxed) || (breakpoints[pc >> 6] >> (pc & 63) & 1);
+}
+
+// Whether the debugger may have to stop before any instruction, so that the
+// emulation has to single-step.
+inline bool Debugger::traps() {
+  return attention.load(memory_order_relaxed) || breakpoint_count || !watchpoints.empty();
+}
@@ -2,17 +2,32 @@
 
 #define ROM_SIZE 0x100
 
+#define CYCLE_NEVER UINT64_MAX // Deadline of an event that is not scheduled.
+
 #define ADDR_IE 0xFFFF // Interrupt enable.
 #define ADDR_IF 0xFF0F // Interrupt flag.
 #define ADDR_VIDEO_START 0x8000
 #define ADDR_VIDEO_END   0x9FFF
 #define ADDR_LCDC 0xFF40 // RW
 #define ADDR_STAT 0xFF41 // RW
+#define ADDR_SCY  0xFF42 // RW
+#define ADDR_SCX  0xFF43 // RW
+#define ADDR_LY   0xFF44 // R
+#define ADDR_LYC  0xFF45 // RW
+#define ADDR_DMA  0xFF46 // W
+#define ADDR_BGP  0xFF47 // RW
+#define ADDR_OBP0 0xFF48 // RW
+#define ADDR_OBP1 0xFF49 // RW
+#define ADDR_WY   0xFF4A // RW
+#define ADDR_WX   0xFF4B // RW
+#define ADDR_SB   0xFF01 // RW
+#define ADDR_SC   0xFF02 // RW
 #define ADDR_DIV  0xFF04 // RW
 #define ADDR_TAC  0xFF07 // RW
 #define ADDR_TMA  0xFF06 // RW
 #define ADDR_TIMA 0xFF05 // RW
-#define ADDR_IF   0xFF0F
+#define ADDR_BOOT 0xFF50 // W, unmaps the boot ROM.
+#define ADDR_HRAM 0xFF80
 
 #define SHELL_TXT_ERROR     "\033[1m\033[101m "
 #define SHELL_TXT_RESET     " \033[0m"
@@ -21,6 +36,13 @@
 #define ERR(x) printf(SHELL_TXT_ERROR); x; printf(SHELL_TXT_RESET_NL)
 #define BOLD(x) printf(SHELL_TXT_BOLD); x; printf(SHELL_TXT_RESET)
 
+// Bits of IE and IF.
+#define INT_VBLANK 0
+#define INT_STAT   1
+#define INT_TIMER  2
+#define INT_SERIAL 3
+#define INT_JOYPAD 4
+
 #define BITN(v, n) (((v) >> (n)) & 0b1)
 #define ISBITN(v, n) (BITN(v, n) == 1)
 
@@ -29,11 +51,36 @@
 #define BITFH 5
 #define BITFC 4
 
-#define LOG_LEVEL_DEBUG
-#define LOG_LEVEL_INFO
-// #define LOG_LEVEL_NOTICE
+// Build configuration, switched off from the Makefile variants (or DEFS):
+// -DQUIET for no log output, -DNO_DEBUG for no interactive debugger and
+// -DNO_TRACE for no instruction trace, -DNO_PROFILER for no guest profiler,
+// -DNO_STATS for no host counters. -DLOG_LEVEL_NOTICE adds more logs.
+#ifndef QUIET
+  #define LOG_LEVEL_DEBUG
+  #define LOG_LEVEL_INFO
+#endif
+
+#ifndef NO_DEBUG
+  #define DEBUG
+#endif
+
+#ifndef NO_TRACE
+  #define TRACE
+#endif
 
-#define DEBUG
+#ifndef NO_PROFILER
+  #define PROFILER
+#endif
+
+#ifndef NO_STATS
+  #define STATS
+#endif
+
+#ifdef STATS
+  #define STAT(f) f
+#else
+  #define STAT(f) void()
+#endif
 
 #ifdef LOG_LEVEL_DEBUG
   #define LOG_DEBUG(f) f
@@ -1,30 +1,100 @@
 #include "environment.h"
+#include "cartridge.h"
 #include <iostream>
+#include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <thread>
+#include "opcodes.h"
 #include "util.h"
 
 using namespace std;
 
-Environment::Environment(unique_ptr<uint8_t> && _rom) : cpu({}), rom(move(_rom)), dbg((mem)) {
-  cout << "Environment has been created" << endl;
+// Opcodes are dispatched through a switch over the ops/ops_cb handler tables.
+// The tables are constant, so the optimizer can turn each case into a direct,
+// inlinable call. Building with -DDISPATCH_TABLE calls through the tables
+// instead.
+#ifdef DISPATCH_TABLE
+  #define DISPATCH(table, cmd, dur) (this->*table[cmd])(dur)
+#else
+  #define OP_CASE(n, table, dur) case (n): (this->*table[(n)])(dur); break;
+  #define OP_CASES_4(n, table, dur) OP_CASE(n, table, dur) OP_CASE((n) + 1, table, dur) OP_CASE((n) + 2, table, dur) OP_CASE((n) + 3, table, dur)
+  #define OP_CASES_16(n, table, dur) OP_CASES_4(n, table, dur) OP_CASES_4((n) + 4, table, dur) OP_CASES_4((n) + 8, table, dur) OP_CASES_4((n) + 12, table, dur)
+  #define OP_CASES_64(n, table, dur) OP_CASES_16(n, table, dur) OP_CASES_16((n) + 16, table, dur) OP_CASES_16((n) + 32, table, dur) OP_CASES_16((n) + 48, table, dur)
+  #define DISPATCH(table, cmd, dur) switch (cmd) { OP_CASES_64(0, table, dur) OP_CASES_64(64, table, dur) OP_CASES_64(128, table, dur) OP_CASES_64(192, table, dur) }
+#endif
+
+Environment::Environment(unique_ptr<uint8_t[]> && _rom) : cpu({}), rom(move(_rom)), cart(nullptr), dbg(this), stats_frame(0), rewind_frame(0), ppu(vram, oam, io),
+  watch_guard(this), block_broken(false), code_guard(this), jit_check(false) {
+  memset(watch_kinds, 0, sizeof(watch_kinds));
+  stats.clear();
+  enable_blocks(true);
+}
+
+void Environment::insert_cartridge(Cartridge *_cart) {
+  cart = _cart;
+  cart->attach(this);
 }
 
 void Environment::reset() {
-  cout << "Reset" << endl;
+  memset(vram, 0, sizeof(vram));
+  memset(wram, 0, sizeof(wram));
+  memset(oam, 0, sizeof(oam));
+  memset(io, 0, sizeof(io));
 
-  for (size_t i = 0; i < MEM_SIZE; i++) {
-    mem[i] = 0;
-  }
+  reset_mem_map();
 
+  cpu.reg_a = cpu.reg_b = cpu.reg_c = cpu.reg_d = cpu.reg_e = cpu.reg_h = cpu.reg_l = 0;
+  cpu.set_f(0);
+  cpu.reg_sp = 0;
   cpu.reg_pc = 0;
+  cpu.ime = false;
+  cpu.ime_pending = false;
+  cpu.halted = false;
+
+  if (!rom) {
+    // No boot ROM: start the cartridge with the registers the DMG boot ROM
+    // leaves behind.
+    cpu.set_af(0x01B0);
+    cpu.set_bc(0x0013);
+    cpu.set_de(0x00D8);
+    cpu.set_hl(0x014D);
+    cpu.reg_sp = 0xFFFE;
+    cpu.reg_pc = 0x0100;
+    io[ADDR_BOOT & 0xFF] = 1;
+    io[ADDR_LCDC & 0xFF] = 0x91;
+    io[ADDR_BGP & 0xFF] = 0xFC;
+  }
+
+  ppu.reset();
+
   t = 0;
-  t_div = 0;
-  t_tima = 0;
+  sched.reset();
+  div_base = 0;
+  timer_synced = 0;
+  timer_period = 0;
+  sync_ppu();
+  crashed = false;
+  crash_msg[0] = '\0';
+  irq_check = false;
+  trace.clear();
+  if (rewind) rewind->clear();
+  rewind_frame = ppu.frames;
+  if (profiler) profiler->clear(cpu.reg_pc);
+  stats.clear();
+  stats_frame = ppu.frames;
 }
 
-uint8_t Environment::read_next() {
-  uint8_t word = get_mem(cpu.reg_pc);
-  cpu.reg_pc++;
-  return word;
+inline uint8_t Environment::read_next() {
+  uint16_t addr = cpu.reg_pc++;
+  if ((addr >> 8) != fetch_page_num) {
+    // A page without a read pointer (HRAM, I/O, watched) is never cached.
+    uint8_t *page = mem_read[addr >> 8];
+    if (!page) return get_mem_slow(addr);
+    fetch_page = page;
+    fetch_page_num = addr >> 8;
+  }
+  return fetch_page[addr & 0xFF];
 }
 
 uint16_t Environment::read_next_hl() {
@@ -33,64 +103,240 @@ uint16_t Environment::read_next_hl() {
   return dword;
 }
 
-uint8_t Environment::get_mem(uint16_t ptr) {
-  if (0 <= ptr && ptr < ROM_SIZE) {
-    return rom.get()[ptr];
-  } else {
-    return mem[ptr];
+void Environment::map_mem(uint16_t addr, size_t size, uint8_t *read, uint8_t *write, MemHandler *handler) {
+  fetch_page_num = 0x100;
+  for (size_t offs = 0; offs < size; offs += 0x100) {
+    uint8_t page = (addr + offs) >> 8;
+    mem_read[page] = read ? read + offs : nullptr;
+    mem_write[page] = write ? write + offs : nullptr;
+    mem_handler[page] = handler;
+    if (blocks) {
+      // New contents under any cached code, and no guard on the new mapping.
+      code_write[page] = nullptr;
+      drop_blocks(page);
+    }
+    if (watch_kinds[page]) install_watch(page);
+  }
+}
+
+// A guarded page is unguarded first, as the watch takes over its pointers.
+// Watched pages stay out of the block cache.
+void Environment::watch_page(uint8_t page, uint8_t kinds) {
+  if (kinds == watch_kinds[page]) return;
+  if (blocks) {
+    unguard_page(page);
+    drop_blocks(page);
+  }
+  if (watch_kinds[page]) {
+    mem_read[page] = watch_read[page];
+    mem_write[page] = watch_write[page];
+    mem_handler[page] = watch_handler[page];
+  }
+  watch_kinds[page] = kinds;
+  if (kinds) install_watch(page);
+  fetch_page_num = 0x100;
+}
+
+void Environment::install_watch(uint8_t page) {
+  watch_read[page] = mem_read[page];
+  watch_write[page] = mem_write[page];
+  watch_handler[page] = mem_handler[page];
+  if (watch_kinds[page] & WATCH_READ) mem_read[page] = nullptr;
+  if (watch_kinds[page] & WATCH_WRITE) mem_write[page] = nullptr;
+  mem_handler[page] = &watch_guard;
+}
+
+Environment::WatchGuard::WatchGuard(Environment *_env) : env(_env) {
+}
+
+// Accesses the page as it was mapped before the watch. Reads include opcode
+// fetches.
+uint8_t Environment::WatchGuard::read(uint16_t addr) {
+  uint8_t page = addr >> 8;
+  if (env->watch_kinds[page] & WATCH_READ) env->dbg.watch_access(addr, WATCH_READ);
+  if (env->watch_read[page]) return env->watch_read[page][addr & 0xFF];
+  if (env->watch_handler[page]) return env->watch_handler[page]->read(addr);
+  if (addr >= 0xFF00) return env->read_io(addr);
+  return 0xFF;
+}
+
+void Environment::WatchGuard::write(uint16_t addr, uint8_t val) {
+  uint8_t page = addr >> 8;
+  if (env->watch_kinds[page] & WATCH_WRITE) env->dbg.watch_access(addr, WATCH_WRITE);
+  uint8_t *write = env->watch_write[page];
+  if (write) {
+    write[addr & 0xFF] = val;
+    if (env->blocks) {
+      // Code cached from an alias of this page is guarded there.
+      for (int other = 0; other < 0x100; other++) {
+        if (env->code_write[other] == write) {
+          env->unguard_page(other);
+          break;
+        }
+      }
+    }
+  } else if (env->watch_handler[page]) {
+    env->watch_handler[page]->write(addr, val);
+  } else if (addr >= 0xFF00) {
+    env->write_io(addr, val);
   }
 }
 
-uint8_t * Environment::get_mem_ptr(uint16_t ptr) {
-  if (0 <= ptr && ptr < ROM_SIZE) {
-    return &rom.get()[ptr];
+void Environment::reset_mem_map() {
+  map_cartridge();
+  if (boot_rom_mapped()) map_mem(0x0000, 0x0100, rom.get(), nullptr, cart);
+  map_mem(0x8000, 0x1800, vram, nullptr, &ppu); // Tile data, writes update the tile cache.
+  map_mem(0x9800, 0x0800, vram + 0x1800, vram + 0x1800);
+  map_mem(0xC000, 0x2000, wram, wram);
+  map_mem(0xE000, 0x1E00, wram, wram); // Echo RAM is an alias of WRAM.
+  map_mem(0xFE00, 0x0100, oam, oam);
+  map_mem(0xFF00, 0x0100, nullptr, nullptr);
+}
+
+inline uint8_t Environment::get_mem(uint16_t addr) {
+  STAT(stats.reads[mem_region(addr)]++);
+  uint8_t *page = mem_read[addr >> 8];
+  if (page) return page[addr & 0xFF];
+  if (addr >= ADDR_HRAM && addr < ADDR_IE && !watch_kinds[0xFF]) return io[addr & 0xFF];
+  return get_mem_slow(addr);
+}
+
+inline void Environment::set_mem(uint16_t addr, uint8_t val) {
+  STAT(stats.writes[mem_region(addr)]++);
+  uint8_t *page = mem_write[addr >> 8];
+  if (page) {
+    page[addr & 0xFF] = val;
+  } else if (addr >= ADDR_HRAM && addr < ADDR_IE && !watch_kinds[0xFF]) {
+    io[addr & 0xFF] = val;
   } else {
-    return &mem[ptr];
+    set_mem_slow(addr, val);
+  }
+}
+
+uint8_t Environment::get_mem_slow(uint16_t addr) {
+  MemHandler *handler = mem_handler[addr >> 8];
+  if (handler) return handler->read(addr);
+  if (addr >= 0xFF00) return read_io(addr);
+  return 0xFF;
+}
+
+void Environment::set_mem_slow(uint16_t addr, uint8_t val) {
+  MemHandler *handler = mem_handler[addr >> 8];
+  if (handler) {
+    handler->write(addr, val);
+  } else if (addr >= 0xFF00) {
+    write_io(addr, val);
   }
+  // Anything else is a write into ROM without an MBC, which is ignored.
+}
+
+// 0xFF00-0xFFFF: I/O registers and IE. HRAM is handled inline by get/set_mem
+// unless the page is watched.
+uint8_t Environment::read_io(uint16_t addr) {
+  if (addr == ADDR_DIV) return (t - div_base) >> 8;
+  if (addr == ADDR_TIMA) sync_timer();
+  return io[addr & 0xFF];
+}
+
+bool Environment::boot_rom_mapped() {
+  return rom && !io[ADDR_BOOT & 0xFF];
 }
 
-void Environment::set_mem(uint16_t addr, uint8_t val) {
-  LOG_DEBUG(printf("+MEM[0x%x] = 0x%x\n", addr, val));
-  if (0xC000 <= addr && addr < 0xDE00) {
-    uint16_t offset = addr - 0xC000;
-    mem[addr] = mem[0xE000 + offset] = val;
-  } else if (0xE000 <= addr && addr < 0xFE00) {
-    uint16_t offset = addr - 0xE000;
-    mem[addr] = mem[0xC000 + offset] = val;
-  } else if (addr == ADDR_DIV) {
-    mem[addr] = 0;
+// Without a cartridge, ROM and external RAM read as 0xFF.
+void Environment::map_cartridge() {
+  if (cart) {
+    cart->map();
   } else {
-    mem[addr] = val;
+    map_mem(0x0000, 0x8000, nullptr, nullptr);
+    map_mem(0xA000, 0x2000, nullptr, nullptr);
   }
 }
 
-inline void Environment::set_flag(uint8_t bit, bool is_on) {
-  if (is_on) {
-    cpu.reg_f |= 1 << bit;
+void Environment::write_io(uint16_t addr, uint8_t val) {
+  if (addr == ADDR_DIV) {
+    // Restarts the divider, which also moves the next TIMA increment.
+    sync_timer();
+    div_base = t;
+    timer_synced = t;
+    schedule_timer();
+  } else if (addr == ADDR_TIMA || addr == ADDR_TMA) {
+    sync_timer();
+    io[addr & 0xFF] = val;
+    schedule_timer();
+  } else if (addr == ADDR_TAC) {
+    static const uint16_t periods[4] = { 0x400, 0x10, 0x40, 0x100 };
+    sync_timer();
+    io[addr & 0xFF] = val;
+    timer_period = ISBITN(val, 2) ? periods[val & 0b11] : 0;
+    schedule_timer();
+  } else if (addr == ADDR_IF || addr == ADDR_IE) {
+    io[addr & 0xFF] = val;
+    irq_check = true;
+  } else if (addr == ADDR_SC) {
+    // No link partner: a transfer on the internal clock shifts in 0xFF bits
+    // at 8192 Hz, one on the external clock never completes.
+    io[addr & 0xFF] = val;
+    if (ISBITN(val, 7) && ISBITN(val, 0)) {
+      sched.schedule(Event::Serial, t + 8 * 512);
+    } else {
+      sched.cancel(Event::Serial);
+    }
+  } else if (addr == ADDR_LCDC) {
+    sync_ppu();
+    uint8_t old = io[addr & 0xFF];
+    io[addr & 0xFF] = val;
+    if ((old ^ val) & 0x80) ppu.lcd_switched();
+    sync_ppu();
+  } else if (addr == ADDR_STAT) {
+    // The mode and coincidence bits are read-only.
+    sync_ppu();
+    io[addr & 0xFF] = (val & 0x78) | (io[addr & 0xFF] & 0x07);
+    ppu.update_stat();
+  } else if (addr == ADDR_LY) {
+    // Read-only.
+  } else if (addr == ADDR_LYC) {
+    sync_ppu();
+    io[addr & 0xFF] = val;
+    ppu.update_stat();
+  } else if (addr == ADDR_DMA) {
+    // OAM DMA, done at once.
+    io[addr & 0xFF] = val;
+    for (uint16_t i = 0; i < 0xA0; i++) oam[i] = get_mem((val << 8) | i);
+  } else if (addr == ADDR_BOOT) {
+    io[addr & 0xFF] = val;
+    if (val) map_cartridge();
   } else {
-    cpu.reg_f &= 0b11111111 ^ (1 << bit);
+    io[addr & 0xFF] = val;
   }
 }
 
-void Environment::set_zero_flag(bool is_on) {
-  set_flag(7, is_on);
+// Reads like the CPU, but neither counts the access nor sets off a watchpoint.
+uint8_t Environment::peek_mem(uint16_t addr) {
+  uint8_t page = addr >> 8;
+  uint8_t *mem = watch_kinds[page] ? watch_read[page] : mem_read[page];
+  MemHandler *handler = watch_kinds[page] ? watch_handler[page] : mem_handler[page];
+  if (mem) return mem[addr & 0xFF];
+  if (addr >= ADDR_HRAM && addr < ADDR_IE) return io[addr & 0xFF];
+  if (handler) return handler->read(addr);
+  if (addr >= 0xFF00) return read_io(addr);
+  return 0xFF;
 }
 
-void Environment::set_substract_flag(bool is_on) {
-  set_flag(6, is_on);
+CPU &Environment::registers() {
+  return cpu;
 }
 
-void Environment::set_half_carry_flag(bool is_on) {
-  set_flag(5, is_on);
+Debugger &Environment::debugger() {
+  return dbg;
 }
 
-void Environment::set_carry_flag(bool is_on) {
-  set_flag(4, is_on);
+// Writes the last instructions executed; decode with tools/tracedump.
+bool Environment::save_trace(const string &path) {
+  return trace.save(path);
 }
 
 void Environment::push_to_stack_d8(uint8_t val) {
-  set_mem(cpu.reg_sp, val);
-  cpu.reg_sp--;
+  set_mem(--cpu.reg_sp, val);
 }
 
 void Environment::push_to_stack_d16(uint16_t val) {
@@ -110,1516 +356,1033 @@ uint16_t Environment::pop_from_stack_d16() {
   return lo | (hi << 8);
 }
 
-void Environment::handle_timer_counter(uint8_t dur) {
-  uint8_t tac = get_mem(ADDR_TAC);
-  bool t_start = ISBITN(tac, 2);
+// Runs every event that is due, in cycle order.
+void Environment::run_events() {
+  Event event;
+  while (sched.pop_due(t, &event)) {
+    STAT(stats.events++);
+    switch (event) {
+      case Event::Timer:  sync_timer();    break;
+      case Event::Ppu:    sync_ppu();      break;
+      case Event::Serial: finish_serial(); break;
+      default: break;
+    }
+  }
+  #ifdef STATS
+    if (ppu.frames != stats_frame) {
+      stats_frame = ppu.frames;
+      stats.end_frame();
+    }
+  #endif
+  if (rewind && ppu.frames != rewind_frame) record_frame();
+}
 
-  if (!t_start) return;
+// Runs between instructions, once the events of the frame's VBlank are done.
+void Environment::record_frame() {
+  rewind_frame = ppu.frames;
+  save_state(rewind_state);
+  rewind->push(rewind_state);
+}
 
-  uint8_t hz_mode = tac & 0b11;
-  uint16_t cycles;
-  switch (hz_mode) {
-    case 0b00:
-      cycles = 0x400;
-      break;
-    case 0b01:
-      cycles = 0x10;
-      break;
-    case 0b10:
-      cycles = 0x40;
-      break;
-    case 0b11:
-      cycles = 0x100;
-      break;
-    default:
-      ERR(printf("Unknown TAC clock input mode from TAC: 0x%x", tac));
-      exit(EXIT_FAILURE);
-  }
+void Environment::enable_rewind(size_t seconds, size_t keyframe_interval) {
+  rewind.reset(new Rewind(seconds * REWIND_FRAME_RATE, keyframe_interval));
+  rewind_frame = ppu.frames;
+}
+
+// Goes back to the state recorded `frames` frames before the last one.
+bool Environment::rewind_frames(size_t frames) {
+  if (!rewind || !rewind->seek_back(frames, rewind_state)) return false;
+  load_state(rewind_state);
+  rewind_frame = ppu.frames;
+  return true;
+}
+
+size_t Environment::rewind_bytes() {
+  return rewind ? rewind->bytes() : 0;
+}
+
+void Environment::sync_ppu() {
+  sched.schedule(Event::Ppu, ppu.sync(t));
+  irq_check = true;
+}
+
+void Environment::finish_serial() {
+  io[ADDR_SB & 0xFF] = 0xFF;
+  io[ADDR_SC & 0xFF] &= 0x7F;
+  io[ADDR_IF & 0xFF] |= 1 << INT_SERIAL;
+  irq_check = true;
+}
 
-  if (t_tima + dur >= cycles) {
-    if (get_mem(ADDR_TIMA) == 0xFF) {
+// Brings TIMA up to t. TIMA counts falling edges of a divider bit, so the
+// increments are the period boundaries the divider crossed since the last sync.
+void Environment::sync_timer() {
+  if (timer_period) {
+    uint64_t ticks = (t - div_base) / timer_period - (timer_synced - div_base) / timer_period;
+    uint64_t tima = io[ADDR_TIMA & 0xFF] + ticks;
+    while (tima > 0xFF) {
       // INT 50 Timer Interrupt.
-      set_mem(ADDR_IF, get_mem(ADDR_IF) | 0b001);
+      io[ADDR_IF & 0xFF] |= 1 << INT_TIMER;
+      irq_check = true;
+      tima = io[ADDR_TMA & 0xFF] + tima - 0x100;
     }
-
-    mem[ADDR_TIMA]++;
+    io[ADDR_TIMA & 0xFF] = tima;
   }
+  timer_synced = t;
+  schedule_timer();
+}
 
-  t_tima = (t_tima + dur) % cycles;
+// The next observable timer event is the TIMA overflow.
+void Environment::schedule_timer() {
+  if (timer_period) {
+    uint64_t boundary = (timer_synced - div_base) / timer_period + 0x100 - io[ADDR_TIMA & 0xFF];
+    sched.schedule(Event::Timer, div_base + boundary * timer_period);
+  } else {
+    sched.cancel(Event::Timer);
+  }
 }
 
+// Only runs when irq_check says IE, IF or IME may have changed, so the
+// interrupt lines cost nothing per instruction otherwise.
 void Environment::handle_interrupt() {
+  if (cpu.ime_pending) {
+    // EI takes effect after the instruction that follows it.
+    cpu.ime_pending = false;
+    cpu.ime = true;
+    return;
+  }
+  irq_check = false;
 
+  uint8_t pending = io[ADDR_IE & 0xFF] & io[ADDR_IF & 0xFF] & 0x1F;
+  if (!pending) return;
+  cpu.halted = false;
+  if (!cpu.ime) return;
+
+  // The lowest bit has the highest priority; its vector is 0x40 + 8 * bit.
+  uint8_t bit = __builtin_ctz(pending);
+  io[ADDR_IF & 0xFF] &= ~(1 << bit);
+  cpu.ime = false;
+  push_to_stack_d16(cpu.reg_pc);
+  cpu.reg_pc = 0x40 + bit * 8;
+  t += 20;
+  STAT(stats.interrupts++);
+  #ifdef PROFILER
+    if (profiler) profiler->interrupt(cpu.reg_pc, cpu, 20);
+  #endif
+  if (t >= sched.next) run_events();
 }
 
-void Environment::op_bit_n_d8(uint8_t word, uint8_t *dur, unsigned int n) {
-  set_zero_flag(!ISBITN(word, n));
-  set_substract_flag(false);
-  set_half_carry_flag(true);
-  *dur = 8;
+// Register operand as encoded in the low (or middle) 3 bits of an opcode:
+// 0=B 1=C 2=D 3=E 4=H 5=L 6=(HL) 7=A.
+static constexpr uint8_t CPU::* reg8_member(uint8_t r) {
+  return r == 0 ? &CPU::reg_b :
+         r == 1 ? &CPU::reg_c :
+         r == 2 ? &CPU::reg_d :
+         r == 3 ? &CPU::reg_e :
+         r == 4 ? &CPU::reg_h :
+         r == 5 ? &CPU::reg_l :
+         r == 7 ? &CPU::reg_a :
+         nullptr;
 }
 
-void Environment::op_inc(uint8_t *reg) {
-  *reg += 1;
-  set_zero_flag(*reg == 0);
-  set_substract_flag(false);
-  set_half_carry_flag((*reg & 0b1111) == 0);
+template <uint8_t R>
+inline uint8_t Environment::get_reg8() {
+  constexpr uint8_t CPU::* member = reg8_member(R);
+  return R == 6 ? get_mem(cpu.hl()) : cpu.*member;
 }
 
-void Environment::op_dec(uint8_t *reg) {
-  *reg -= 1;
-  set_zero_flag(*reg == 0);
-  set_substract_flag(true);
-  set_half_carry_flag((*reg ^ 0b1111) == 0);
+template <uint8_t R>
+inline void Environment::set_reg8(uint8_t val) {
+  constexpr uint8_t CPU::* member = reg8_member(R);
+  if (R == 6) {
+    set_mem(cpu.hl(), val);
+  } else {
+    cpu.*member = val;
+  }
 }
 
-void Environment::op_rlc_n(uint8_t *reg, uint8_t *dur) {
-  set_carry_flag(ISBITN(*reg, 7));
-  set_substract_flag(false);
-  set_half_carry_flag(false);
+uint8_t Environment::op_inc(uint8_t val) {
+  uint8_t res = val + 1;
+  cpu.flag_z = res;
+  cpu.flag_n = false;
+  cpu.flag_h = val ^ 1 ^ res;
+  return res;
+}
 
-  *reg = rotate_left(*reg);
-  set_zero_flag(*reg == 0);
+uint8_t Environment::op_dec(uint8_t val) {
+  uint8_t res = val - 1;
+  cpu.flag_z = res;
+  cpu.flag_n = true;
+  cpu.flag_h = val ^ 1 ^ res;
+  return res;
+}
 
-  *dur = 8;
+void Environment::op_add(uint8_t val, uint8_t carry) {
+  uint16_t res = cpu.reg_a + val + carry;
+  cpu.flag_z = res;
+  cpu.flag_n = false;
+  cpu.flag_h = cpu.reg_a ^ val ^ res;
+  cpu.flag_c = res;
+  cpu.reg_a = res;
 }
 
-void Environment::op_rrc_n(uint8_t *reg, uint8_t *dur) {
-  set_carry_flag(ISBITN(*reg, 0));
-  set_substract_flag(false);
-  set_half_carry_flag(false);
+// Borrows show up as the same bits as carries do on add: bit 4 of
+// lhs ^ rhs ^ result for H and bit 8 of the wrapped 16-bit result for C.
+void Environment::op_sub(uint8_t val, uint8_t carry, bool store) {
+  uint16_t res = cpu.reg_a - val - carry;
+  cpu.flag_z = res;
+  cpu.flag_n = true;
+  cpu.flag_h = cpu.reg_a ^ val ^ res;
+  cpu.flag_c = res;
+  if (store) cpu.reg_a = res;
+}
 
-  *reg = rotate_right(*reg);
-  set_zero_flag(*reg == 0);
+void Environment::op_logic(uint8_t res, bool half_carry) {
+  cpu.reg_a = res;
+  cpu.flag_z = res;
+  cpu.flag_n = false;
+  cpu.flag_h = half_carry << 4;
+  cpu.flag_c = 0;
+}
 
-  *dur = 8;
+void Environment::op_bit(uint8_t val, unsigned int n) {
+  cpu.flag_z = val & (1 << n);
+  cpu.flag_n = false;
+  cpu.flag_h = 1 << 4;
 }
 
-void Environment::op_rl_n(uint8_t *reg, uint8_t *dur) {
-  *dur = 8;
+// Rotates and shifts of the 0xCB page, selected by bits 3-5 of the opcode:
+// RLC RRC RL RR SLA SRA SWAP SRL.
+uint8_t Environment::op_shift(uint8_t kind, uint8_t val) {
+  uint8_t old_carry = cpu.carry_flag();
+  uint8_t res;
+  uint16_t carry;
+
+  switch (kind) {
+    case 0: res = rotate_left(val);              carry = val << 1;         break; // RLC
+    case 1: res = rotate_right(val);             carry = (val & 1) << 8;   break; // RRC
+    case 2: res = (val << 1) | old_carry;        carry = val << 1;         break; // RL
+    case 3: res = (val >> 1) | (old_carry << 7); carry = (val & 1) << 8;   break; // RR
+    case 4: res = val << 1;                      carry = val << 1;         break; // SLA
+    case 5: res = (val >> 1) | (val & 0x80);     carry = (val & 1) << 8;   break; // SRA
+    case 6: res = (val << 4) | (val >> 4);       carry = 0;                break; // SWAP
+    default: res = val >> 1;                     carry = (val & 1) << 8;   break; // SRL
+  }
 
-  uint8_t old_carry = BITN(cpu.reg_f, BITFC);
-  set_carry_flag(ISBITN(*reg, 7));
-  set_substract_flag(false);
-  set_half_carry_flag(false);
+  cpu.flag_z = res;
+  cpu.flag_n = false;
+  cpu.flag_h = 0;
+  cpu.flag_c = carry;
+  return res;
+}
 
-  *reg = (*reg << 1) | old_carry;
-  set_zero_flag(*reg == 0);
+// SP plus a signed offset, for ADD SP,r8 and LD HL,SP+r8. The flags are those
+// of the unsigned add of the offset to the low byte of SP.
+uint16_t Environment::op_add_sp(uint8_t val) {
+  uint16_t offset = (int8_t) val;
+  uint16_t res = cpu.reg_sp + offset;
+  cpu.flag_z = 1;
+  cpu.flag_n = false;
+  cpu.flag_h = cpu.reg_sp ^ offset ^ res;
+  cpu.flag_c = (cpu.reg_sp ^ offset ^ res) & 0x100;
+  return res;
 }
 
-void Environment::op_rr_n(uint8_t *reg, uint8_t *dur) {
-  *dur = 8;
+bool Environment::step() {
+  if (irq_check) handle_interrupt();
+
+  if (cpu.halted) {
+    // Nothing runs until an event raises an interrupt, so skip to the next one.
+    if (sched.next == CYCLE_NEVER) {
+      crash("Halted with no events scheduled @ 0x%.2x", cpu.reg_pc);
+      return false;
+    }
+    #ifdef PROFILER
+      if (profiler) profiler->halt(sched.next - t);
+    #endif
+    t = sched.next;
+    run_events();
+    return true;
+  }
+
+  uint8_t cmd = read_next();
+  uint8_t dur = 0;
+
+  #ifdef TRACE
+    trace.record(t, cpu.reg_pc - 1, cmd, cpu);
+  #endif
+
+  #ifdef PROFILER
+    uint16_t pc = cpu.reg_pc - 1;
+  #endif
+
+  DISPATCH(ops, cmd, &dur);
+  if (crashed) return false;
+  STAT(stats.retire(cmd));
+
+  #ifdef PROFILER
+    if (profiler) profiler->record(pc, cmd, cpu, dur);
+  #endif
+
+  LOG_NOTICE(cout << "Duration: " << (int) dur << endl);
+
+  t += dur;
+  if (t >= sched.next) run_events();
+
+  return true;
+}
+
+uint64_t Environment::run_for(uint64_t limit) {
+  uint64_t instructions = 0;
+  if (blocks) {
+    while (t < limit) {
+      uint32_t n = run_block(limit);
+      if (!n) break;
+      instructions += n;
+    }
+  } else {
+    while (t < limit && step()) instructions++;
+  }
+  return instructions;
+}
+
+uint64_t Environment::cycles() {
+  return t;
+}
+
+bool Environment::enable_profiler(bool on) {
+  #ifdef PROFILER
+    if (on) {
+      enable_jit(false);
+      enable_blocks(false);
+      if (!profiler) profiler.reset(new Profiler(cpu.reg_pc));
+    } else {
+      profiler.reset();
+    }
+    return true;
+  #else
+    return !on;
+  #endif
+}
+
+bool Environment::report_profile(FILE *out, size_t count) {
+  if (!profiler) return false;
+  profiler->report(out, count, this);
+  return true;
+}
+
+bool Environment::save_profile(const string &path) {
+  return profiler && profiler->save_folded(path);
+}
+
+// The counters as JSON, see stats.h.
+bool Environment::write_stats(FILE *out) {
+  #ifdef STATS
+    stats.write_json(out, t);
+    return true;
+  #else
+    return false;
+  #endif
+}
+
+// Without the counters built in, fails without creating or truncating the file.
+bool Environment::save_stats(const string &path) {
+  #ifdef STATS
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return false;
+    bool written = write_stats(out);
+    return fclose(out) == 0 && written;
+  #else
+    return false;
+  #endif
+}
+
+// Why step() stopped, or null while the CPU runs.
+const char *Environment::crash_message() {
+  return crashed ? crash_msg : nullptr;
+}
+
+// Stops the CPU. The message is kept rather than printed, so instances can
+// run side by side without sharing stdout.
+void Environment::crash(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(crash_msg, sizeof(crash_msg), fmt, args);
+  va_end(args);
+  crashed = true;
+}
+
+// FNV-1a hashes of the machine state, for comparing runs.
+static uint64_t fnv1a(uint64_t hash, uint8_t byte) {
+  return (hash ^ byte) * 0x100000001B3ULL;
+}
 
-  uint8_t old_carry = BITN(cpu.reg_f, BITFC);
-  set_carry_flag(ISBITN(*reg, 0));
-  set_substract_flag(false);
-  set_half_carry_flag(false);
+uint64_t Environment::register_hash() {
+  const uint8_t regs[] = {
+    cpu.reg_a, cpu.f(), cpu.reg_b, cpu.reg_c, cpu.reg_d, cpu.reg_e, cpu.reg_h, cpu.reg_l,
+    (uint8_t) (cpu.reg_sp >> 8), (uint8_t) cpu.reg_sp, (uint8_t) (cpu.reg_pc >> 8), (uint8_t) cpu.reg_pc,
+  };
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (uint8_t byte : regs) hash = fnv1a(hash, byte);
+  return hash;
+}
 
-  *reg = (*reg >> 1) | (old_carry << 7);
-  set_zero_flag(*reg == 0);
+// Everything the CPU can write: VRAM, cartridge RAM, WRAM, OAM, I/O and HRAM.
+uint64_t Environment::memory_hash() {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr++) {
+    if (addr >= 0xE000 && addr < 0xFE00) continue; // Echo RAM.
+    hash = fnv1a(hash, peek_mem(addr));
+  }
+  return hash;
 }
 
+// With the debugger, the console reads commands on a thread of its own while
+// the emulation runs on another, and this one waits for the CPU to stop.
 void Environment::run() {
+  #ifdef DEBUG
+    thread console(&Debugger::console, &dbg);
+    thread emulation(&Environment::emulate, this);
+    emulation.join();
+    dbg.stop();
+    console.join();
+  #else
+    emulate();
+  #endif
+}
+
+void Environment::emulate() {
   uint64_t cycle = 0;
-  uint8_t cmd = 0;
-  uint8_t dur = 0;
 
   for (;;) {
     #ifdef DEBUG
-      if (dbg.should_stop(cycle, cmd, cpu.reg_pc)) {
-        for (;;) {
-          if (dbg.prompt()) break;
-          if (dbg.should_dump()) {
-            printf("CMD 0x%.2x @ 0x%.2x (%d) CYCLE %llu\n", cmd, cpu.reg_pc, cpu.reg_pc, cycle);
-            cpu.dump_registers();
-          }
-        }
+      if (dbg.pending(cpu.reg_pc)) {
+        STAT(stats.debugger++);
+        if (!dbg.service(cycle, cpu)) break;
       }
     #endif
 
-    cmd = read_next();
-    dur = 0;
+    // Whole blocks unless something has to look at every instruction. The
+    // profiler turns blocks off.
+    bool single = !blocks;
+    #ifdef DEBUG
+      single = single || dbg.traps();
+    #endif
+    uint32_t n = single ? step() : run_block(UINT64_MAX);
+    if (!n) {
+      ERR(printf("%s", crash_message()));
+      break;
+    }
 
-    LOG_DEBUG(printf("CMD 0x%.2x @ 0x%.2x (%d) CYCLE %llu\n", cmd, cpu.reg_pc - 1, cpu.reg_pc - 1, cycle));
+    cycle += n;
+  }
+}
 
-    if (cmd == 0x00) { // NOP | 1  4 | - - - -
-      dur = 4;
-    }
-    else if (cmd == 0x01) { // LD BC,d16 | 3  12 | - - - -
-      cpu.set_bc(read_next_hl());
-      dur = 12;
-    }
-    else if (cmd == 0x02) { // LD (BC),A | 1  8 | - - - -
-      set_mem(cpu.bc(), cpu.reg_a);
-      dur = 8;
-    }
-    else if (cmd == 0x03) { // INC BC | 1  8 | - - - -
-      cpu.inc_bc();
-      dur = 8;
-    }
-    else if (cmd == 0x04) { // INC B | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_b);
-      dur = 4;
-    }
-    else if (cmd == 0x05) { // DEC B | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_b);
-      dur = 4;
-    }
-    else if (cmd == 0x06) { // LD B,d8 | 2  8 | - - - -
-      cpu.reg_b = read_next();
-      dur = 8;
-    }
-    else if (cmd == 0x07) { // RLCA | 1  4 | 0 0 0 C
-      set_carry_flag(ISBITN(cpu.reg_a, 7));
-      cpu.reg_a = rotate_left(cpu.reg_a);
-      set_substract_flag(false);
-      set_half_carry_flag(false);
-      set_zero_flag(false);
-      dur = 4;
-    }
-    else if (cmd == 0x08) { // LD (a16),SP | 3  20 | - - - -
-      set_mem(read_next_hl(), cpu.reg_sp);
-      dur = 20;
-    }
-    // else if (cmd == 0x09) { // ADD HL,BC | 1  8 | - 0 H C
-    // }
-    else if (cmd == 0x0A) { // LD A,(BC) | 1  8 | - - - -
-      cpu.reg_a = get_mem(cpu.bc());
-      dur = 8;
-    }
-    else if (cmd == 0x0B) { // DEC BC | 1  8 | - - - -
-      cpu.dec_bc();
-      dur = 8;
-    }
-    else if (cmd == 0x0C) { // INC C | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_c);
-      dur = 4;
-    }
-    else if (cmd == 0x0D) { // DEC C | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_c);
-      dur = 4;
-    }
-    else if (cmd == 0x0E) { // LD C,d8 | 2  8 | - - - -
-      cpu.reg_c = read_next();
-      dur = 8;
-    }
-    // else if (cmd == 0x0F) { // RRCA | 1  4 | 0 0 0 C
-    // }
-    // else if (cmd == 0x10) { // STOP 0 | 2  4 | - - - -
-    // }
-    else if (cmd == 0x11) { // LD DE,d16 | 3  12 | - - - -
-      cpu.set_de(read_next_hl());
-      dur = 12;
-    }
-    else if (cmd == 0x12) { // LD (DE),A | 1  8 | - - - -
-      set_mem(cpu.de(), cpu.reg_a);
-      dur = 8;
-    }
-    else if (cmd == 0x13) { // INC DE | 1  8 | - - - -
-      cpu.inc_de();
-      dur = 8;
-    }
-    else if (cmd == 0x14) { // INC D | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_d);
-      dur = 4;
-    }
-    else if (cmd == 0x15) { // DEC D | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_d);
-      dur = 4;
-    }
-    else if (cmd == 0x16) { // LD D,d8 | 2  8 | - - - -
-      cpu.reg_d = read_next();
-      dur = 8;
-    }
-    else if (cmd == 0x17) { // RLA | 1  4 | 0 0 0 C
-      set_carry_flag(ISBITN(cpu.reg_a, 7));
-
-      cpu.reg_a = rotate_left(cpu.reg_a);
-      set_zero_flag(cpu.reg_a == 0);
-      set_substract_flag(false);
-      set_half_carry_flag(false);
-      dur = 4;
-    }
-    // else if (cmd == 0x18) { // JR r8 | 2  12 | - - - -
-    // }
-    // else if (cmd == 0x19) { // ADD HL,DE | 1  8 | - 0 H C
-    // }
-    else if (cmd == 0x1A) { // LD A,(DE) | 1  8 | - - - -
-      cpu.reg_a = get_mem(cpu.de());
-      dur = 8;
-    }
-    else if (cmd == 0x1B) { // DEC DE | 1  8 | - - - -
-      cpu.dec_de();
-      dur = 8;
-    }
-    else if (cmd == 0x1C) { // INC E | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_e);
-      dur = 4;
-    }
-    else if (cmd == 0x1D) { // DEC E | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_e);
-      dur = 4;
-    }
-    else if (cmd == 0x1E) { // LD E,d8 | 2  8 | - - - -
-      cpu.reg_e = read_next();
-      dur = 8;
-    }
-    // else if (cmd == 0x1F) { // RRA | 1  4 | 0 0 0 C
-    // }
-    else if (cmd == 0x20) { // JR NZ,r8 | 2  12/8 | - - - -
-      char offset = (char) read_next();
-      dur = 8;
-
-      if (!ISBITN(cpu.reg_f, BITFZ)) {
-        dur = 12;
-        cpu.reg_pc += offset;
-      }
-    }
-    else if (cmd == 0x21) { // LD HL,d16 | 3  12 | - - - -
-      cpu.reg_l = read_next();
-      cpu.reg_h = read_next();
-      dur = 12;
-    }
-    else if (cmd == 0x22) { // LD (HL+),A | 1  8 | - - - -
-      set_mem(cpu.hl(), cpu.reg_a);
-      cpu.inc_hl();
-      dur = 8;
-    }
-    else if (cmd == 0x23) { // INC HL | 1  8 | - - - -
-      cpu.inc_hl();
-      dur = 8;
-    }
-    else if (cmd == 0x24) { // INC H | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_h);
-      dur = 4;
-    }
-    else if (cmd == 0x25) { // DEC H | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_h);
-      dur = 4;
-    }
-    else if (cmd == 0x26) { // LD H,d8 | 2  8 | - - - -
-      cpu.reg_h = read_next();
-      dur = 8;
-    }
-    // else if (cmd == 0x27) { // DAA | 1  4 | Z - 0 C
-    // }
-    else if (cmd == 0x28) { // JR Z,r8 | 2  12/8 | - - - -
-      dur = 8;
-      char offset = (char) read_next();
-
-      if (ISBITN(cpu.reg_f, BITFZ)) {
-        dur = 12;
-        cpu.reg_pc += offset;
-      }
-    }
-    // else if (cmd == 0x29) { // ADD HL,HL | 1  8 | - 0 H C
-    // }
-    else if (cmd == 0x2A) { // LD A,(HL+) | 1  8 | - - - -
-      cpu.reg_a = get_mem(cpu.hl());
-      cpu.inc_hl();
-      dur = 8;
-    }
-    else if (cmd == 0x2B) { // DEC HL | 1  8 | - - - -
-      cpu.dec_hl();
-      dur = 8;
-    }
-    else if (cmd == 0x2C) { // INC L | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_l);
-      dur = 4;
-    }
-    else if (cmd == 0x2D) { // DEC L | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_l);
-      dur = 4;
-    }
-    else if (cmd == 0x2E) { // LD L,d8 | 2  8 | - - - -
-      cpu.reg_l = read_next();
-      dur = 8;
-    }
-    // else if (cmd == 0x2F) { // CPL | 1  4 | - 1 1 -
-    // }
-    // else if (cmd == 0x30) { // JR NC,r8 | 2  12/8 | - - - -
-    // }
-    else if (cmd == 0x31) { // LD SP,d16 | 3  12 | - - - -
-      cpu.reg_sp = read_next_hl();
-      dur = 12;
-    }
-    else if (cmd == 0x32) { // LD (HL-),A | 1  8 | - - - -
-      set_mem(cpu.hl(), cpu.reg_a);
-      cpu.dec_hl();
-      dur = 8;
-    }
-    // else if (cmd == 0x33) { // INC SP | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x34) { // INC (HL) | 1  12 | Z 0 H -
-    // }
-    // else if (cmd == 0x35) { // DEC (HL) | 1  12 | Z 1 H -
-    // }
-    else if (cmd == 0x36) { // LD (HL),d8 | 2  12 | - - - -
-      set_mem(cpu.hl(), read_next());
-      dur = 12;
-    }
-    // else if (cmd == 0x37) { // SCF | 1  4 | - 0 0 1
-    // }
-    // else if (cmd == 0x38) { // JR C,r8 | 2  12/8 | - - - -
-    // }
-    // else if (cmd == 0x39) { // ADD HL,SP | 1  8 | - 0 H C
-    // }
-    else if (cmd == 0x3A) { // LD A,(HL-) | 1  8 | - - - -
-      cpu.reg_a = get_mem(cpu.hl());
-      cpu.inc_hl();
-      dur = 8;
-    }
-    // else if (cmd == 0x3B) { // DEC SP | 1  8 | - - - -
-    // }
-    else if (cmd == 0x3C) { // INC A | 1  4 | Z 0 H -
-      op_inc(&cpu.reg_a);
-      dur = 4;
-    }
-    else if (cmd == 0x3D) { // DEC A | 1  4 | Z 1 H -
-      op_dec(&cpu.reg_a);
-      dur = 4;
-    }
-    else if (cmd == 0x3E) { // LD A,d8 | 2  8 | - - - -
-      cpu.reg_a = read_next();
-      dur = 8;
-    }
-    // else if (cmd == 0x3F) { // CCF | 1  4 | - 0 0 C
-    // }
-    else if (cmd == 0x40) { // LD B,B | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x41) { // LD B,C | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x42) { // LD B,D | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x43) { // LD B,E | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x44) { // LD B,H | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x45) { // LD B,L | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x46) { // LD B,(HL) | 1  8 | - - - -
-      cpu.reg_b = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x47) { // LD B,A | 1  4 | - - - -
-      cpu.reg_b = cpu.reg_a;
-      dur = 4;
-    }
-    else if (cmd == 0x48) { // LD C,B | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x49) { // LD C,C | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x4A) { // LD C,D | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x4B) { // LD C,E | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x4C) { // LD C,H | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x4D) { // LD C,L | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x4E) { // LD C,(HL) | 1  8 | - - - -
-      cpu.reg_c = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x4F) { // LD C,A | 1  4 | - - - -
-      cpu.reg_c = cpu.reg_a;
-      dur = 4;
-    }
-    else if (cmd == 0x50) { // LD D,B | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x51) { // LD D,C | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x52) { // LD D,D | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x53) { // LD D,E | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x54) { // LD D,H | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x55) { // LD D,L | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x56) { // LD D,(HL) | 1  8 | - - - -
-      cpu.reg_d = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x57) { // LD D,A | 1  4 | - - - -
-      cpu.reg_d = cpu.reg_a;
-      dur = 4;
-    }
-    else if (cmd == 0x58) { // LD E,B | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x59) { // LD E,C | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x5A) { // LD E,D | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x5B) { // LD E,E | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x5C) { // LD E,H | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x5D) { // LD E,L | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x5E) { // LD E,(HL) | 1  8 | - - - -
-      cpu.reg_e = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x5F) { // LD E,A | 1  4 | - - - -
-      cpu.reg_e = cpu.reg_a;
-      dur = 4;
-    }
-    else if (cmd == 0x60) { // LD H,B | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x61) { // LD H,C | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x62) { // LD H,D | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x63) { // LD H,E | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x64) { // LD H,H | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x65) { // LD H,L | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x66) { // LD H,(HL) | 1  8 | - - - -
-      cpu.reg_h = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x67) { // LD H,A | 1  4 | - - - -
-      cpu.reg_h = cpu.reg_a;
-      dur = 4;
-    }
-    else if (cmd == 0x68) { // LD L,B | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x69) { // LD L,C | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x6A) { // LD L,D | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x6B) { // LD L,E | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x6C) { // LD L,H | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x6D) { // LD L,L | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x6E) { // LD L,(HL) | 1  8 | - - - -
-      cpu.reg_l = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x6F) { // LD L,A | 1  4 | - - - -
-      cpu.reg_l = cpu.reg_a;
-      dur = 4;
-    }
-    // else if (cmd == 0x70) { // LD (HL),B | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x71) { // LD (HL),C | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x72) { // LD (HL),D | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x73) { // LD (HL),E | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x74) { // LD (HL),H | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x75) { // LD (HL),L | 1  8 | - - - -
-    // }
-    // else if (cmd == 0x76) { // HALT | 1  4 | - - - -
-    // }
-    else if (cmd == 0x77) { // LD (HL),A | 1  8 | - - - -
-      set_mem(cpu.hl(), cpu.reg_a);
-      dur = 8;
-    }
-    else if (cmd == 0x78) { // LD A,B | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_b;
-      dur = 4;
-    }
-    else if (cmd == 0x79) { // LD A,C | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_c;
-      dur = 4;
-    }
-    else if (cmd == 0x7A) { // LD A,D | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_d;
-      dur = 4;
-    }
-    else if (cmd == 0x7B) { // LD A,E | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_e;
-      dur = 4;
-    }
-    else if (cmd == 0x7C) { // LD A,H | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_h;
-      dur = 4;
-    }
-    else if (cmd == 0x7D) { // LD A,L | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_l;
-      dur = 4;
-    }
-    else if (cmd == 0x7E) { // LD A,(HL) | 1  8 | - - - -
-      cpu.reg_a = get_mem(cpu.hl());
-      dur = 8;
-    }
-    else if (cmd == 0x7F) { // LD A,A | 1  4 | - - - -
-      cpu.reg_a = cpu.reg_a;
-      dur = 4;
-    }
-    // else if (cmd == 0x80) { // ADD A,B | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x81) { // ADD A,C | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x82) { // ADD A,D | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x83) { // ADD A,E | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x84) { // ADD A,H | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x85) { // ADD A,L | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x86) { // ADD A,(HL) | 1  8 | Z 0 H C
-    // }
-    // else if (cmd == 0x87) { // ADD A,A | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x88) { // ADC A,B | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x89) { // ADC A,C | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x8A) { // ADC A,D | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x8B) { // ADC A,E | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x8C) { // ADC A,H | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x8D) { // ADC A,L | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x8E) { // ADC A,(HL) | 1  8 | Z 0 H C
-    // }
-    // else if (cmd == 0x8F) { // ADC A,A | 1  4 | Z 0 H C
-    // }
-    // else if (cmd == 0x90) { // SUB B | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x91) { // SUB C | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x92) { // SUB D | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x93) { // SUB E | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x94) { // SUB H | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x95) { // SUB L | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x96) { // SUB (HL) | 1  8 | Z 1 H C
-    // }
-    // else if (cmd == 0x97) { // SUB A | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x98) { // SBC A,B | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x99) { // SBC A,C | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x9A) { // SBC A,D | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x9B) { // SBC A,E | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x9C) { // SBC A,H | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x9D) { // SBC A,L | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0x9E) { // SBC A,(HL) | 1  8 | Z 1 H C
-    // }
-    // else if (cmd == 0x9F) { // SBC A,A | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xA0) { // AND B | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA1) { // AND C | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA2) { // AND D | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA3) { // AND E | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA4) { // AND H | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA5) { // AND L | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA6) { // AND (HL) | 1  8 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA7) { // AND A | 1  4 | Z 0 1 0
-    // }
-    // else if (cmd == 0xA8) { // XOR B | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xA9) { // XOR C | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xAA) { // XOR D | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xAB) { // XOR E | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xAC) { // XOR H | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xAD) { // XOR L | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xAE) { // XOR (HL) | 1  8 | Z 0 0 0
-    // }
-    else if (cmd == 0xAF) { // XOR A | 1  4 | Z 0 0 0
-      cpu.reg_a ^= cpu.reg_a;
-      set_zero_flag(cpu.reg_a == 0);
-      set_substract_flag(false);
-      set_half_carry_flag(false);
-      set_carry_flag(false);
-
-      dur = 4;
-    }
-    // else if (cmd == 0xB0) { // OR B | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB1) { // OR C | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB2) { // OR D | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB3) { // OR E | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB4) { // OR H | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB5) { // OR L | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB6) { // OR (HL) | 1  8 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB7) { // OR A | 1  4 | Z 0 0 0
-    // }
-    // else if (cmd == 0xB8) { // CP B | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xB9) { // CP C | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xBA) { // CP D | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xBB) { // CP E | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xBC) { // CP H | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xBD) { // CP L | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xBE) { // CP (HL) | 1  8 | Z 1 H C
-    // }
-    // else if (cmd == 0xBF) { // CP A | 1  4 | Z 1 H C
-    // }
-    // else if (cmd == 0xC0) { // RET NZ | 1  20/8 | - - - -
-    // }
-    else if (cmd == 0xC1) { // POP BC | 1  12 | - - - -
-      dur = 12;
-      cpu.set_bc(pop_from_stack_d16());
-    }
-    // else if (cmd == 0xC2) { // JP NZ,a16 | 3  16/12 | - - - -
-    // }
-    // else if (cmd == 0xC3) { // JP a16 | 3  16 | - - - -
-    // }
-    // else if (cmd == 0xC4) { // CALL NZ,a16 | 3  24/12 | - - - -
-    // }
-    else if (cmd == 0xC5) { // PUSH BC | 1  16 | - - - -
-      push_to_stack_d16(cpu.bc());
-      dur = 16;
-    }
-    // else if (cmd == 0xC6) { // ADD A,d8 | 2  8 | Z 0 H C
-    // }
-    // else if (cmd == 0xC7) { // RST 00H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xC8) { // RET Z | 1  20/8 | - - - -
-    // }
-    // else if (cmd == 0xC9) { // RET | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xCA) { // JP Z,a16 | 3  16/12 | - - - -
-    // }
-    else if (cmd == 0xCB) { // PREFIX CB | 1  4 | - - - -
-      dur = 4;
-
-      cmd = read_next();
-
-      if (cmd == 0x00) { // RLC B | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_b, &dur);
-      }
-      else if (cmd == 0x01) { // RLC C | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_c, &dur);
-      }
-      else if (cmd == 0x02) { // RLC D | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_d, &dur);
-      }
-      else if (cmd == 0x03) { // RLC E | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_e, &dur);
-      }
-      else if (cmd == 0x04) { // RLC H | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_h, &dur);
-      }
-      else if (cmd == 0x05) { // RLC L | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_l, &dur);
-      }
-      else if (cmd == 0x06) { // RLC (HL) | 2  16 | Z 0 0 C
-        op_rlc_n(get_mem_ptr(cpu.hl()), &dur);
-        dur = 16;
-      }
-      else if (cmd == 0x07) { // RLC A | 2  8 | Z 0 0 C
-        op_rlc_n(&cpu.reg_a, &dur);
-      }
-      else if (cmd == 0x08) { // RRC B | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_b, &dur);
-      }
-      else if (cmd == 0x09) { // RRC C | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_c, &dur);
-      }
-      else if (cmd == 0x0a) { // RRC D | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_d, &dur);
-      }
-      else if (cmd == 0x0b) { // RRC E | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_e, &dur);
-      }
-      else if (cmd == 0x0c) { // RRC H | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_h, &dur);
-      }
-      else if (cmd == 0x0d) { // RRC L | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_l, &dur);
-      }
-      else if (cmd == 0x0e) { // RRC (HL) | 2  16 | Z 0 0 C
-        op_rrc_n(get_mem_ptr(cpu.hl()), &dur);
-        dur = 16;
-      }
-      else if (cmd == 0x0f) { // RRC A | 2  8 | Z 0 0 C
-        op_rrc_n(&cpu.reg_a, &dur);
-      }
-      else if (cmd == 0x10) { // RL B | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_b, &dur);
-      }
-      else if (cmd == 0x11) { // RL C | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_c, &dur);
-      }
-      else if (cmd == 0x12) { // RL D | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_d, &dur);
-      }
-      else if (cmd == 0x13) { // RL E | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_e, &dur);
-      }
-      else if (cmd == 0x14) { // RL H | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_h, &dur);
-      }
-      else if (cmd == 0x15) { // RL L | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_l, &dur);
-      }
-      else if (cmd == 0x16) { // RL (HL) | 2  16 | Z 0 0 C
-        op_rl_n(get_mem_ptr(cpu.hl()), &dur);
-        dur = 16;
-      }
-      else if (cmd == 0x17) { // RL A | 2  8 | Z 0 0 C
-        op_rl_n(&cpu.reg_a, &dur);
-      }
-      else if (cmd == 0x18) { // RR B | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_b, &dur);
-      }
-      else if (cmd == 0x19) { // RR C | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_c, &dur);
-      }
-      else if (cmd == 0x1a) { // RR D | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_d, &dur);
-      }
-      else if (cmd == 0x1b) { // RR E | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_e, &dur);
-      }
-      else if (cmd == 0x1c) { // RR H | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_h, &dur);
-      }
-      else if (cmd == 0x1d) { // RR L | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_l, &dur);
-      }
-      else if (cmd == 0x1e) { // RR (HL) | 2  16 | Z 0 0 C
-        op_rr_n(get_mem_ptr(cpu.hl()), &dur);
-        dur = 16;
-      }
-      else if (cmd == 0x1f) { // RR A | 2  8 | Z 0 0 C
-        op_rr_n(&cpu.reg_a, &dur);
-      }
-      // else if (cmd == 0x20) { // SLA B | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x21) { // SLA C | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x22) { // SLA D | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x23) { // SLA E | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x24) { // SLA H | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x25) { // SLA L | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x26) { // SLA (HL) | 2  16 | Z 0 0 C
-      // }
-      // else if (cmd == 0x27) { // SLA A | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x28) { // SRA B | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x29) { // SRA C | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2a) { // SRA D | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2b) { // SRA E | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2c) { // SRA H | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2d) { // SRA L | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2e) { // SRA (HL) | 2  16 | Z 0 0 0
-      // }
-      // else if (cmd == 0x2f) { // SRA A | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x30) { // SWAP B | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x31) { // SWAP C | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x32) { // SWAP D | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x33) { // SWAP E | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x34) { // SWAP H | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x35) { // SWAP L | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x36) { // SWAP (HL) | 2  16 | Z 0 0 0
-      // }
-      // else if (cmd == 0x37) { // SWAP A | 2  8 | Z 0 0 0
-      // }
-      // else if (cmd == 0x38) { // SRL B | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x39) { // SRL C | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3a) { // SRL D | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3b) { // SRL E | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3c) { // SRL H | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3d) { // SRL L | 2  8 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3e) { // SRL (HL) | 2  16 | Z 0 0 C
-      // }
-      // else if (cmd == 0x3f) { // SRL A | 2  8 | Z 0 0 C
-      // }
-      else if (cmd == 0x40) { // BIT 0,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 0);
-      }
-      else if (cmd == 0x41) { // BIT 0,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 0);
-      }
-      else if (cmd == 0x42) { // BIT 0,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 0);
-      }
-      else if (cmd == 0x43) { // BIT 0,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 0);
-      }
-      else if (cmd == 0x44) { // BIT 0,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 0);
-      }
-      else if (cmd == 0x45) { // BIT 0,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 0);
-      }
-      else if (cmd == 0x46) { // BIT 0,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 0);
-      }
-      else if (cmd == 0x47) { // BIT 0,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 0);
-      }
-      else if (cmd == 0x48) { // BIT 1,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 1);
-      }
-      else if (cmd == 0x49) { // BIT 1,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 1);
-      }
-      else if (cmd == 0x4a) { // BIT 1,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 1);
-      }
-      else if (cmd == 0x4b) { // BIT 1,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 1);
-      }
-      else if (cmd == 0x4c) { // BIT 1,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 1);
-      }
-      else if (cmd == 0x4d) { // BIT 1,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 1);
-      }
-      else if (cmd == 0x4e) { // BIT 1,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 1);
-      }
-      else if (cmd == 0x4f) { // BIT 1,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 1);
-      }
-      else if (cmd == 0x50) { // BIT 2,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 2);
-      }
-      else if (cmd == 0x51) { // BIT 2,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 2);
-      }
-      else if (cmd == 0x52) { // BIT 2,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 2);
-      }
-      else if (cmd == 0x53) { // BIT 2,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 2);
-      }
-      else if (cmd == 0x54) { // BIT 2,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 2);
-      }
-      else if (cmd == 0x55) { // BIT 2,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 2);
-      }
-      else if (cmd == 0x56) { // BIT 2,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 2);
-      }
-      else if (cmd == 0x57) { // BIT 2,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 2);
-      }
-      else if (cmd == 0x58) { // BIT 3,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 3);
-      }
-      else if (cmd == 0x59) { // BIT 3,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 3);
-      }
-      else if (cmd == 0x5a) { // BIT 3,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 3);
-      }
-      else if (cmd == 0x5b) { // BIT 3,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 3);
-      }
-      else if (cmd == 0x5c) { // BIT 3,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 3);
-      }
-      else if (cmd == 0x5d) { // BIT 3,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 3);
-      }
-      else if (cmd == 0x5e) { // BIT 3,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 3);
-      }
-      else if (cmd == 0x5f) { // BIT 3,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 3);
-      }
-      else if (cmd == 0x60) { // BIT 4,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 4);
-      }
-      else if (cmd == 0x61) { // BIT 4,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 4);
-      }
-      else if (cmd == 0x62) { // BIT 4,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 4);
-      }
-      else if (cmd == 0x63) { // BIT 4,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 4);
-      }
-      else if (cmd == 0x64) { // BIT 4,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 4);
-      }
-      else if (cmd == 0x65) { // BIT 4,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 4);
-      }
-      else if (cmd == 0x66) { // BIT 4,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 4);
-      }
-      else if (cmd == 0x67) { // BIT 4,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 4);
-      }
-      else if (cmd == 0x68) { // BIT 5,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 5);
-      }
-      else if (cmd == 0x69) { // BIT 5,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 5);
-      }
-      else if (cmd == 0x6a) { // BIT 5,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 5);
-      }
-      else if (cmd == 0x6b) { // BIT 5,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 5);
-      }
-      else if (cmd == 0x6c) { // BIT 5,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 5);
-      }
-      else if (cmd == 0x6d) { // BIT 5,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 5);
-      }
-      else if (cmd == 0x6e) { // BIT 5,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 5);
-      }
-      else if (cmd == 0x6f) { // BIT 5,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 5);
-      }
-      else if (cmd == 0x70) { // BIT 6,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 6);
-      }
-      else if (cmd == 0x71) { // BIT 6,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 6);
-      }
-      else if (cmd == 0x72) { // BIT 6,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 6);
-      }
-      else if (cmd == 0x73) { // BIT 6,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 6);
-      }
-      else if (cmd == 0x74) { // BIT 6,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 6);
-      }
-      else if (cmd == 0x75) { // BIT 6,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 6);
-      }
-      else if (cmd == 0x76) { // BIT 6,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 6);
-      }
-      else if (cmd == 0x77) { // BIT 6,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 6);
-      }
-      else if (cmd == 0x78) { // BIT 7,B | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_b, &dur, 7);
-      }
-      else if (cmd == 0x79) { // BIT 7,C | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_c, &dur, 7);
-      }
-      else if (cmd == 0x7a) { // BIT 7,D | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_d, &dur, 7);
-      }
-      else if (cmd == 0x7b) { // BIT 7,E | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_e, &dur, 7);
-      }
-      else if (cmd == 0x7c) { // BIT 7,H | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_h, &dur, 7);
-      }
-      else if (cmd == 0x7d) { // BIT 7,L | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_l, &dur, 7);
-      }
-      else if (cmd == 0x7e) { // BIT 7,(HL) | 2  16 | Z 0 1 -
-        op_bit_n_d8(get_mem(cpu.hl()), &dur, 7);
-      }
-      else if (cmd == 0x7f) { // BIT 7,A | 2  8 | Z 0 1 -
-        op_bit_n_d8(cpu.reg_a, &dur, 7);
-      }
-      // else if (cmd == 0x80) { // RES 0,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x81) { // RES 0,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x82) { // RES 0,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x83) { // RES 0,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x84) { // RES 0,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x85) { // RES 0,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x86) { // RES 0,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0x87) { // RES 0,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x88) { // RES 1,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x89) { // RES 1,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x8a) { // RES 1,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x8b) { // RES 1,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x8c) { // RES 1,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x8d) { // RES 1,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x8e) { // RES 1,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0x8f) { // RES 1,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x90) { // RES 2,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x91) { // RES 2,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x92) { // RES 2,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x93) { // RES 2,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x94) { // RES 2,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x95) { // RES 2,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x96) { // RES 2,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0x97) { // RES 2,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x98) { // RES 3,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x99) { // RES 3,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x9a) { // RES 3,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x9b) { // RES 3,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x9c) { // RES 3,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x9d) { // RES 3,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0x9e) { // RES 3,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0x9f) { // RES 3,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa0) { // RES 4,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa1) { // RES 4,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa2) { // RES 4,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa3) { // RES 4,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa4) { // RES 4,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa5) { // RES 4,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa6) { // RES 4,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xa7) { // RES 4,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa8) { // RES 5,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xa9) { // RES 5,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xaa) { // RES 5,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xab) { // RES 5,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xac) { // RES 5,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xad) { // RES 5,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xae) { // RES 5,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xaf) { // RES 5,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb0) { // RES 6,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb1) { // RES 6,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb2) { // RES 6,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb3) { // RES 6,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb4) { // RES 6,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb5) { // RES 6,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb6) { // RES 6,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xb7) { // RES 6,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb8) { // RES 7,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xb9) { // RES 7,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xba) { // RES 7,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xbb) { // RES 7,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xbc) { // RES 7,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xbd) { // RES 7,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xbe) { // RES 7,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xbf) { // RES 7,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc0) { // SET 0,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc1) { // SET 0,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc2) { // SET 0,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc3) { // SET 0,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc4) { // SET 0,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc5) { // SET 0,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc6) { // SET 0,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xc7) { // SET 0,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc8) { // SET 1,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xc9) { // SET 1,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xca) { // SET 1,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xcb) { // SET 1,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xcc) { // SET 1,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xcd) { // SET 1,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xce) { // SET 1,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xcf) { // SET 1,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd0) { // SET 2,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd1) { // SET 2,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd2) { // SET 2,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd3) { // SET 2,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd4) { // SET 2,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd5) { // SET 2,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd6) { // SET 2,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xd7) { // SET 2,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd8) { // SET 3,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xd9) { // SET 3,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xda) { // SET 3,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xdb) { // SET 3,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xdc) { // SET 3,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xdd) { // SET 3,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xde) { // SET 3,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xdf) { // SET 3,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe0) { // SET 4,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe1) { // SET 4,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe2) { // SET 4,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe3) { // SET 4,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe4) { // SET 4,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe5) { // SET 4,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe6) { // SET 4,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xe7) { // SET 4,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe8) { // SET 5,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xe9) { // SET 5,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xea) { // SET 5,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xeb) { // SET 5,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xec) { // SET 5,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xed) { // SET 5,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xee) { // SET 5,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xef) { // SET 5,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf0) { // SET 6,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf1) { // SET 6,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf2) { // SET 6,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf3) { // SET 6,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf4) { // SET 6,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf5) { // SET 6,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf6) { // SET 6,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xf7) { // SET 6,A | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf8) { // SET 7,B | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xf9) { // SET 7,C | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xfa) { // SET 7,D | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xfb) { // SET 7,E | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xfc) { // SET 7,H | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xfd) { // SET 7,L | 2  8 | - - - -
-      // }
-      // else if (cmd == 0xfe) { // SET 7,(HL) | 2  16 | - - - -
-      // }
-      // else if (cmd == 0xff) { // SET 7,A | 2  8 | - - - -
-      // }
-      else {
-        ERR(printf("Unknown 0xCB command: 0x%.2x @ 0x%.2x (%d)", cmd, cpu.reg_pc - 1, (int) cpu.reg_pc - 1));
-        break;
-      }
-    }
-    // else if (cmd == 0xCC) { // CALL Z,a16 | 3  24/12 | - - - -
-    // }
-    else if (cmd == 0xCD) { // CALL a16 | 3  24 | - - - -
-      push_to_stack_d16(cpu.reg_pc);
-      uint16_t addr = read_next_hl();
-      cpu.reg_pc = addr;
-      dur = 24;
-    }
-    // else if (cmd == 0xCE) { // ADC A,d8 | 2  8 | Z 0 H C
-    // }
-    // else if (cmd == 0xCF) { // RST 08H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xD0) { // RET NC | 1  20/8 | - - - -
-    // }
-    // else if (cmd == 0xD1) { // POP DE | 1  12 | - - - -
-    // }
-    // else if (cmd == 0xD2) { // JP NC,a16 | 3  16/12 | - - - -
-    // }
-    // else if (cmd == 0xD4) { // CALL NC,a16 | 3  24/12 | - - - -
-    // }
-    // else if (cmd == 0xD5) { // PUSH DE | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xD6) { // SUB d8 | 2  8 | Z 1 H C
-    // }
-    // else if (cmd == 0xD7) { // RST 10H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xD8) { // RET C | 1  20/8 | - - - -
-    // }
-    // else if (cmd == 0xD9) { // RETI | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xDA) { // JP C,a16 | 3  16/12 | - - - -
-    // }
-    // else if (cmd == 0xDC) { // CALL C,a16 | 3  24/12 | - - - -
-    // }
-    // else if (cmd == 0xDE) { // SBC A,d8 | 2  8 | Z 1 H C
-    // }
-    // else if (cmd == 0xDF) { // RST 18H | 1  16 | - - - -
-    // }
-    else if (cmd == 0xE0) { // LDH (a8),A | 2  12 | - - - -
-      dur = 12;
-      uint16_t addr = 0xFF00 | read_next();
-      set_mem(addr, cpu.reg_a);
-    }
-    // else if (cmd == 0xE1) { // POP HL | 1  12 | - - - -
-    // }
-    else if (cmd == 0xE2) { // LD (C),A | 2  8 | - - - -
-      uint16_t addr = 0xFF00 | cpu.reg_c;
-      set_mem(addr, cpu.reg_a);
-      dur = 8;
-    }
-    // else if (cmd == 0xE5) { // PUSH HL | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xE6) { // AND d8 | 2  8 | Z 0 1 0
-    // }
-    // else if (cmd == 0xE7) { // RST 20H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xE8) { // ADD SP,r8 | 2  16 | 0 0 H C
-    // }
-    // else if (cmd == 0xE9) { // JP (HL) | 1  4 | - - - -
-    // }
-    // else if (cmd == 0xEA) { // LD (a16),A | 3  16 | - - - -
-    // }
-    // else if (cmd == 0xEE) { // XOR d8 | 2  8 | Z 0 0 0
-    // }
-    // else if (cmd == 0xEF) { // RST 28H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xF0) { // LDH A,(a8) | 2  12 | - - - -
-    // }
-    // else if (cmd == 0xF1) { // POP AF | 1  12 | Z N H C
-    // }
-    // else if (cmd == 0xF2) { // LD A,(C) | 2  8 | - - - -
-    // }
-    // else if (cmd == 0xF3) { // DI | 1  4 | - - - -
-    // }
-    // else if (cmd == 0xF5) { // PUSH AF | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xF6) { // OR d8 | 2  8 | Z 0 0 0
-    // }
-    // else if (cmd == 0xF7) { // RST 30H | 1  16 | - - - -
-    // }
-    // else if (cmd == 0xF8) { // LD HL,SP+r8 | 2  12 | 0 0 H C
-    // }
-    // else if (cmd == 0xF9) { // LD SP,HL | 1  8 | - - - -
-    // }
-    // else if (cmd == 0xFA) { // LD A,(a16) | 3  16 | - - - -
-    // }
-    // else if (cmd == 0xFB) { // EI | 1  4 | - - - -
-    // }
-    // else if (cmd == 0xFE) { // CP d8 | 2  8 | Z 1 H C
-    // }
-    // else if (cmd == 0xFF) { // RST 38H | 1  16 | - - - -
-    // }
-    else {
-      ERR(printf("Unknown command: 0x%.2x @ 0x%.2x (%d)", cmd, cpu.reg_pc - 1, (int) cpu.reg_pc - 1));
-      break;
-    }
+void Environment::op_unknown(uint8_t *dur) {
+  crash("Unknown command: 0x%.2x @ 0x%.2x (%d)", peek_mem(cpu.reg_pc - 1), cpu.reg_pc - 1, (int) cpu.reg_pc - 1);
+}
 
-    LOG_NOTICE(cout << "Duration: " << (int) dur << endl);
+void Environment::op_cb_unknown(uint8_t *dur) {
+  crash("Unknown 0xCB command: 0x%.2x @ 0x%.2x (%d)", peek_mem(cpu.reg_pc - 1), cpu.reg_pc - 1, (int) cpu.reg_pc - 1);
+}
 
-    t += dur;
+// Opcode families with the register operand encoded in the opcode bits. Each
+// opcode gets its own instantiation, so the operand is resolved at compile
+// time and no decoding happens at runtime.
 
-    // Divider register handler.
-    if (t_div + dur >= 0x100) {
-      mem[ADDR_DIV]++;
-    }
-    t_div += dur;
+template <uint8_t OP>
+void Environment::op_ld_r_r(uint8_t *dur) { // LD r,r' 0x40-0x7F | 1  4 (8 with (HL)) | - - - -
+  set_reg8<(OP >> 3) & 0b111>(get_reg8<OP & 0b111>());
+  *dur = ((OP >> 3) & 0b111) == 6 || (OP & 0b111) == 6 ? 8 : 4;
+}
+
+template <uint8_t OP>
+void Environment::op_ld_r_d8(uint8_t *dur) { // LD r,d8 0x06-0x3E | 2  8 (12 with (HL)) | - - - -
+  set_reg8<(OP >> 3) & 0b111>(read_next());
+  *dur = ((OP >> 3) & 0b111) == 6 ? 12 : 8;
+}
+
+template <uint8_t OP>
+void Environment::op_inc_r(uint8_t *dur) { // INC r 0x04-0x3C | 1  4 (12 with (HL)) | Z 0 H -
+  set_reg8<(OP >> 3) & 0b111>(op_inc(get_reg8<(OP >> 3) & 0b111>()));
+  *dur = ((OP >> 3) & 0b111) == 6 ? 12 : 4;
+}
+
+template <uint8_t OP>
+void Environment::op_dec_r(uint8_t *dur) { // DEC r 0x05-0x3D | 1  4 (12 with (HL)) | Z 1 H -
+  set_reg8<(OP >> 3) & 0b111>(op_dec(get_reg8<(OP >> 3) & 0b111>()));
+  *dur = ((OP >> 3) & 0b111) == 6 ? 12 : 4;
+}
+
+// ALU operation selected by bits 3-5: ADD ADC SUB SBC AND XOR OR CP.
+template <uint8_t OP>
+inline void Environment::op_alu(uint8_t val) {
+  switch ((OP >> 3) & 0b111) {
+    case 0: op_add(val, 0); break;
+    case 1: op_add(val, cpu.carry_flag()); break;
+    case 2: op_sub(val, 0, true); break;
+    case 3: op_sub(val, cpu.carry_flag(), true); break;
+    case 4: op_logic(cpu.reg_a & val, true); break;
+    case 5: op_logic(cpu.reg_a ^ val, false); break;
+    case 6: op_logic(cpu.reg_a | val, false); break;
+    case 7: op_sub(val, 0, false); break;
+  }
+}
+
+template <uint8_t OP>
+void Environment::op_alu_r(uint8_t *dur) { // ALU A,r 0x80-0xBF | 1  4 (8 with (HL)) | Z N H C
+  op_alu<OP>(get_reg8<OP & 0b111>());
+  *dur = (OP & 0b111) == 6 ? 8 : 4;
+}
+
+template <uint8_t OP>
+void Environment::op_alu_d8(uint8_t *dur) { // ALU A,d8 0xC6-0xFE | 2  8 | Z N H C
+  op_alu<OP>(read_next());
+  *dur = 8;
+}
+
+// 16-bit add into HL of the pair selected by bits 4-5: BC DE HL SP. H and C
+// come from bits 11 and 15, shifted to where f() looks for them.
+template <uint8_t OP>
+void Environment::op_add_hl(uint8_t *dur) { // ADD HL,rr 0x09-0x39 | 1  8 | - 0 H C
+  uint16_t val;
+  switch ((OP >> 4) & 0b11) {
+    case 0: val = cpu.bc(); break;
+    case 1: val = cpu.de(); break;
+    case 2: val = cpu.hl(); break;
+    default: val = cpu.reg_sp; break;
+  }
+  uint32_t res = cpu.hl() + val;
+  cpu.flag_n = false;
+  cpu.flag_h = (cpu.hl() ^ val ^ res) >> 8;
+  cpu.flag_c = res >> 8;
+  cpu.set_hl(res);
+  *dur = 8;
+}
+
+// Branch condition selected by bits 3-4: NZ Z NC C.
+template <uint8_t OP>
+inline bool Environment::condition() {
+  switch ((OP >> 3) & 0b11) {
+    case 0: return !cpu.zero_flag();
+    case 1: return cpu.zero_flag();
+    case 2: return !cpu.carry_flag();
+    default: return cpu.carry_flag();
+  }
+}
+
+template <uint8_t OP>
+void Environment::op_ret_cc(uint8_t *dur) { // RET cc 0xC0-0xD8 | 1  20/8 | - - - -
+  *dur = 8;
+  if (condition<OP>()) {
+    *dur = 20;
+    cpu.reg_pc = pop_from_stack_d16();
+  }
+}
+
+template <uint8_t OP>
+void Environment::op_jp_cc(uint8_t *dur) { // JP cc,a16 0xC2-0xDA | 3  16/12 | - - - -
+  uint16_t addr = read_next_hl();
+  *dur = 12;
+  if (condition<OP>()) {
+    *dur = 16;
+    cpu.reg_pc = addr;
+  }
+}
+
+template <uint8_t OP>
+void Environment::op_call_cc(uint8_t *dur) { // CALL cc,a16 0xC4-0xDC | 3  24/12 | - - - -
+  uint16_t addr = read_next_hl();
+  *dur = 12;
+  if (condition<OP>()) {
+    *dur = 24;
+    push_to_stack_d16(cpu.reg_pc);
+    cpu.reg_pc = addr;
+  }
+}
+
+template <uint8_t OP>
+void Environment::op_rst(uint8_t *dur) { // RST n 0xC7-0xFF | 1  16 | - - - -
+  push_to_stack_d16(cpu.reg_pc);
+  cpu.reg_pc = OP & 0x38;
+  *dur = 16;
+}
+
+// The whole 0xCB page: bits 6-7 pick shift/BIT/RES/SET, bits 3-5 the shift
+// kind or bit number and bits 0-2 the register.
+template <uint8_t OP>
+void Environment::op_cb(uint8_t *dur) { // | 2  8 (12 BIT n,(HL), 16 other (HL)) |
+  const uint8_t n = (OP >> 3) & 0b111;
+  uint8_t val = get_reg8<OP & 0b111>();
+
+  switch (OP >> 6) {
+    case 0: set_reg8<OP & 0b111>(op_shift(n, val)); break;
+    case 1: op_bit(val, n); break;
+    case 2: set_reg8<OP & 0b111>(val & ~(1 << n)); break;
+    case 3: set_reg8<OP & 0b111>(val | (1 << n)); break;
+  }
+
+  if ((OP & 0b111) != 6) {
+    *dur = 8;
+  } else {
+    *dur = OP >> 6 == 1 ? 12 : 16;
+  }
+}
+
+void Environment::op_0x00(uint8_t *dur) { // NOP | 1  4 | - - - -
+  *dur = 4;
+}
+
+void Environment::op_0x01(uint8_t *dur) { // LD BC,d16 | 3  12 | - - - -
+  cpu.set_bc(read_next_hl());
+  *dur = 12;
+}
+
+void Environment::op_0x02(uint8_t *dur) { // LD (BC),A | 1  8 | - - - -
+  set_mem(cpu.bc(), cpu.reg_a);
+  *dur = 8;
+}
+
+void Environment::op_0x03(uint8_t *dur) { // INC BC | 1  8 | - - - -
+  cpu.inc_bc();
+  *dur = 8;
+}
+
+void Environment::op_0x07(uint8_t *dur) { // RLCA | 1  4 | 0 0 0 C
+  cpu.reg_a = op_shift(0, cpu.reg_a);
+  cpu.flag_z = 1;
+  *dur = 4;
+}
+
+void Environment::op_0x08(uint8_t *dur) { // LD (a16),SP | 3  20 | - - - -
+  uint16_t addr = read_next_hl();
+  set_mem(addr, cpu.reg_sp & 0xFF);
+  set_mem(addr + 1, cpu.reg_sp >> 8);
+  *dur = 20;
+}
+
+void Environment::op_0x0A(uint8_t *dur) { // LD A,(BC) | 1  8 | - - - -
+  cpu.reg_a = get_mem(cpu.bc());
+  *dur = 8;
+}
+
+void Environment::op_0x0B(uint8_t *dur) { // DEC BC | 1  8 | - - - -
+  cpu.dec_bc();
+  *dur = 8;
+}
+
+void Environment::op_0x0F(uint8_t *dur) { // RRCA | 1  4 | 0 0 0 C
+  cpu.reg_a = op_shift(1, cpu.reg_a);
+  cpu.flag_z = 1;
+  *dur = 4;
+}
+
+void Environment::op_0x10(uint8_t *dur) { // STOP 0 | 2  4 | - - - -
+  // Without a joypad only an interrupt can end it, so it behaves like HALT.
+  read_next();
+  cpu.halted = true;
+  irq_check = true;
+  *dur = 4;
+}
+
+void Environment::op_0x11(uint8_t *dur) { // LD DE,d16 | 3  12 | - - - -
+  cpu.set_de(read_next_hl());
+  *dur = 12;
+}
+
+void Environment::op_0x12(uint8_t *dur) { // LD (DE),A | 1  8 | - - - -
+  set_mem(cpu.de(), cpu.reg_a);
+  *dur = 8;
+}
+
+void Environment::op_0x13(uint8_t *dur) { // INC DE | 1  8 | - - - -
+  cpu.inc_de();
+  *dur = 8;
+}
+
+void Environment::op_0x17(uint8_t *dur) { // RLA | 1  4 | 0 0 0 C
+  cpu.reg_a = op_shift(2, cpu.reg_a);
+  cpu.flag_z = 1;
+  *dur = 4;
+}
+
+void Environment::op_0x18(uint8_t *dur) { // JR r8 | 2  12 | - - - -
+  char offset = (char) read_next();
+  cpu.reg_pc += offset;
+  *dur = 12;
+}
+
+void Environment::op_0x1A(uint8_t *dur) { // LD A,(DE) | 1  8 | - - - -
+  cpu.reg_a = get_mem(cpu.de());
+  *dur = 8;
+}
+
+void Environment::op_0x1B(uint8_t *dur) { // DEC DE | 1  8 | - - - -
+  cpu.dec_de();
+  *dur = 8;
+}
+
+void Environment::op_0x1F(uint8_t *dur) { // RRA | 1  4 | 0 0 0 C
+  cpu.reg_a = op_shift(3, cpu.reg_a);
+  cpu.flag_z = 1;
+  *dur = 4;
+}
+
+void Environment::op_0x20(uint8_t *dur) { // JR NZ,r8 | 2  12/8 | - - - -
+  char offset = (char) read_next();
+  *dur = 8;
+
+  if (!cpu.zero_flag()) {
+    *dur = 12;
+    cpu.reg_pc += offset;
+  }
+}
+
+void Environment::op_0x21(uint8_t *dur) { // LD HL,d16 | 3  12 | - - - -
+  cpu.reg_l = read_next();
+  cpu.reg_h = read_next();
+  *dur = 12;
+}
+
+void Environment::op_0x22(uint8_t *dur) { // LD (HL+),A | 1  8 | - - - -
+  set_mem(cpu.hl(), cpu.reg_a);
+  cpu.inc_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x23(uint8_t *dur) { // INC HL | 1  8 | - - - -
+  cpu.inc_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x27(uint8_t *dur) { // DAA | 1  4 | Z - 0 C
+  // Adjusts A back to BCD after an add or a subtract of two BCD numbers.
+  uint8_t res = cpu.reg_a;
+  bool carry = cpu.carry_flag();
+  bool half_carry = cpu.flag_h & 0x10;
+  if (!cpu.flag_n) {
+    if (carry || res > 0x99) {
+      res += 0x60;
+      carry = true;
+    }
+    if (half_carry || (res & 0x0F) > 0x09) res += 0x06;
+  } else {
+    if (carry) res -= 0x60;
+    if (half_carry) res -= 0x06;
+  }
+  cpu.reg_a = res;
+  cpu.flag_z = res;
+  cpu.flag_h = 0;
+  cpu.flag_c = carry << 8;
+  *dur = 4;
+}
+
+void Environment::op_0x28(uint8_t *dur) { // JR Z,r8 | 2  12/8 | - - - -
+  *dur = 8;
+  char offset = (char) read_next();
+
+  if (cpu.zero_flag()) {
+    *dur = 12;
+    cpu.reg_pc += offset;
+  }
+}
+
+void Environment::op_0x2A(uint8_t *dur) { // LD A,(HL+) | 1  8 | - - - -
+  cpu.reg_a = get_mem(cpu.hl());
+  cpu.inc_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x2B(uint8_t *dur) { // DEC HL | 1  8 | - - - -
+  cpu.dec_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x2F(uint8_t *dur) { // CPL | 1  4 | - 1 1 -
+  cpu.reg_a = ~cpu.reg_a;
+  cpu.flag_n = true;
+  cpu.flag_h = 1 << 4;
+  *dur = 4;
+}
+
+void Environment::op_0x30(uint8_t *dur) { // JR NC,r8 | 2  12/8 | - - - -
+  *dur = 8;
+  char offset = (char) read_next();
+
+  if (!cpu.carry_flag()) {
+    *dur = 12;
+    cpu.reg_pc += offset;
+  }
+}
+
+void Environment::op_0x31(uint8_t *dur) { // LD SP,d16 | 3  12 | - - - -
+  cpu.reg_sp = read_next_hl();
+  *dur = 12;
+}
+
+void Environment::op_0x32(uint8_t *dur) { // LD (HL-),A | 1  8 | - - - -
+  set_mem(cpu.hl(), cpu.reg_a);
+  cpu.dec_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x33(uint8_t *dur) { // INC SP | 1  8 | - - - -
+  cpu.reg_sp++;
+  *dur = 8;
+}
 
-    // Timer counter handler.
-    handle_timer_counter(dur);
+void Environment::op_0x37(uint8_t *dur) { // SCF | 1  4 | - 0 0 1
+  cpu.flag_n = false;
+  cpu.flag_h = 0;
+  cpu.flag_c = 1 << 8;
+  *dur = 4;
+}
+
+void Environment::op_0x38(uint8_t *dur) { // JR C,r8 | 2  12/8 | - - - -
+  *dur = 8;
+  char offset = (char) read_next();
 
-    cycle++;
+  if (cpu.carry_flag()) {
+    *dur = 12;
+    cpu.reg_pc += offset;
   }
 }
+
+void Environment::op_0x3A(uint8_t *dur) { // LD A,(HL-) | 1  8 | - - - -
+  cpu.reg_a = get_mem(cpu.hl());
+  cpu.dec_hl();
+  *dur = 8;
+}
+
+void Environment::op_0x3B(uint8_t *dur) { // DEC SP | 1  8 | - - - -
+  cpu.reg_sp--;
+  *dur = 8;
+}
+
+void Environment::op_0x3F(uint8_t *dur) { // CCF | 1  4 | - 0 0 C
+  cpu.flag_n = false;
+  cpu.flag_h = 0;
+  cpu.flag_c = !cpu.carry_flag() << 8;
+  *dur = 4;
+}
+
+void Environment::op_0x76(uint8_t *dur) { // HALT | 1  4 | - - - -
+  cpu.halted = true;
+  irq_check = true;
+  *dur = 4;
+}
+
+void Environment::op_0xC1(uint8_t *dur) { // POP BC | 1  12 | - - - -
+  *dur = 12;
+  cpu.set_bc(pop_from_stack_d16());
+}
+
+void Environment::op_0xC3(uint8_t *dur) { // JP a16 | 3  16 | - - - -
+  cpu.reg_pc = read_next_hl();
+  *dur = 16;
+}
+
+void Environment::op_0xC5(uint8_t *dur) { // PUSH BC | 1  16 | - - - -
+  push_to_stack_d16(cpu.bc());
+  *dur = 16;
+}
+
+void Environment::op_0xC9(uint8_t *dur) { // RET | 1  16 | - - - -
+  cpu.reg_pc = pop_from_stack_d16();
+  *dur = 16;
+}
+
+void Environment::op_0xCB(uint8_t *dur) { // PREFIX CB | 1  4 | - - - -
+  *dur = 4;
+
+  uint8_t cmd = read_next();
+  #ifdef TRACE
+    trace.record_cb(cmd);
+  #endif
+  STAT(stats.cb_opcodes[cmd]++);
+  DISPATCH(ops_cb, cmd, dur);
+}
+
+void Environment::op_0xCD(uint8_t *dur) { // CALL a16 | 3  24 | - - - -
+  uint16_t addr = read_next_hl();
+  push_to_stack_d16(cpu.reg_pc);
+  cpu.reg_pc = addr;
+  *dur = 24;
+}
+
+void Environment::op_0xD1(uint8_t *dur) { // POP DE | 1  12 | - - - -
+  *dur = 12;
+  cpu.set_de(pop_from_stack_d16());
+}
+
+void Environment::op_0xD5(uint8_t *dur) { // PUSH DE | 1  16 | - - - -
+  push_to_stack_d16(cpu.de());
+  *dur = 16;
+}
+
+void Environment::op_0xD9(uint8_t *dur) { // RETI | 1  16 | - - - -
+  cpu.reg_pc = pop_from_stack_d16();
+  cpu.ime = true;
+  irq_check = true;
+  *dur = 16;
+}
+
+void Environment::op_0xE0(uint8_t *dur) { // LDH (a8),A | 2  12 | - - - -
+  *dur = 12;
+  uint16_t addr = 0xFF00 | read_next();
+  set_mem(addr, cpu.reg_a);
+}
+
+void Environment::op_0xE1(uint8_t *dur) { // POP HL | 1  12 | - - - -
+  *dur = 12;
+  cpu.set_hl(pop_from_stack_d16());
+}
+
+void Environment::op_0xE2(uint8_t *dur) { // LD (C),A | 1  8 | - - - -
+  uint16_t addr = 0xFF00 | cpu.reg_c;
+  set_mem(addr, cpu.reg_a);
+  *dur = 8;
+}
+
+void Environment::op_0xE5(uint8_t *dur) { // PUSH HL | 1  16 | - - - -
+  push_to_stack_d16(cpu.hl());
+  *dur = 16;
+}
+
+void Environment::op_0xE8(uint8_t *dur) { // ADD SP,r8 | 2  16 | 0 0 H C
+  cpu.reg_sp = op_add_sp(read_next());
+  *dur = 16;
+}
+
+void Environment::op_0xE9(uint8_t *dur) { // JP (HL) | 1  4 | - - - -
+  cpu.reg_pc = cpu.hl();
+  *dur = 4;
+}
+
+void Environment::op_0xEA(uint8_t *dur) { // LD (a16),A | 3  16 | - - - -
+  set_mem(read_next_hl(), cpu.reg_a);
+  *dur = 16;
+}
+
+void Environment::op_0xF0(uint8_t *dur) { // LDH A,(a8) | 2  12 | - - - -
+  *dur = 12;
+  uint16_t addr = 0xFF00 | read_next();
+  cpu.reg_a = get_mem(addr);
+}
+
+void Environment::op_0xF1(uint8_t *dur) { // POP AF | 1  12 | Z N H C
+  *dur = 12;
+  cpu.set_af(pop_from_stack_d16());
+}
+
+void Environment::op_0xF2(uint8_t *dur) { // LD A,(C) | 1  8 | - - - -
+  uint16_t addr = 0xFF00 | cpu.reg_c;
+  cpu.reg_a = get_mem(addr);
+  *dur = 8;
+}
+
+void Environment::op_0xF3(uint8_t *dur) { // DI | 1  4 | - - - -
+  cpu.ime = false;
+  cpu.ime_pending = false;
+  *dur = 4;
+}
+
+void Environment::op_0xF5(uint8_t *dur) { // PUSH AF | 1  16 | - - - -
+  push_to_stack_d16(cpu.af());
+  *dur = 16;
+}
+
+void Environment::op_0xF8(uint8_t *dur) { // LD HL,SP+r8 | 2  12 | 0 0 H C
+  cpu.set_hl(op_add_sp(read_next()));
+  *dur = 12;
+}
+
+void Environment::op_0xF9(uint8_t *dur) { // LD SP,HL | 1  8 | - - - -
+  cpu.reg_sp = cpu.hl();
+  *dur = 8;
+}
+
+void Environment::op_0xFA(uint8_t *dur) { // LD A,(a16) | 3  16 | - - - -
+  cpu.reg_a = get_mem(read_next_hl());
+  *dur = 16;
+}
+
+void Environment::op_0xFB(uint8_t *dur) { // EI | 1  4 | - - - -
+  cpu.ime_pending = true;
+  irq_check = true;
+  *dur = 4;
+}
+
+const OpHandler Environment::ops[0x100] = {
+  &Environment::op_0x00, &Environment::op_0x01, &Environment::op_0x02, &Environment::op_0x03,
+  &Environment::op_inc_r<0x04>, &Environment::op_dec_r<0x05>, &Environment::op_ld_r_d8<0x06>, &Environment::op_0x07,
+  &Environment::op_0x08, &Environment::op_add_hl<0x09>, &Environment::op_0x0A, &Environment::op_0x0B,
+  &Environment::op_inc_r<0x0C>, &Environment::op_dec_r<0x0D>, &Environment::op_ld_r_d8<0x0E>, &Environment::op_0x0F,
+  &Environment::op_0x10, &Environment::op_0x11, &Environment::op_0x12, &Environment::op_0x13,
+  &Environment::op_inc_r<0x14>, &Environment::op_dec_r<0x15>, &Environment::op_ld_r_d8<0x16>, &Environment::op_0x17,
+  &Environment::op_0x18, &Environment::op_add_hl<0x19>, &Environment::op_0x1A, &Environment::op_0x1B,
+  &Environment::op_inc_r<0x1C>, &Environment::op_dec_r<0x1D>, &Environment::op_ld_r_d8<0x1E>, &Environment::op_0x1F,
+  &Environment::op_0x20, &Environment::op_0x21, &Environment::op_0x22, &Environment::op_0x23,
+  &Environment::op_inc_r<0x24>, &Environment::op_dec_r<0x25>, &Environment::op_ld_r_d8<0x26>, &Environment::op_0x27,
+  &Environment::op_0x28, &Environment::op_add_hl<0x29>, &Environment::op_0x2A, &Environment::op_0x2B,
+  &Environment::op_inc_r<0x2C>, &Environment::op_dec_r<0x2D>, &Environment::op_ld_r_d8<0x2E>, &Environment::op_0x2F,
+  &Environment::op_0x30, &Environment::op_0x31, &Environment::op_0x32, &Environment::op_0x33,
+  &Environment::op_inc_r<0x34>, &Environment::op_dec_r<0x35>, &Environment::op_ld_r_d8<0x36>, &Environment::op_0x37,
+  &Environment::op_0x38, &Environment::op_add_hl<0x39>, &Environment::op_0x3A, &Environment::op_0x3B,
+  &Environment::op_inc_r<0x3C>, &Environment::op_dec_r<0x3D>, &Environment::op_ld_r_d8<0x3E>, &Environment::op_0x3F,
+  &Environment::op_ld_r_r<0x40>, &Environment::op_ld_r_r<0x41>, &Environment::op_ld_r_r<0x42>, &Environment::op_ld_r_r<0x43>,
+  &Environment::op_ld_r_r<0x44>, &Environment::op_ld_r_r<0x45>, &Environment::op_ld_r_r<0x46>, &Environment::op_ld_r_r<0x47>,
+  &Environment::op_ld_r_r<0x48>, &Environment::op_ld_r_r<0x49>, &Environment::op_ld_r_r<0x4A>, &Environment::op_ld_r_r<0x4B>,
+  &Environment::op_ld_r_r<0x4C>, &Environment::op_ld_r_r<0x4D>, &Environment::op_ld_r_r<0x4E>, &Environment::op_ld_r_r<0x4F>,
+  &Environment::op_ld_r_r<0x50>, &Environment::op_ld_r_r<0x51>, &Environment::op_ld_r_r<0x52>, &Environment::op_ld_r_r<0x53>,
+  &Environment::op_ld_r_r<0x54>, &Environment::op_ld_r_r<0x55>, &Environment::op_ld_r_r<0x56>, &Environment::op_ld_r_r<0x57>,
+  &Environment::op_ld_r_r<0x58>, &Environment::op_ld_r_r<0x59>, &Environment::op_ld_r_r<0x5A>, &Environment::op_ld_r_r<0x5B>,
+  &Environment::op_ld_r_r<0x5C>, &Environment::op_ld_r_r<0x5D>, &Environment::op_ld_r_r<0x5E>, &Environment::op_ld_r_r<0x5F>,
+  &Environment::op_ld_r_r<0x60>, &Environment::op_ld_r_r<0x61>, &Environment::op_ld_r_r<0x62>, &Environment::op_ld_r_r<0x63>,
+  &Environment::op_ld_r_r<0x64>, &Environment::op_ld_r_r<0x65>, &Environment::op_ld_r_r<0x66>, &Environment::op_ld_r_r<0x67>,
+  &Environment::op_ld_r_r<0x68>, &Environment::op_ld_r_r<0x69>, &Environment::op_ld_r_r<0x6A>, &Environment::op_ld_r_r<0x6B>,
+  &Environment::op_ld_r_r<0x6C>, &Environment::op_ld_r_r<0x6D>, &Environment::op_ld_r_r<0x6E>, &Environment::op_ld_r_r<0x6F>,
+  &Environment::op_ld_r_r<0x70>, &Environment::op_ld_r_r<0x71>, &Environment::op_ld_r_r<0x72>, &Environment::op_ld_r_r<0x73>,
+  &Environment::op_ld_r_r<0x74>, &Environment::op_ld_r_r<0x75>, &Environment::op_0x76, &Environment::op_ld_r_r<0x77>,
+  &Environment::op_ld_r_r<0x78>, &Environment::op_ld_r_r<0x79>, &Environment::op_ld_r_r<0x7A>, &Environment::op_ld_r_r<0x7B>,
+  &Environment::op_ld_r_r<0x7C>, &Environment::op_ld_r_r<0x7D>, &Environment::op_ld_r_r<0x7E>, &Environment::op_ld_r_r<0x7F>,
+  &Environment::op_alu_r<0x80>, &Environment::op_alu_r<0x81>, &Environment::op_alu_r<0x82>, &Environment::op_alu_r<0x83>,
+  &Environment::op_alu_r<0x84>, &Environment::op_alu_r<0x85>, &Environment::op_alu_r<0x86>, &Environment::op_alu_r<0x87>,
+  &Environment::op_alu_r<0x88>, &Environment::op_alu_r<0x89>, &Environment::op_alu_r<0x8A>, &Environment::op_alu_r<0x8B>,
+  &Environment::op_alu_r<0x8C>, &Environment::op_alu_r<0x8D>, &Environment::op_alu_r<0x8E>, &Environment::op_alu_r<0x8F>,
+  &Environment::op_alu_r<0x90>, &Environment::op_alu_r<0x91>, &Environment::op_alu_r<0x92>, &Environment::op_alu_r<0x93>,
+  &Environment::op_alu_r<0x94>, &Environment::op_alu_r<0x95>, &Environment::op_alu_r<0x96>, &Environment::op_alu_r<0x97>,
+  &Environment::op_alu_r<0x98>, &Environment::op_alu_r<0x99>, &Environment::op_alu_r<0x9A>, &Environment::op_alu_r<0x9B>,
+  &Environment::op_alu_r<0x9C>, &Environment::op_alu_r<0x9D>, &Environment::op_alu_r<0x9E>, &Environment::op_alu_r<0x9F>,
+  &Environment::op_alu_r<0xA0>, &Environment::op_alu_r<0xA1>, &Environment::op_alu_r<0xA2>, &Environment::op_alu_r<0xA3>,
+  &Environment::op_alu_r<0xA4>, &Environment::op_alu_r<0xA5>, &Environment::op_alu_r<0xA6>, &Environment::op_alu_r<0xA7>,
+  &Environment::op_alu_r<0xA8>, &Environment::op_alu_r<0xA9>, &Environment::op_alu_r<0xAA>, &Environment::op_alu_r<0xAB>,
+  &Environment::op_alu_r<0xAC>, &Environment::op_alu_r<0xAD>, &Environment::op_alu_r<0xAE>, &Environment::op_alu_r<0xAF>,
+  &Environment::op_alu_r<0xB0>, &Environment::op_alu_r<0xB1>, &Environment::op_alu_r<0xB2>, &Environment::op_alu_r<0xB3>,
+  &Environment::op_alu_r<0xB4>, &Environment::op_alu_r<0xB5>, &Environment::op_alu_r<0xB6>, &Environment::op_alu_r<0xB7>,
+  &Environment::op_alu_r<0xB8>, &Environment::op_alu_r<0xB9>, &Environment::op_alu_r<0xBA>, &Environment::op_alu_r<0xBB>,
+  &Environment::op_alu_r<0xBC>, &Environment::op_alu_r<0xBD>, &Environment::op_alu_r<0xBE>, &Environment::op_alu_r<0xBF>,
+  &Environment::op_ret_cc<0xC0>, &Environment::op_0xC1, &Environment::op_jp_cc<0xC2>, &Environment::op_0xC3,
+  &Environment::op_call_cc<0xC4>, &Environment::op_0xC5, &Environment::op_alu_d8<0xC6>, &Environment::op_rst<0xC7>,
+  &Environment::op_ret_cc<0xC8>, &Environment::op_0xC9, &Environment::op_jp_cc<0xCA>, &Environment::op_0xCB,
+  &Environment::op_call_cc<0xCC>, &Environment::op_0xCD, &Environment::op_alu_d8<0xCE>, &Environment::op_rst<0xCF>,
+  &Environment::op_ret_cc<0xD0>, &Environment::op_0xD1, &Environment::op_jp_cc<0xD2>, &Environment::op_unknown,
+  &Environment::op_call_cc<0xD4>, &Environment::op_0xD5, &Environment::op_alu_d8<0xD6>, &Environment::op_rst<0xD7>,
+  &Environment::op_ret_cc<0xD8>, &Environment::op_0xD9, &Environment::op_jp_cc<0xDA>, &Environment::op_unknown,
+  &Environment::op_call_cc<0xDC>, &Environment::op_unknown, &Environment::op_alu_d8<0xDE>, &Environment::op_rst<0xDF>,
+  &Environment::op_0xE0, &Environment::op_0xE1, &Environment::op_0xE2, &Environment::op_unknown,
+  &Environment::op_unknown, &Environment::op_0xE5, &Environment::op_alu_d8<0xE6>, &Environment::op_rst<0xE7>,
+  &Environment::op_0xE8, &Environment::op_0xE9, &Environment::op_0xEA, &Environment::op_unknown,
+  &Environment::op_unknown, &Environment::op_unknown, &Environment::op_alu_d8<0xEE>, &Environment::op_rst<0xEF>,
+  &Environment::op_0xF0, &Environment::op_0xF1, &Environment::op_0xF2, &Environment::op_0xF3,
+  &Environment::op_unknown, &Environment::op_0xF5, &Environment::op_alu_d8<0xF6>, &Environment::op_rst<0xF7>,
+  &Environment::op_0xF8, &Environment::op_0xF9, &Environment::op_0xFA, &Environment::op_0xFB,
+  &Environment::op_unknown, &Environment::op_unknown, &Environment::op_alu_d8<0xFE>, &Environment::op_rst<0xFF>,
+};
+
+#define OP_CB_4(n) &Environment::op_cb<(n)>, &Environment::op_cb<(n) + 1>, &Environment::op_cb<(n) + 2>, &Environment::op_cb<(n) + 3>
+#define OP_CB_16(n) OP_CB_4(n), OP_CB_4((n) + 4), OP_CB_4((n) + 8), OP_CB_4((n) + 12)
+#define OP_CB_64(n) OP_CB_16(n), OP_CB_16((n) + 16), OP_CB_16((n) + 32), OP_CB_16((n) + 48)
+
+const OpHandler Environment::ops_cb[0x100] = {
+  OP_CB_64(0x00), OP_CB_64(0x40), OP_CB_64(0x80), OP_CB_64(0xC0),
+};
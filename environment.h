@@ -1,26 +1,102 @@
 #pragma once
 
+#include "blockcache.h"
 #include "cpu.h"
 #include <cstdint>
 #include "defines.h"
 #include <memory>
+#include <vector>
 #include "debugger.h"
+#include "memory.h"
+#include "ppu.h"
+#include "profiler.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
 
 using namespace std;
 
+class Cartridge;
+struct MachineState;
+
 class Environment {
 public:
-  Environment(unique_ptr<uint8_t>&&);
+  Environment(unique_ptr<uint8_t[]>&&);
+  void insert_cartridge(Cartridge *);
   void reset();
   void run();
+  bool step();
+  uint64_t cycles();
+  const char *crash_message();
+  uint64_t register_hash();
+  uint64_t memory_hash();
+  uint64_t run_for(uint64_t);
+  void enable_blocks(bool);
+  bool enable_jit(bool, bool = false);  // The second one checks every native run.
+  uint8_t peek_mem(uint16_t);  // Without side effects, for tools.
+  CPU &registers();  // For tools that set the machine up directly.
+  Debugger &debugger();
+  bool save_trace(const string &);  // Fails when built with NO_TRACE.
+
+  // Exact profile of the guest, see profiler.h. It watches every instruction
+  // so it turns blocks off. Fails when built with NO_PROFILER.
+  bool enable_profiler(bool);
+  bool report_profile(FILE *, size_t);
+  bool save_profile(const string &);  // Folded stacks.
+
+  // Host counters as JSON. Fails when built with NO_STATS.
+  bool write_stats(FILE *);
+  bool save_stats(const string &);
+
+  // Save states, laid out as described in savestate.h. A delta holds the
+  // pages that changed since the full state passed along with it.
+  void save_state(vector<uint8_t> &);
+  bool save_delta(const vector<uint8_t> &, vector<uint8_t> &);
+  bool load_state(const vector<uint8_t> &);
+  bool load_delta(const vector<uint8_t> &, const vector<uint8_t> &);
+
+  // Keeps the state of every frame of the last seconds for rewinding, with a
+  // keyframe every so many frames.
+  void enable_rewind(size_t, size_t = REWIND_FRAME_RATE);
+  bool rewind_frames(size_t);
+  size_t rewind_bytes();
+
+  // Points pages at plain memory (either pointer may be null) and sets the
+  // handler used for whatever is not plain memory. Used by the cartridge MBC
+  // to switch banks.
+  void map_mem(uint16_t, size_t, uint8_t *, uint8_t *, MemHandler * = nullptr);
+  bool boot_rom_mapped();  // Over page 0, until 0xFF50 is written.
+
+  // Sends the page's reads and/or writes (WATCH_READ, WATCH_WRITE) through
+  // the debugger, or 0 to stop. Watching page 0xFF also takes HRAM off the
+  // inline path.
+  void watch_page(uint8_t, uint8_t);
 
 private:
   CPU cpu;
-  unique_ptr<uint8_t> rom;
+  unique_ptr<uint8_t[]> rom; // Boot ROM, may be null to start from the cartridge.
+  Cartridge *cart;
   uint64_t t;
-  uint8_t t_div;
-  uint16_t t_tima;
+
+  // Peripherals run on catch-up. Each schedules the cycle of its next
+  // observable event and step() only compares t against the earliest one.
+  Scheduler sched;
+  uint64_t div_base;        // t when the divider was last reset.
+  uint64_t timer_synced;    // t that TIMA has been brought up to.
+  uint16_t timer_period;    // Cycles per TIMA increment, 0 when stopped.
+  bool crashed;
+  char crash_msg[80];
+  bool irq_check;  // IE, IF or IME may have changed since the last check.
   Debugger dbg;
+  TraceBuffer trace;
+  unique_ptr<Profiler> profiler;  // Null unless enabled.
+  Stats stats;
+  uint64_t stats_frame;           // PPU frame last timed.
+
+  unique_ptr<Rewind> rewind;      // Null unless enabled.
+  uint64_t rewind_frame;          // PPU frame last recorded.
+  vector<uint8_t> rewind_state;   // Scratch buffer for the states.
 
   // 0x0000-0x3FFF: Permanently-mapped ROM bank.
   // 0x4000-0x7FFF: Area for switchable ROM banks.
@@ -28,38 +104,207 @@ private:
   // 0xA000-0xBFFF: Area for switchable external RAM banks.
   // 0xC000-0xCFFF: Game Boy’s working RAM bank 0 .
   // 0xD000-0xDFFF: Game Boy’s working RAM bank 1.
+  // 0xE000-0xFDFF: Echo of 0xC000-0xDDFF.
   // 0xFE00-0xFEFF: Sprite Attribute Table.
   // 0xFF00-0xFF7F: Devices’ Mappings. Used to access I/O devices.
   // 0xFF80-0xFFFE: High RAM Area.
   // 0xFFFF: Interrupt Enable Register.
-  uint8_t mem[MEM_SIZE];
+  //
+  // Each region has its own backing store; mirrors such as echo RAM are
+  // aliases in the memory map rather than copies.
+  //
+  // ROM and external RAM live in the cartridge.
+  uint8_t vram[0x2000];
+  uint8_t wram[0x2000];
+  uint8_t oam[0x100];
+  uint8_t io[0x100];  // 0xFF00-0xFFFF: I/O registers, HRAM and IE.
+
+  PPU ppu;
+
+  // Memory map of 256-byte pages. Pages with a read/write pointer are plain
+  // memory accessed with a single indexed load/store; the rest go through the
+  // page's handler slot or the I/O registers.
+  uint8_t    *mem_read[0x100];
+  uint8_t    *mem_write[0x100];
+  MemHandler *mem_handler[0x100];
+
+  // Page of the last opcode fetch, so straight-line code skips the map lookup.
+  // fetch_page_num is 0x100 when no page is cached.
+  uint8_t  *fetch_page;
+  uint16_t  fetch_page_num;
+
+  // Writes into RAM pages holding cached blocks land here, see blockcache.h.
+  struct CodeGuard : public MemHandler {
+    Environment *env;
+    CodeGuard(Environment *);
+    uint8_t read(uint16_t);
+    void write(uint16_t, uint8_t);
+  };
 
-  uint8_t   get_mem(uint16_t);
-  uint8_t * get_mem_ptr(uint16_t);
-  void      set_mem(uint16_t, uint8_t);
-  uint8_t   read_next();
+  // Accesses to watched pages land here, see debugger.h.
+  struct WatchGuard : public MemHandler {
+    Environment *env;
+    WatchGuard(Environment *);
+    uint8_t read(uint16_t);
+    void write(uint16_t, uint8_t);
+  };
+
+  uint8_t     watch_kinds[0x100];
+  uint8_t    *watch_read[0x100];     // The page's mapping before it was watched.
+  uint8_t    *watch_write[0x100];
+  MemHandler *watch_handler[0x100];
+  WatchGuard  watch_guard;
+
+  // Basic-block cache, null unless enabled.
+  unique_ptr<Block[]> blocks;
+  uint16_t    page_blocks[0x100];       // Valid blocks starting in each page.
+  uint8_t    *code_write[0x100];        // Write pointer of each guarded page.
+  MemHandler *code_handler[0x100];      // Its handler before it was guarded.
+  uint8_t     code_invalidations[0x100];
+  bool        block_broken;             // The running block was invalidated.
+  CodeGuard   code_guard;
+
+  // Recompiler for hot blocks, null unless enabled.
+  unique_ptr<Jit> jit;
+  bool        jit_check;  // Replay native runs on the interpreter and compare.
+
+  void      reset_mem_map();
+  void      install_watch(uint8_t);
+  void      map_cartridge();
+
+  size_t    state_pages();
+  uint8_t  *state_page(size_t);
+  bool      check_state(const vector<uint8_t> &, uint16_t);
+  void      save_machine(MachineState &);
+  void      load_machine(const MachineState &);
+
+  inline uint8_t get_mem(uint16_t);
+  inline void    set_mem(uint16_t, uint8_t);
+  uint8_t   get_mem_slow(uint16_t);
+  void      set_mem_slow(uint16_t, uint8_t);
+  uint8_t   read_io(uint16_t);
+  void      write_io(uint16_t, uint8_t);
+  inline uint8_t read_next();
   uint16_t  read_next_hl();
 
-  inline void set_flag(uint8_t, bool);
-  void set_zero_flag(bool);
-  void set_substract_flag(bool);
-  void set_half_carry_flag(bool);
-  void set_carry_flag(bool);
+  void      emulate();
+  uint32_t  run_block(uint64_t);
+  Block    *find_block(uint16_t);
+  void      guard_page(uint8_t);
+  void      unguard_page(uint8_t);
+  void      drop_blocks(uint8_t);
+  void      compile_block(Block &);
+  bool      run_native(const Block &);
+
+  void crash(const char *, ...);
 
   void push_to_stack_d8(uint8_t);
   void push_to_stack_d16(uint16_t);
   uint8_t  pop_from_stack_d8();
   uint16_t pop_from_stack_d16();
 
-  void handle_timer_counter(uint8_t);
+  void run_events();
+  void record_frame();
+  void sync_ppu();
+  void sync_timer();
+  void schedule_timer();
+  void finish_serial();
   void handle_interrupt();
 
-  void op_bit_n_d8(uint8_t, uint8_t *, unsigned int);
-  // @todo op inc and dec should include &dur
-  void op_inc(uint8_t *);
-  void op_dec(uint8_t *);
-  void op_rlc_n(uint8_t *, uint8_t *);
-  void op_rrc_n(uint8_t *, uint8_t *);
-  void op_rl_n(uint8_t *, uint8_t *);
-  void op_rr_n(uint8_t *, uint8_t *);
+  template <uint8_t R> uint8_t get_reg8();
+  template <uint8_t R> void set_reg8(uint8_t);
+
+  uint8_t op_inc(uint8_t);
+  uint8_t op_dec(uint8_t);
+  void op_add(uint8_t, uint8_t);
+  void op_sub(uint8_t, uint8_t, bool);
+  void op_logic(uint8_t, bool);
+  void op_bit(uint8_t, unsigned int);
+  uint8_t op_shift(uint8_t, uint8_t);
+  uint16_t op_add_sp(uint8_t);
+
+  // Opcode handlers, indexed by the opcode (and by the byte after 0xCB).
+  static const OpHandler ops[0x100];
+  static const OpHandler ops_cb[0x100];
+
+  void op_unknown(uint8_t *);
+  void op_cb_unknown(uint8_t *);
+
+  template <uint8_t OP> void op_ld_r_r(uint8_t *);
+  template <uint8_t OP> void op_ld_r_d8(uint8_t *);
+  template <uint8_t OP> void op_inc_r(uint8_t *);
+  template <uint8_t OP> void op_dec_r(uint8_t *);
+  template <uint8_t OP> void op_alu(uint8_t);
+  template <uint8_t OP> void op_alu_r(uint8_t *);
+  template <uint8_t OP> void op_alu_d8(uint8_t *);
+  template <uint8_t OP> void op_cb(uint8_t *);
+  template <uint8_t OP> void op_add_hl(uint8_t *);
+  template <uint8_t OP> bool condition();
+  template <uint8_t OP> void op_ret_cc(uint8_t *);
+  template <uint8_t OP> void op_jp_cc(uint8_t *);
+  template <uint8_t OP> void op_call_cc(uint8_t *);
+  template <uint8_t OP> void op_rst(uint8_t *);
+
+  void op_0x00(uint8_t *);
+  void op_0x01(uint8_t *);
+  void op_0x02(uint8_t *);
+  void op_0x03(uint8_t *);
+  void op_0x07(uint8_t *);
+  void op_0x08(uint8_t *);
+  void op_0x0A(uint8_t *);
+  void op_0x0B(uint8_t *);
+  void op_0x0F(uint8_t *);
+  void op_0x10(uint8_t *);
+  void op_0x11(uint8_t *);
+  void op_0x12(uint8_t *);
+  void op_0x13(uint8_t *);
+  void op_0x17(uint8_t *);
+  void op_0x18(uint8_t *);
+  void op_0x1A(uint8_t *);
+  void op_0x1B(uint8_t *);
+  void op_0x1F(uint8_t *);
+  void op_0x20(uint8_t *);
+  void op_0x21(uint8_t *);
+  void op_0x22(uint8_t *);
+  void op_0x23(uint8_t *);
+  void op_0x27(uint8_t *);
+  void op_0x28(uint8_t *);
+  void op_0x2A(uint8_t *);
+  void op_0x2B(uint8_t *);
+  void op_0x2F(uint8_t *);
+  void op_0x30(uint8_t *);
+  void op_0x31(uint8_t *);
+  void op_0x32(uint8_t *);
+  void op_0x33(uint8_t *);
+  void op_0x37(uint8_t *);
+  void op_0x38(uint8_t *);
+  void op_0x3A(uint8_t *);
+  void op_0x3B(uint8_t *);
+  void op_0x3F(uint8_t *);
+  void op_0x76(uint8_t *);
+  void op_0xC1(uint8_t *);
+  void op_0xC3(uint8_t *);
+  void op_0xC5(uint8_t *);
+  void op_0xC9(uint8_t *);
+  void op_0xCB(uint8_t *);
+  void op_0xCD(uint8_t *);
+  void op_0xD1(uint8_t *);
+  void op_0xD5(uint8_t *);
+  void op_0xD9(uint8_t *);
+  void op_0xE0(uint8_t *);
+  void op_0xE1(uint8_t *);
+  void op_0xE2(uint8_t *);
+  void op_0xE5(uint8_t *);
+  void op_0xE8(uint8_t *);
+  void op_0xE9(uint8_t *);
+  void op_0xEA(uint8_t *);
+  void op_0xF0(uint8_t *);
+  void op_0xF1(uint8_t *);
+  void op_0xF2(uint8_t *);
+  void op_0xF3(uint8_t *);
+  void op_0xF5(uint8_t *);
+  void op_0xF8(uint8_t *);
+  void op_0xF9(uint8_t *);
+  void op_0xFA(uint8_t *);
+  void op_0xFB(uint8_t *);
 };
@@ -0,0 +1,365 @@
+#include "jit.h"
+#include "opcodes.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace std;
+
+// The code buffer is never writable and executable at once: it is mapped
+// read-write, and executable only between two compile() calls.
+#define CODE_RW (PROT_READ | PROT_WRITE)
+#define CODE_RX (PROT_READ | PROT_EXEC)
+
+// Host registers. rdi holds the CPU, eax and ecx are scratch.
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define EBX 3
+#define ESI 6
+#define EDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+
+// Host register of every SM83 register operand (B C D E H L (HL) A).
+static const int host_reg[8] = { R9, R10, R11, ESI, EDX, EBX, -1, R8 };
+
+static const size_t guest_offs[8] = {
+  offsetof(CPU, reg_b), offsetof(CPU, reg_c), offsetof(CPU, reg_d), offsetof(CPU, reg_e),
+  offsetof(CPU, reg_h), offsetof(CPU, reg_l), 0, offsetof(CPU, reg_a),
+};
+
+#define OFFS_Z offsetof(CPU, flag_z)
+#define OFFS_N offsetof(CPU, flag_n)
+#define OFFS_H offsetof(CPU, flag_h)
+#define OFFS_C offsetof(CPU, flag_c)
+
+// Opcodes of the r/m32, r32 forms, and /digit extensions of the 0x81 and
+// 0xC1 immediate forms.
+#define OP_MOV 0x89
+#define OP_ADD 0x01
+#define OP_SUB 0x29
+#define OP_AND 0x21
+#define OP_OR  0x09
+#define OP_XOR 0x31
+#define EXT_ADD 0
+#define EXT_OR  1
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_XOR 6
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+Jit::Jit() : compiled(0), flushes(0), code(nullptr), used(0), out(nullptr) {
+  #ifdef JIT_SUPPORTED
+    void *area = mmap(nullptr, JIT_CODE_SIZE, CODE_RW, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return;
+    if (mprotect(area, JIT_CODE_SIZE, CODE_RX) != 0) {
+      munmap(area, JIT_CODE_SIZE);
+      return;
+    }
+    code = (uint8_t *) area;
+  #endif
+}
+
+Jit::~Jit() {
+  if (code) munmap(code, JIT_CODE_SIZE);
+}
+
+// False when the host is not x86-64 or refuses executable memory.
+bool Jit::ready() {
+  return code != nullptr;
+}
+
+// Room for the prologue, an instruction and the epilogue is checked before
+// every instruction; full means not even that much is left.
+bool Jit::full() {
+  return used + JIT_MAX_BLOCK * 8 > JIT_CODE_SIZE;
+}
+
+// Drops all the code. The caller forgets every JitBlock it handed out.
+void Jit::flush() {
+  used = 0;
+  compiled = 0;
+  flushes++;
+}
+
+void Jit::emit(uint8_t byte) {
+  *out++ = byte;
+}
+
+void Jit::emit32(uint32_t val) {
+  memcpy(out, &val, sizeof(val));
+  out += sizeof(val);
+}
+
+static inline uint8_t rex(int reg, int rm) {
+  return 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+}
+
+// op dst, src on 32-bit registers.
+void Jit::rr(uint8_t op, int dst, int src) {
+  if (dst >= 8 || src >= 8) emit(rex(src, dst));
+  emit(op);
+  emit(0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+// op dst, imm32.
+void Jit::ri(uint8_t ext, int dst, uint32_t imm) {
+  if (dst >= 8) emit(rex(0, dst));
+  emit(0x81);
+  emit(0xC0 | ext << 3 | (dst & 7));
+  emit32(imm);
+}
+
+void Jit::shift(uint8_t ext, int dst, uint8_t count) {
+  if (dst >= 8) emit(rex(0, dst));
+  emit(0xC1);
+  emit(0xC0 | ext << 3 | (dst & 7));
+  emit(count);
+}
+
+void Jit::mov_ri(int dst, uint32_t imm) {
+  if (dst >= 8) emit(rex(0, dst));
+  emit(0xB8 | (dst & 7));
+  emit32(imm);
+}
+
+// movzx dst, byte [rdi + offs]
+void Jit::load8(int dst, size_t offs) {
+  if (dst >= 8) emit(rex(dst, 0));
+  emit(0x0F);
+  emit(0xB6);
+  emit(0x40 | (dst & 7) << 3 | EDI);
+  emit(offs);
+}
+
+// movzx dst, word [rdi + offs]
+void Jit::load16(int dst, size_t offs) {
+  if (dst >= 8) emit(rex(dst, 0));
+  emit(0x0F);
+  emit(0xB7);
+  emit(0x40 | (dst & 7) << 3 | EDI);
+  emit(offs);
+}
+
+// mov byte [rdi + offs], src. The REX prefix selects sil over dh.
+void Jit::store8(int src, size_t offs) {
+  emit(rex(src, 0));
+  emit(0x88);
+  emit(0x40 | (src & 7) << 3 | EDI);
+  emit(offs);
+}
+
+// mov word [rdi + offs], src
+void Jit::store16(int src, size_t offs) {
+  emit(0x66);
+  if (src >= 8) emit(rex(src, 0));
+  emit(0x89);
+  emit(0x40 | (src & 7) << 3 | EDI);
+  emit(offs);
+}
+
+void Jit::store8_imm(size_t offs, uint8_t val) {
+  emit(0xC6);
+  emit(0x40 | EDI);
+  emit(offs);
+  emit(val);
+}
+
+void Jit::store16_imm(size_t offs, uint16_t val) {
+  emit(0x66);
+  emit(0xC7);
+  emit(0x40 | EDI);
+  emit(offs);
+  emit(val & 0xFF);
+  emit(val >> 8);
+}
+
+// Translates the longest run of register-only instructions at the start of
+// `mem` (at most `max_ops` of them, within `avail` bytes). Fails when the run
+// is too short to be worth a call.
+bool Jit::compile(const uint8_t *mem, size_t avail, size_t max_ops, JitBlock &block) {
+  if (!code || full()) return false;
+  if (mprotect(code, JIT_CODE_SIZE, CODE_RW) != 0) return false;
+  bool done = emit_block(mem, avail, max_ops, block);
+  // The blocks already handed out would fault without it.
+  if (mprotect(code, JIT_CODE_SIZE, CODE_RX) != 0) {
+    perror("JIT code buffer");
+    abort();
+  }
+  return done;
+}
+
+bool Jit::emit_block(const uint8_t *mem, size_t avail, size_t max_ops, JitBlock &block) {
+  uint8_t *start = code + used;
+  out = start;
+
+  emit(0x50 | EBX); // push rbx
+  for (int r = 0; r < 8; r++) {
+    if (r != 6) load8(host_reg[r], guest_offs[r]);
+  }
+
+  size_t pos = 0;
+  uint8_t ops = 0;
+  uint16_t cycles = 0;
+  while (ops < max_ops && ops < 0xFF && pos < avail && out + JIT_MAX_BLOCK * 2 < code + JIT_CODE_SIZE) {
+    if (pos + op_info[mem[pos]].length > avail) break;
+    const OpInfo &info = decode_op(mem + pos);
+    if (!translate(mem + pos)) break;
+    pos += info.length;
+    cycles += info.cycles;
+    ops++;
+  }
+  if (ops < 2) return false;
+
+  for (int r = 0; r < 8; r++) {
+    if (r != 6) store8(host_reg[r], guest_offs[r]);
+  }
+  emit(0x58 | EBX); // pop rbx
+  emit(0xC3);       // ret
+
+  used += out - start;
+  compiled++;
+  block.code = (JitCode) start;
+  block.ops = ops;
+  block.bytes = pos;
+  block.cycles = cycles;
+  return true;
+}
+
+// Emits one instruction, with the flags computed as the interpreter computes
+// them. Returns false for anything that is not register-only.
+bool Jit::translate(const uint8_t *p) {
+  uint8_t op = p[0];
+  uint8_t dst = (op >> 3) & 0b111;
+  uint8_t src = op & 0b111;
+
+  if (op == 0x00) { // NOP
+    return true;
+  }
+
+  if (op >= 0x40 && op < 0x80 && dst != 6 && src != 6) { // LD r,r'
+    if (dst != src) rr(OP_MOV, host_reg[dst], host_reg[src]);
+    return true;
+  }
+
+  if ((op & 0xC7) == 0x06 && dst != 6) { // LD r,d8
+    mov_ri(host_reg[dst], p[1]);
+    return true;
+  }
+
+  if ((op & 0xC6) == 0x04 && dst != 6) { // INC r, DEC r
+    inc_dec(host_reg[dst], op & 1);
+    return true;
+  }
+
+  if (op >= 0x80 && op < 0xC0 && src != 6) { // ALU A,r
+    alu(dst, host_reg[src], false, 0);
+    return true;
+  }
+
+  if ((op & 0xC7) == 0xC6) { // ALU A,d8
+    alu(dst, -1, true, p[1]);
+    return true;
+  }
+
+  if ((op & 0xC7) == 0x03 && op < 0x30) { // INC rr, DEC rr (not SP)
+    uint8_t pair = (op >> 4) * 2;
+    inc_dec_pair(host_reg[pair], host_reg[pair + 1], op & 0x08);
+    return true;
+  }
+
+  if (op == 0xCB && (p[1] & 0b111) != 6 && (p[1] >> 6) != 0) { // BIT, RES, SET
+    uint8_t cb = p[1];
+    int reg = host_reg[cb & 0b111];
+    uint8_t bit = 1 << ((cb >> 3) & 0b111);
+    switch (cb >> 6) {
+      case 1:
+        rr(OP_MOV, EAX, reg);
+        ri(EXT_AND, EAX, bit);
+        store8(EAX, OFFS_Z);
+        store8_imm(OFFS_N, 0);
+        store16_imm(OFFS_H, 1 << 4);
+        break;
+      case 2: ri(EXT_AND, reg, (uint8_t) ~bit); break;
+      case 3: ri(EXT_OR, reg, bit); break;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// ADD ADC SUB SBC AND XOR OR CP of A with a register or an immediate.
+void Jit::alu(uint8_t kind, int src, bool imm, uint8_t val) {
+  static const uint8_t rr_ops[8] = { OP_ADD, OP_ADD, OP_SUB, OP_SUB, OP_AND, OP_XOR, OP_OR, OP_SUB };
+  static const uint8_t ri_exts[8] = { EXT_ADD, EXT_ADD, EXT_SUB, EXT_SUB, EXT_AND, EXT_XOR, EXT_OR, EXT_SUB };
+  int a = host_reg[7];
+
+  auto apply = [&](uint8_t op, uint8_t ext, int dst) {
+    if (imm) {
+      ri(ext, dst, val);
+    } else {
+      rr(op, dst, src);
+    }
+  };
+
+  if (kind >= 4 && kind <= 6) {
+    apply(rr_ops[kind], ri_exts[kind], a);
+    store8(a, OFFS_Z);
+    store8_imm(OFFS_N, 0);
+    store16_imm(OFFS_H, kind == 4 ? 1 << 4 : 0);
+    store16_imm(OFFS_C, 0);
+    return;
+  }
+
+  // The 16-bit result keeps the carry (or borrow) in bit 8.
+  rr(OP_MOV, EAX, a);
+  apply(rr_ops[kind], ri_exts[kind], EAX);
+  if (kind == 1 || kind == 3) {
+    load16(ECX, OFFS_C);
+    shift(EXT_SHR, ECX, 8);
+    ri(EXT_AND, ECX, 1);
+    rr(rr_ops[kind], EAX, ECX);
+  }
+  rr(OP_MOV, ECX, a);
+  apply(OP_XOR, EXT_XOR, ECX);
+  rr(OP_XOR, ECX, EAX);
+  store16(ECX, OFFS_H);
+  store16(EAX, OFFS_C);
+  store8(EAX, OFFS_Z);
+  store8_imm(OFFS_N, kind >= 2);
+  if (kind != 7) {
+    ri(EXT_AND, EAX, 0xFF);
+    rr(OP_MOV, a, EAX);
+  }
+}
+
+void Jit::inc_dec(int reg, bool dec) {
+  rr(OP_MOV, EAX, reg);
+  ri(dec ? EXT_SUB : EXT_ADD, EAX, 1);
+  ri(EXT_AND, EAX, 0xFF);
+  rr(OP_MOV, ECX, reg);
+  ri(EXT_XOR, ECX, 1);
+  rr(OP_XOR, ECX, EAX);
+  store16(ECX, OFFS_H);
+  store8(EAX, OFFS_Z);
+  store8_imm(OFFS_N, dec);
+  rr(OP_MOV, reg, EAX);
+}
+
+void Jit::inc_dec_pair(int hi, int lo, bool dec) {
+  rr(OP_MOV, EAX, hi);
+  shift(EXT_SHL, EAX, 8);
+  rr(OP_OR, EAX, lo);
+  ri(dec ? EXT_SUB : EXT_ADD, EAX, 1);
+  rr(OP_MOV, lo, EAX);
+  ri(EXT_AND, lo, 0xFF);
+  shift(EXT_SHR, EAX, 8);
+  ri(EXT_AND, EAX, 0xFF);
+  rr(OP_MOV, hi, EAX);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "cpu.h"
+
+using namespace std;
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+  #define JIT_SUPPORTED
+#endif
+
+#define JIT_CODE_SIZE  (1 << 20)  // Code buffer, flushed when full.
+#define JIT_THRESHOLD  16         // Block runs before it is compiled.
+#define JIT_MAX_BLOCK  64         // Bytes of host code per guest instruction, at most.
+
+typedef void (*JitCode)(CPU *);
+
+// Native code for the start of a block: the first `ops` instructions, `bytes`
+// long, taking `cycles` cycles.
+struct JitBlock {
+  JitCode code;
+  uint8_t ops;
+  uint8_t bytes;
+  uint16_t cycles;
+};
+
+// Dynamic recompiler from SM83 to x86-64.
+//
+// Only instructions that work on registers alone are translated: register
+// loads, INC/DEC, the ALU, 16-bit INC/DEC and BIT/RES/SET. Everything that
+// touches memory may hit I/O and stays with the interpreter, so a block is
+// compiled up to its first such instruction and the interpreter runs the
+// rest.
+//
+// The generated function pins A, B, C, D, E, H and L in host registers, loads
+// them from the CPU on entry and stores them back on exit. Flags are written
+// to the lazy flag fields as the interpreter writes them, so both leave the
+// CPU in the same state.
+class Jit {
+public:
+  Jit();
+  ~Jit();
+  bool ready();
+  bool compile(const uint8_t *, size_t, size_t, JitBlock &);
+  bool full();
+  void flush();
+
+  uint64_t compiled;  // Blocks translated since the last flush.
+  uint64_t flushes;
+
+private:
+  uint8_t *code;
+  size_t used;
+
+  uint8_t *out;  // Emission point while compiling.
+
+  bool emit_block(const uint8_t *, size_t, size_t, JitBlock &);
+  void emit(uint8_t);
+  void emit32(uint32_t);
+  void rr(uint8_t, int, int);
+  void ri(uint8_t, int, uint32_t);
+  void shift(uint8_t, int, uint8_t);
+  void mov_ri(int, uint32_t);
+  void load8(int, size_t);
+  void load16(int, size_t);
+  void store8(int, size_t);
+  void store16(int, size_t);
+  void store8_imm(size_t, uint8_t);
+  void store16_imm(size_t, uint16_t);
+
+  bool translate(const uint8_t *);
+  void alu(uint8_t, int, bool, uint8_t);
+  void inc_dec(int, bool);
+  void inc_dec_pair(int, int, bool);
+};
@@ -0,0 +1,149 @@
+#include "json.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+JsonValue::JsonValue() : type(Null), boolean(false), number(0) {
+}
+
+const JsonValue *JsonValue::get(const string &name) const {
+  for (const auto &member : members) {
+    if (member.first == name) return &member.second;
+  }
+  return nullptr;
+}
+
+// Recursive descent over the text, which stays alive for the whole parse.
+class JsonParser {
+public:
+  JsonParser(const string &_text) : text(_text.c_str()), pos(_text.c_str()) {}
+
+  bool parse(JsonValue &value, string &error) {
+    bool parsed = parse_value(value, 0);
+    if (parsed) {
+      skip_space();
+      parsed = !*pos || fail("trailing text");
+    }
+    if (!parsed) error = message + " at offset " + to_string(pos - text);
+    return parsed;
+  }
+
+private:
+  const char *text;
+  const char *pos;
+  string message;
+
+  static const int max_depth = 64;
+
+  bool fail(const char *why) {
+    message = why;
+    return false;
+  }
+
+  void skip_space() {
+    while (isspace((unsigned char) *pos)) pos++;
+  }
+
+  bool accept(char c) {
+    skip_space();
+    if (*pos != c) return false;
+    pos++;
+    return true;
+  }
+
+  bool accept_word(const char *word) {
+    size_t len = strlen(word);
+    if (strncmp(pos, word, len) != 0) return false;
+    pos += len;
+    return true;
+  }
+
+  bool parse_value(JsonValue &value, int depth) {
+    if (depth > max_depth) return fail("too deeply nested");
+    skip_space();
+    if (*pos == '{') return parse_object(value, depth);
+    if (*pos == '[') return parse_array(value, depth);
+    if (*pos == '"') {
+      value.type = JsonValue::String;
+      return parse_string(value.text);
+    }
+    bool truth = accept_word("true");
+    if (truth || accept_word("false")) {
+      value.type = JsonValue::Bool;
+      value.boolean = truth;
+      return true;
+    }
+    if (accept_word("null")) {
+      value.type = JsonValue::Null;
+      return true;
+    }
+    return parse_number(value);
+  }
+
+  bool parse_object(JsonValue &value, int depth) {
+    value.type = JsonValue::Object;
+    pos++;
+    if (accept('}')) return true;
+    do {
+      skip_space();
+      value.members.emplace_back();
+      auto &member = value.members.back();
+      if (*pos != '"') return fail("expected a member name");
+      if (!parse_string(member.first)) return false;
+      if (!accept(':')) return fail("expected :");
+      if (!parse_value(member.second, depth + 1)) return false;
+    } while (accept(','));
+    return accept('}') || fail("expected , or }");
+  }
+
+  bool parse_array(JsonValue &value, int depth) {
+    value.type = JsonValue::Array;
+    pos++;
+    if (accept(']')) return true;
+    do {
+      value.items.emplace_back();
+      if (!parse_value(value.items.back(), depth + 1)) return false;
+    } while (accept(','));
+    return accept(']') || fail("expected , or ]");
+  }
+
+  // \uXXXX is kept as is: test vectors only have ASCII names.
+  bool parse_string(string &out) {
+    pos++;
+    for (; *pos != '"'; pos++) {
+      if (!*pos) return fail("unterminated string");
+      if (*pos != '\\') {
+        out += *pos;
+        continue;
+      }
+      switch (*++pos) {
+        case 'n': out += '\n'; break;
+        case 't': out += '\t'; break;
+        case 'r': out += '\r'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'u': out += "\\u"; break;
+        case '\0': return fail("unterminated string");
+        default: out += *pos; break;
+      }
+    }
+    pos++;
+    return true;
+  }
+
+  bool parse_number(JsonValue &value) {
+    char *end;
+    value.number = strtod(pos, &end);
+    if (end == pos) return fail("expected a value");
+    value.type = JsonValue::Number;
+    pos = end;
+    return true;
+  }
+};
+
+bool parse_json(const string &text, JsonValue &value, string &error) {
+  value = JsonValue();
+  return JsonParser(text).parse(value, error);
+}
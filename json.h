@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// A parsed JSON document, as a tree of values. Enough for test vectors and
+// tool input; numbers are doubles, strings keep their escapes decoded only
+// for the common ones.
+struct JsonValue {
+  enum Type { Null, Bool, Number, String, Array, Object };
+
+  Type type;
+  bool boolean;
+  double number;
+  string text;
+  vector<JsonValue> items;                    // Of an array.
+  vector<pair<string, JsonValue>> members;    // Of an object, in order.
+
+  JsonValue();
+  const JsonValue *get(const string &) const; // Member, or null.
+};
+
+// Fails with the offset and reason in the string.
+bool parse_json(const string &, JsonValue &, string &);
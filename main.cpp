@@ -2,30 +2,67 @@
 #include <fstream>
 #include <string>
 #include "environment.h"
+#include "cartridge.h"
 #include "tests.h"
+#include "bench.h"
+#include "batch.h"
+#include "conform.h"
 #include "defines.h"
 
 using namespace std;
 
-int main() {
+int main(int argc, char **argv) {
+  if (argc > 1 && string(argv[1]) == "bench") {
+    return run_bench(argc, argv);
+  }
+
+  if (argc > 1 && string(argv[1]) == "batch") {
+    return run_batch(argc, argv);
+  }
+
+  if (argc > 1 && string(argv[1]) == "conform") {
+    return run_conform(argc, argv);
+  }
+
   cout << "Executing tests." << endl;
   run_test();
 
+  // Usage: main [cartridge.gb]
+  // The boot ROM is read from rom.bin; without it the cartridge starts at 0x100.
   cout << "Reading ROM" << endl;
   string rom_file_name = "rom.bin";
   fstream rom_file(rom_file_name, ios::binary | ios::in);
-  unique_ptr<uint8_t> rom(new uint8_t[ROM_SIZE]);
-  rom_file.read(reinterpret_cast<char *>(rom.get()), ROM_SIZE);
+  unique_ptr<uint8_t[]> rom;
+  if (rom_file) {
+    rom.reset(new uint8_t[ROM_SIZE]);
+    rom_file.read(reinterpret_cast<char *>(rom.get()), ROM_SIZE);
 
-  for (int i = 0; i < ROM_SIZE; i++) {
-    printf("%.2x ", *(rom.get() + i));
-    if (i % 0x10 == 0xF) cout << endl;
+    for (int i = 0; i < ROM_SIZE; i++) {
+      printf("%.2x ", *(rom.get() + i));
+      if (i % 0x10 == 0xF) cout << endl;
+    }
+  } else {
+    cout << "No boot ROM, skipping boot" << endl;
   }
 
   Environment env{move(rom)};
+
+  Cartridge cart;
+  if (argc > 1) {
+    if (!cart.load(argv[1])) return EXIT_FAILURE;
+    env.insert_cartridge(&cart);
+  }
+
+  #ifdef DEBUG
+    env.enable_rewind(REWIND_SECONDS); // For the debugger's rewind command.
+  #endif
   env.reset();
   env.run();
 
+  // run() returns when the CPU stopped or on quit, so keep what led there.
+  if (env.save_trace("trace.bin")) cout << "Trace written to trace.bin" << endl;
+  if (env.save_stats("stats.json")) cout << "Counters written to stats.json" << endl;
+
   cout << "End" << endl;
   return EXIT_SUCCESS;
 }
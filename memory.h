@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+using namespace std;
+
+// Device behind a page of the memory map that has no plain backing memory,
+// e.g. a cartridge MBC intercepting writes into ROM.
+class MemHandler {
+public:
+  virtual ~MemHandler() {}
+  virtual uint8_t read(uint16_t) = 0;
+  virtual void write(uint16_t, uint8_t) = 0;
+};
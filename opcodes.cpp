@@ -0,0 +1,59 @@
+#include "opcodes.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+// Every entry is 1 to 3 bytes long, and branches say what they cost taken.
+static constexpr bool check_tables() {
+  for (int op = 0; op < 0x100; op++) {
+    const OpInfo &info = op_info[op];
+    if (info.length < 1 || info.length > 3) return false;
+    if ((info.attrs & OP_BRANCH) && !info.branch_cycles) return false;
+    if (!(info.attrs & OP_BRANCH) && info.branch_cycles) return false;
+    if (cb_info[op].length != 2 || !cb_info[op].cycles) return false;
+  }
+  return op_info[0xCB].length == 2;
+}
+static_assert(check_tables(), "inconsistent opcode tables");
+
+// Writes the instruction at p, located at pc, as text with its operands
+// filled in. Returns its length.
+size_t disassemble(const uint8_t *p, uint16_t pc, char *out, size_t size) {
+  const OpInfo &info = decode_op(p);
+  if (info.attrs & OP_ILLEGAL) {
+    snprintf(out, size, "DB $%.2X", p[0]);
+    return info.length;
+  }
+
+  static const char *const operands[] = { "d16", "a16", "d8", "a8", "r8" };
+  const char *mnemonic = info.mnemonic;
+  const char *at = nullptr;
+  size_t kind = 0;
+  for (; kind < sizeof(operands) / sizeof(operands[0]); kind++) {
+    at = strstr(mnemonic, operands[kind]);
+    if (at) break;
+  }
+  if (!at) {
+    snprintf(out, size, "%s", mnemonic);
+    return info.length;
+  }
+
+  char operand[8];
+  uint16_t word = p[1] | p[2] << 8;
+  switch (kind) {
+    case 0: case 1: snprintf(operand, sizeof(operand), "$%.4X", word); break;
+    case 2:         snprintf(operand, sizeof(operand), "$%.2X", p[1]); break;
+    case 3:         snprintf(operand, sizeof(operand), "$FF%.2X", p[1]); break;
+    default:
+      // JR shows its target, SP arithmetic the offset.
+      if (p[0] == 0xE8 || p[0] == 0xF8) {
+        snprintf(operand, sizeof(operand), "%d", (int8_t) p[1]);
+      } else {
+        snprintf(operand, sizeof(operand), "$%.4X", (uint16_t) (pc + 2 + (int8_t) p[1]));
+      }
+      break;
+  }
+  snprintf(out, size, "%.*s%s%s", (int) (at - mnemonic), mnemonic, operand, at + strlen(operands[kind]));
+  return info.length;
+}
@@ -0,0 +1,291 @@
+#include "ppu.h"
+#include <cstring>
+#include "defines.h"
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
+using namespace std;
+
+#define IO(addr) io[(addr) & 0xFF]
+
+// Decodes one tile row from its two bit planes (low plane first) into 8
+// colour indices, leftmost pixel first.
+#ifdef __SSE2__
+static inline void decode_row(uint8_t lo, uint8_t hi, uint8_t *out) {
+  const __m128i bits = _mm_setr_epi8((char) 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                     (char) 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+  const __m128i weight = _mm_setr_epi8(1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2);
+
+  // Low plane in the lower 8 lanes, high plane in the upper 8, one bit per lane.
+  __m128i planes = _mm_unpacklo_epi64(_mm_set1_epi8(lo), _mm_set1_epi8(hi));
+  __m128i set = _mm_cmpeq_epi8(_mm_and_si128(planes, bits), bits);
+  __m128i px = _mm_and_si128(set, weight);
+  px = _mm_or_si128(px, _mm_srli_si128(px, 8));
+  _mm_storel_epi64((__m128i *) out, px);
+}
+#else
+// Portable fallback: each table entry spreads the 8 bits of a plane into the
+// lowest bit of 8 bytes, so a row is two lookups, a shift and an or.
+struct PlaneTable {
+  uint64_t spread[0x100];
+
+  PlaneTable() {
+    for (int val = 0; val < 0x100; val++) {
+      uint8_t px[8];
+      for (int i = 0; i < 8; i++) px[i] = BITN(val, 7 - i);
+      memcpy(&spread[val], px, sizeof(px));
+    }
+  }
+};
+
+static const PlaneTable plane_table;
+
+static inline void decode_row(uint8_t lo, uint8_t hi, uint8_t *out) {
+  uint64_t px = plane_table.spread[lo] | (plane_table.spread[hi] << 1);
+  memcpy(out, &px, sizeof(px));
+}
+#endif
+
+// The PPU renders from the environment's VRAM, OAM and I/O registers; reset()
+// it once those are initialized.
+PPU::PPU(uint8_t *_vram, uint8_t *_oam, uint8_t *_io) :
+  frames(0), tile_hits(0), tile_misses(0), vram(_vram), oam(_oam), io(_io),
+  synced(0), dot(0), next_dot(PPU_NEVER), window_line(0), stat_line(false) {
+  memset(dirty, 0xFF, sizeof(dirty));
+}
+
+void PPU::reset() {
+  memset(framebuffer, 0, sizeof(framebuffer));
+  frames = 0;
+  tile_hits = 0;
+  tile_misses = 0;
+  memset(dirty, 0xFF, sizeof(dirty));
+  window_line = 0;
+  stat_line = false;
+  synced = 0;
+  lcd_switched();
+}
+
+void PPU::save_state(State &state) {
+  state.synced = synced;
+  state.frames = frames;
+  state.dot = dot;
+  state.next_dot = next_dot;
+  state.window_line = window_line;
+  state.stat_line = stat_line;
+}
+
+// VRAM may have changed under the tile cache, so every tile is decoded again.
+void PPU::load_state(const State &state) {
+  synced = state.synced;
+  frames = state.frames;
+  dot = state.dot;
+  next_dot = state.next_dot;
+  window_line = state.window_line;
+  stat_line = state.stat_line;
+  memset(dirty, 0xFF, sizeof(dirty));
+}
+
+uint64_t PPU::sync(uint64_t now) {
+  uint64_t elapsed = now - synced;
+  synced = now;
+  if (next_dot == PPU_NEVER) return CYCLE_NEVER;
+
+  dot += elapsed;
+  if (dot >= next_dot) advance();
+  return now + (next_dot - dot);
+}
+
+uint8_t PPU::read(uint16_t addr) {
+  return vram[addr - ADDR_VIDEO_START];
+}
+
+void PPU::write(uint16_t addr, uint8_t val) {
+  uint16_t offs = addr - ADDR_VIDEO_START;
+  vram[offs] = val;
+  if (offs < PPU_TILES_END) dirty[offs >> 10] |= 1ULL << ((offs >> 4) & 63);
+}
+
+void PPU::lcd_switched() {
+  dot = 0;
+  IO(ADDR_LY) = 0;
+  if (ISBITN(IO(ADDR_LCDC), 7)) {
+    set_mode(PPU_MODE_OAM);
+    next_dot = PPU_OAM_DOTS;
+  } else {
+    set_mode(PPU_MODE_HBLANK);
+    next_dot = PPU_NEVER;
+  }
+  update_stat();
+}
+
+void PPU::advance() {
+  while (dot >= next_dot) {
+    switch (IO(ADDR_STAT) & 0b11) {
+      case PPU_MODE_OAM:
+        set_mode(PPU_MODE_TRANSFER);
+        next_dot = PPU_OAM_DOTS + PPU_TRANSFER_DOTS;
+        break;
+
+      case PPU_MODE_TRANSFER:
+        render_line();
+        set_mode(PPU_MODE_HBLANK);
+        next_dot = PPU_LINE_DOTS;
+        break;
+
+      case PPU_MODE_HBLANK:
+      case PPU_MODE_VBLANK: {
+        dot -= PPU_LINE_DOTS;
+        uint8_t ly = IO(ADDR_LY) + 1;
+        if (ly == PPU_LINES) ly = 0;
+        IO(ADDR_LY) = ly;
+
+        if (ly < SCREEN_H) {
+          set_mode(PPU_MODE_OAM);
+          next_dot = PPU_OAM_DOTS;
+        } else {
+          if (ly == SCREEN_H) {
+            set_mode(PPU_MODE_VBLANK);
+            request_interrupt(INT_VBLANK);
+            window_line = 0;
+            frames++;
+          }
+          next_dot = PPU_LINE_DOTS;
+        }
+        break;
+      }
+    }
+    update_stat();
+  }
+}
+
+void PPU::set_mode(uint8_t mode) {
+  IO(ADDR_STAT) = (IO(ADDR_STAT) & 0xFC) | mode;
+}
+
+void PPU::request_interrupt(uint8_t bit) {
+  IO(ADDR_IF) |= 1 << bit;
+}
+
+void PPU::update_stat() {
+  uint8_t stat = IO(ADDR_STAT);
+  uint8_t mode = stat & 0b11;
+
+  bool coincidence = IO(ADDR_LY) == IO(ADDR_LYC);
+  stat = coincidence ? stat | 0b100 : stat & ~0b100;
+  IO(ADDR_STAT) = stat;
+
+  bool line = (ISBITN(stat, 3) && mode == PPU_MODE_HBLANK) ||
+              (ISBITN(stat, 4) && mode == PPU_MODE_VBLANK) ||
+              (ISBITN(stat, 5) && mode == PPU_MODE_OAM) ||
+              (ISBITN(stat, 6) && coincidence);
+  if (line && !stat_line) request_interrupt(INT_STAT);
+  stat_line = line;
+}
+
+// Re-decodes the tiles written since the last line, so the lookups while
+// rendering are plain loads.
+void PPU::refresh_tiles() {
+  for (int word = 0; word < PPU_TILES / 64; word++) {
+    while (dirty[word]) {
+      int tile = word * 64 + __builtin_ctzll(dirty[word]);
+      const uint8_t *planes = vram + tile * 16;
+      for (int y = 0; y < 8; y++) decode_row(planes[y * 2], planes[y * 2 + 1], tiles[tile][y]);
+      dirty[word] &= dirty[word] - 1;
+      tile_misses++;
+    }
+  }
+}
+
+// Background and window tile, with the LCDC-selected addressing.
+const uint8_t *PPU::bg_tile_row(uint8_t idx, uint8_t row) {
+  if (ISBITN(IO(ADDR_LCDC), 4) || idx >= 0x80) return tiles[idx][row];
+  return tiles[256 + idx][row];
+}
+
+// Copies the 21 tiles of tile map `map` (offset in VRAM) that cover a line,
+// starting at tile column `col` and tile row line `y`.
+void PPU::render_tiles(uint8_t *out, uint16_t map, uint8_t col, uint8_t y) {
+  const uint8_t *map_row = vram + map + (y >> 3) * 32;
+  for (int tile = 0; tile < 21; tile++) {
+    memcpy(out + tile * 8, bg_tile_row(map_row[(col + tile) & 31], y & 7), 8);
+  }
+  tile_hits += 21;
+}
+
+void PPU::render_line() {
+  uint8_t lcdc = IO(ADDR_LCDC);
+  uint8_t ly = IO(ADDR_LY);
+  uint8_t bg[SCREEN_W];  // Colour indices, before the palette.
+  uint8_t row[21 * 8];
+
+  refresh_tiles();
+
+  if (ISBITN(lcdc, 0)) {
+    uint8_t scx = IO(ADDR_SCX);
+    render_tiles(row, ISBITN(lcdc, 3) ? 0x1C00 : 0x1800, scx >> 3, ly + IO(ADDR_SCY));
+    memcpy(bg, row + (scx & 7), SCREEN_W);
+
+    int wx = IO(ADDR_WX) - 7;
+    if (ISBITN(lcdc, 5) && ly >= IO(ADDR_WY) && wx < SCREEN_W) {
+      render_tiles(row, ISBITN(lcdc, 6) ? 0x1C00 : 0x1800, 0, window_line++);
+      for (int x = wx < 0 ? 0 : wx; x < SCREEN_W; x++) bg[x] = row[x - wx];
+    }
+  } else {
+    memset(bg, 0, SCREEN_W);
+  }
+
+  uint8_t *out = framebuffer + ly * SCREEN_W;
+  uint8_t bgp = IO(ADDR_BGP);
+  for (int x = 0; x < SCREEN_W; x++) out[x] = (bgp >> (bg[x] * 2)) & 0b11;
+
+  if (ISBITN(lcdc, 1)) render_sprites(out, bg);
+}
+
+void PPU::render_sprites(uint8_t *out, const uint8_t *bg) {
+  uint8_t ly = IO(ADDR_LY);
+  int height = ISBITN(IO(ADDR_LCDC), 2) ? 16 : 8;
+
+  // The first 10 sprites on the line in OAM order, then sorted by X. Lower X
+  // wins, and OAM order breaks ties, so they are drawn from the back.
+  uint8_t found[10];
+  int n = 0;
+  for (int i = 0; i < 40 && n < 10; i++) {
+    int y = ly - (oam[i * 4] - 16);
+    if (y >= 0 && y < height) found[n++] = i;
+  }
+  for (int i = 1; i < n; i++) {
+    uint8_t cur = found[i];
+    int j = i;
+    for (; j > 0 && oam[found[j - 1] * 4 + 1] > oam[cur * 4 + 1]; j--) found[j] = found[j - 1];
+    found[j] = cur;
+  }
+
+  for (int k = n - 1; k >= 0; k--) {
+    const uint8_t *sprite = oam + found[k] * 4;
+    int sx = sprite[1] - 8;
+    uint8_t tile = sprite[2];
+    uint8_t attr = sprite[3];
+
+    int line = ly - (sprite[0] - 16);
+    if (ISBITN(attr, 6)) line = height - 1 - line;
+    if (height == 16) tile &= 0xFE;
+
+    // Sprites always use the 0x8000 tile addressing.
+    const uint8_t *px = tiles[tile + (line >> 3)][line & 7];
+    tile_hits++;
+    bool flip = ISBITN(attr, 5);
+
+    uint8_t pal = IO(ISBITN(attr, 4) ? ADDR_OBP1 : ADDR_OBP0);
+    bool behind_bg = ISBITN(attr, 7);
+    for (int i = 0; i < 8; i++) {
+      int x = sx + i;
+      uint8_t colour = px[flip ? 7 - i : i];
+      if (x < 0 || x >= SCREEN_W || colour == 0) continue;
+      if (behind_bg && bg[x] != 0) continue;
+      out[x] = (pal >> (colour * 2)) & 0b11;
+    }
+  }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include "defines.h"
+#include "memory.h"
+
+using namespace std;
+
+#define SCREEN_W 160
+#define SCREEN_H 144
+
+#define PPU_LINE_DOTS     456
+#define PPU_LINES         154
+#define PPU_OAM_DOTS      80
+#define PPU_TRANSFER_DOTS 172
+#define PPU_NEVER         0xFFFFFFFF
+
+#define PPU_TILES      384     // Tile data at 0x8000-0x97FF.
+#define PPU_TILES_END  0x1800  // VRAM offset past the tile data.
+
+// STAT modes.
+#define PPU_MODE_HBLANK   0
+#define PPU_MODE_VBLANK   1
+#define PPU_MODE_OAM      2
+#define PPU_MODE_TRANSFER 3
+
+// Picture processing unit.
+//
+// The PPU walks the OAM scan, transfer and HBlank modes of every line and
+// then the VBlank lines, keeping LY and STAT up to date in the I/O registers
+// and raising the VBlank and STAT interrupts. Each scanline is rendered in one
+// go at the end of its transfer mode.
+//
+// It runs on catch-up: sync() advances it to a cycle and returns the cycle of
+// its next mode change, which is the only point it needs to run again.
+//
+// Tiles are decoded once into colour indices and cached. The tile data pages
+// of VRAM are mapped read-only with the PPU as their handler, so every write
+// passes through write() and marks its tile dirty.
+class PPU : public MemHandler {
+public:
+  PPU(uint8_t *, uint8_t *, uint8_t *);
+  void reset();
+
+  // Position in the frame, as kept in save states. VRAM, OAM and the I/O
+  // registers are saved by the environment.
+  struct State {
+    uint64_t synced;
+    uint64_t frames;
+    uint32_t dot;
+    uint32_t next_dot;
+    uint8_t window_line;
+    uint8_t stat_line;
+  };
+  void save_state(State &);
+  void load_state(const State &);
+  uint64_t sync(uint64_t);  // Returns CYCLE_NEVER while the LCD is off.
+
+  void lcd_switched();  // LCDC bit 7 changed.
+  void update_stat();   // LY, LYC or the STAT interrupt sources changed.
+
+  uint8_t read(uint16_t);
+  void write(uint16_t, uint8_t);
+
+  // Shade (0-3, 0 is white) of every pixel, one byte each, rows back to back.
+  uint8_t framebuffer[SCREEN_W * SCREEN_H];
+  uint64_t frames;
+
+  // Decoded-tile cache: tile rows served from it and tiles (re)decoded.
+  uint64_t tile_hits;
+  uint64_t tile_misses;
+
+private:
+  uint8_t *vram;
+  uint8_t *oam;
+  uint8_t *io;  // 0xFF00-0xFFFF.
+
+  uint64_t synced;    // Cycle the PPU has been advanced to.
+  uint32_t dot;       // Dot within the current line.
+  uint32_t next_dot;  // Dot of the next mode change.
+  uint8_t window_line;
+  bool stat_line;     // The STAT interrupt fires on its rising edge.
+
+  uint8_t tiles[PPU_TILES][8][8];  // Colour indices of every tile pixel.
+  uint64_t dirty[PPU_TILES / 64];  // Tiles whose cache entry is stale.
+
+  void advance();
+  void set_mode(uint8_t);
+  void request_interrupt(uint8_t);
+
+  void render_line();
+  void render_tiles(uint8_t *, uint16_t, uint8_t, uint8_t);
+  void render_sprites(uint8_t *, const uint8_t *);
+  void refresh_tiles();
+  const uint8_t *bg_tile_row(uint8_t, uint8_t);
+};
@@ -0,0 +1,144 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include "environment.h"
+#include "opcodes.h"
+
+using namespace std;
+
+Profiler::Profiler(uint16_t pc) :
+  instructions(new uint64_t[0x10000]),
+  cycles(new uint64_t[0x10000])
+{
+  for (int op = 0; op < 0x100; op++) {
+    const char *mnemonic = op_info[op].mnemonic;
+    if (strncmp(mnemonic, "CALL", 4) == 0 || strncmp(mnemonic, "RST", 3) == 0) {
+      branch_kinds[op] = Call;
+    } else if (strncmp(mnemonic, "RET", 3) == 0) {
+      branch_kinds[op] = Ret;
+    } else {
+      branch_kinds[op] = None;
+    }
+  }
+  clear(pc);
+}
+
+void Profiler::clear(uint16_t pc) {
+  memset(instructions.get(), 0, 0x10000 * sizeof(uint64_t));
+  memset(cycles.get(), 0, 0x10000 * sizeof(uint64_t));
+  nodes.assign(1, { pc, 0, 0, 1 });
+  children.clear();
+  frames.clear();
+  current = 0;
+}
+
+// Dispatch costs the cycles of a call, counted in the handler.
+void Profiler::interrupt(uint16_t vector, CPU &cpu, uint8_t dur) {
+  enter(vector, cpu.reg_sp);
+  nodes[current].cycles += dur;
+}
+
+// A branch that was not taken just moved on to the next instruction.
+void Profiler::branch(uint16_t pc, uint8_t opcode, CPU &cpu) {
+  if (cpu.reg_pc == (uint16_t) (pc + op_info[opcode].length)) return;
+  if (branch_kinds[opcode] == Call) {
+    enter(cpu.reg_pc, cpu.reg_sp);
+    return;
+  }
+  while (!frames.empty() && frames.back().sp < cpu.reg_sp) frames.pop_back();
+  current = frames.empty() ? 0 : frames.back().node;
+}
+
+// `sp` points at the return address just pushed; frames at or below it are
+// gone, even if they never returned.
+void Profiler::enter(uint16_t routine, uint16_t sp) {
+  while (!frames.empty() && frames.back().sp <= sp) frames.pop_back();
+  uint32_t parent = frames.empty() ? 0 : frames.back().node;
+  current = parent;
+  if (frames.size() >= PROFILE_MAX_DEPTH) return;
+
+  uint64_t key = (uint64_t) parent << 16 | routine;
+  auto child = children.find(key);
+  if (child == children.end()) {
+    if (nodes.size() >= PROFILE_MAX_NODES) return;
+    child = children.emplace(key, nodes.size()).first;
+    nodes.push_back({ routine, parent, 0, 0 });
+  }
+  current = child->second;
+  nodes[current].calls++;
+  frames.push_back({ current, sp });
+}
+
+void Profiler::report(FILE *out, size_t count, Environment *env) {
+  uint64_t total = 0;
+  for (const Node &node : nodes) total += node.cycles;
+  if (!total) total = 1;
+
+  vector<uint16_t> pcs(0x10000);
+  for (size_t pc = 0; pc < pcs.size(); pc++) pcs[pc] = pc;
+  count = min(count, pcs.size());
+  partial_sort(pcs.begin(), pcs.begin() + count, pcs.end(), [&](uint16_t a, uint16_t b) {
+    return cycles[a] > cycles[b];
+  });
+  fprintf(out, "Hottest instructions:\n");
+  for (size_t i = 0; i < count && cycles[pcs[i]]; i++) {
+    uint16_t pc = pcs[i];
+    uint8_t bytes[3];
+    char text[32];
+    for (int j = 0; j < 3; j++) bytes[j] = env->peek_mem(pc + j);
+    disassemble(bytes, pc, text, sizeof(text));
+    fprintf(out, "  0x%.4x %12lu cycles %5.1f%% %10lu runs  %s\n", pc, (unsigned long) cycles[pc],
+      100.0 * cycles[pc] / total, (unsigned long) instructions[pc], text);
+  }
+
+  // Cycles with callees, propagated up from the leaves. A recursive routine
+  // only counts its outermost call.
+  vector<uint64_t> inclusive(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) inclusive[i] = nodes[i].cycles;
+  for (size_t i = nodes.size() - 1; i > 0; i--) inclusive[nodes[i].parent] += inclusive[i];
+
+  struct Routine { uint64_t self, total, calls; };
+  unordered_map<uint16_t, Routine> routines;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    Routine &routine = routines[nodes[i].routine];
+    routine.self += nodes[i].cycles;
+    routine.calls += nodes[i].calls;
+    bool nested = false;
+    for (size_t j = i; j && !nested; j = nodes[j].parent) nested = nodes[nodes[j].parent].routine == nodes[i].routine;
+    if (!nested) routine.total += inclusive[i];
+  }
+  vector<pair<uint16_t, Routine>> sorted(routines.begin(), routines.end());
+  count = min(count, sorted.size());
+  partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), [](const pair<uint16_t, Routine> &a, const pair<uint16_t, Routine> &b) {
+    return a.second.total > b.second.total;
+  });
+  fprintf(out, "Hottest routines:\n");
+  for (size_t i = 0; i < count; i++) {
+    const Routine &routine = sorted[i].second;
+    fprintf(out, "  0x%.4x %5.1f%% total %5.1f%% self %10lu calls\n", sorted[i].first,
+      100.0 * routine.total / total, 100.0 * routine.self / total, (unsigned long) routine.calls);
+  }
+}
+
+// One line per call path, "0x0100;0x0150;0x2000 <cycles>", as read by
+// flamegraph.pl and speedscope.
+bool Profiler::save_folded(const string &path) {
+  ofstream out(path);
+  if (!out) return false;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i].cycles) out << stack_name(i) << " " << nodes[i].cycles << "\n";
+  }
+  return bool(out);
+}
+
+string Profiler::stack_name(uint32_t node) {
+  string name;
+  char frame[8];
+  for (;;) {
+    snprintf(frame, sizeof(frame), "0x%.4x", nodes[node].routine);
+    name = name.empty() ? frame : string(frame) + ";" + name;
+    if (!node) return name;
+    node = nodes[node].parent;
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cpu.h"
+
+using namespace std;
+
+class Environment;
+
+#define PROFILE_MAX_DEPTH 256   // Deeper calls are counted in their caller.
+#define PROFILE_MAX_NODES 65536 // Call paths past this are too.
+
+// Exact profile of the guest: instructions and cycles per PC, and a call tree
+// built from CALL, RST, RET and interrupts, which gives the cycles of every
+// routine and the folded stacks that flame graph tools read.
+//
+// Frames are matched to the stack by SP rather than by pairing CALL with RET,
+// so code that pops its return address or resets SP does not leave stale
+// frames behind: a frame is dropped once SP rises above its return address.
+class Profiler {
+public:
+  Profiler(uint16_t);
+  void clear(uint16_t);  // Starts over at the given PC.
+
+  // After the instruction at `pc` ran.
+  inline void record(uint16_t pc, uint8_t opcode, CPU &cpu, uint8_t dur) {
+    instructions[pc]++;
+    cycles[pc] += dur;
+    nodes[current].cycles += dur;
+    if (branch_kinds[opcode]) branch(pc, opcode, cpu);
+  }
+  void interrupt(uint16_t, CPU &, uint8_t);  // Dispatch to a vector.
+  inline void halt(uint64_t dur) {
+    nodes[current].cycles += dur;
+  }
+
+  void report(FILE *, size_t, Environment *);  // Hottest PCs and routines.
+  bool save_folded(const string &);
+
+private:
+  enum BranchKind : uint8_t { None, Call, Ret };
+
+  struct Node {
+    uint16_t routine;
+    uint32_t parent;
+    uint64_t cycles;  // Spent in the routine itself.
+    uint64_t calls;
+  };
+
+  struct Frame {
+    uint32_t node;
+    uint16_t sp;  // Where the return address is.
+  };
+
+  unique_ptr<uint64_t[]> instructions;
+  unique_ptr<uint64_t[]> cycles;
+  uint8_t branch_kinds[0x100];
+
+  vector<Node> nodes;  // nodes[0] is the root, parents come before children.
+  unordered_map<uint64_t, uint32_t> children;  // Parent << 16 | routine.
+  vector<Frame> frames;
+  uint32_t current;
+
+  void branch(uint16_t, uint8_t, CPU &);
+  void enter(uint16_t, uint16_t);
+  string stack_name(uint32_t);
+};
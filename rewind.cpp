@@ -0,0 +1,155 @@
+#include "rewind.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static void put_varint(vector<uint8_t> &out, size_t val) {
+  while (val >= 0x80) {
+    out.push_back(val | 0x80);
+    val >>= 7;
+  }
+  out.push_back(val);
+}
+
+static bool get_varint(const vector<uint8_t> &in, size_t &pos, size_t &val) {
+  val = 0;
+  for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    uint8_t byte = in[pos++];
+    val |= (size_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+// Whether 8 bytes at `i` are unchanged. A keyframe has no previous state and
+// compares against zero.
+static inline bool same_word(const uint8_t *cur, const uint8_t *prev, size_t i) {
+  uint64_t a, b = 0;
+  memcpy(&a, cur + i, sizeof(a));
+  if (prev) memcpy(&b, prev + i, sizeof(b));
+  return a == b;
+}
+
+static inline bool same_byte(const uint8_t *cur, const uint8_t *prev, size_t i) {
+  return cur[i] == (prev ? prev[i] : 0);
+}
+
+// Keeps at least one delta group besides the newest, so a full ring always
+// has something to drop.
+Rewind::Rewind(size_t frames, size_t _keyframe_interval) :
+  ring(max(frames, _keyframe_interval + 1)), keyframe_interval(max<size_t>(_keyframe_interval, 1)) {
+  clear();
+}
+
+void Rewind::clear() {
+  first = 0;
+  count = 0;
+  since_key = 0;
+  last.clear();
+}
+
+size_t Rewind::frames() {
+  return count;
+}
+
+size_t Rewind::bytes() {
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) total += frame(i).data.size();
+  return total;
+}
+
+Rewind::Frame &Rewind::frame(size_t i) {
+  return ring[(first + i) % ring.size()];
+}
+
+void Rewind::push(const vector<uint8_t> &state) {
+  if (count == ring.size()) {
+    do {
+      first = (first + 1) % ring.size();
+      count--;
+    } while (count && !frame(0).key);
+  }
+
+  bool key = count == 0 || since_key + 1 >= keyframe_interval || last.size() != state.size();
+  Frame &slot = frame(count++);
+  slot.key = key;
+  encode(state, key ? nullptr : &last, slot.data);
+  since_key = key ? 0 : since_key + 1;
+  last = state;
+}
+
+// Decodes the state `back` frames before the newest one, replaying the deltas
+// from the keyframe before it. The frames after it are dropped, so pushing
+// continues from there.
+bool Rewind::seek_back(size_t back, vector<uint8_t> &out) {
+  if (back >= count) return false;
+
+  size_t target = count - 1 - back;
+  size_t key = target;
+  while (key > 0 && !frame(key).key) key--;
+  for (size_t i = key; i <= target; i++) {
+    if (!decode(frame(i).data, frame(i).key, out)) return false;
+  }
+
+  count = target + 1;
+  since_key = target - key;
+  last = out;
+  return true;
+}
+
+void Rewind::encode(const vector<uint8_t> &state, const vector<uint8_t> *prev_state, vector<uint8_t> &out) {
+  const uint8_t *cur = state.data();
+  const uint8_t *prev = prev_state ? prev_state->data() : nullptr;
+  size_t size = state.size();
+
+  out.clear();
+  put_varint(out, size);
+
+  size_t pos = 0;
+  while (pos < size) {
+    size_t start = pos;
+    while (pos + 8 <= size && same_word(cur, prev, pos)) pos += 8;
+    while (pos < size && same_byte(cur, prev, pos)) pos++;
+    if (pos == size) break;
+
+    // The literal ends at the last change before REWIND_MIN_RUN unchanged
+    // bytes, so short gaps do not cost a pair of varints each.
+    size_t end = pos + 1;
+    for (size_t i = end; i < size && i - end < REWIND_MIN_RUN; i++) {
+      if (!same_byte(cur, prev, i)) end = i + 1;
+    }
+
+    put_varint(out, pos - start);
+    put_varint(out, end - pos);
+    size_t at = out.size();
+    out.resize(at + end - pos);
+    for (size_t i = pos; i < end; i++) out[at++] = cur[i] ^ (prev ? prev[i] : 0);
+    pos = end;
+  }
+}
+
+// Applies an encoded frame to `out`, which holds the previous state unless
+// the frame is a keyframe.
+bool Rewind::decode(const vector<uint8_t> &data, bool key, vector<uint8_t> &out) {
+  size_t pos = 0;
+  size_t size;
+  if (!get_varint(data, pos, size)) return false;
+  if (key) {
+    out.assign(size, 0);
+  } else if (out.size() != size) {
+    return false;
+  }
+
+  size_t at = 0;
+  while (pos < data.size()) {
+    size_t skip, len;
+    if (!get_varint(data, pos, skip) || !get_varint(data, pos, len)) return false;
+    at += skip;
+    if (at > size || len > size - at || len > data.size() - pos) return false;
+    for (size_t i = 0; i < len; i++) out[at + i] ^= data[pos + i];
+    at += len;
+    pos += len;
+  }
+  return true;
+}
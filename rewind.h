@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#define REWIND_FRAME_RATE 60  // The DMG draws 59.7 frames per second.
+#define REWIND_SECONDS    10  // Kept by the interactive emulator.
+#define REWIND_MIN_RUN    8   // Unchanged bytes that end a literal run.
+
+// Ring of the save states of the last frames, compressed.
+//
+// A frame is stored as its XOR against the frame before it, run-length
+// encoded: from one frame to the next most of the machine does not change, so
+// the XOR is mostly zero runs. Every `keyframe_interval` frames the state is
+// stored whole instead, which bounds the deltas to apply when seeking. When
+// the ring is full the oldest keyframe is dropped with the deltas that depend
+// on it.
+//
+// Encoded frames are a varint of the state size, then pairs of varints (bytes
+// to skip, bytes of literal) each followed by the literal bytes.
+class Rewind {
+public:
+  Rewind(size_t, size_t);
+  void clear();
+  void push(const vector<uint8_t> &);
+  bool seek_back(size_t, vector<uint8_t> &);  // Drops the frames after it.
+  size_t frames();
+  size_t bytes();  // Compressed size of the frames held.
+
+private:
+  struct Frame {
+    vector<uint8_t> data;
+    bool key;
+  };
+
+  vector<Frame> ring;  // Buffers are reused, so a full ring stops allocating.
+  size_t first;        // Ring index of the oldest frame.
+  size_t count;
+  size_t keyframe_interval;
+  size_t since_key;      // Frames pushed since the newest keyframe.
+  vector<uint8_t> last;  // State of the newest frame.
+
+  Frame &frame(size_t);
+  static void encode(const vector<uint8_t> &, const vector<uint8_t> *, vector<uint8_t> &);
+  static bool decode(const vector<uint8_t> &, bool, vector<uint8_t> &);
+};
@@ -0,0 +1,205 @@
+#include "savestate.h"
+#include <cstddef>
+#include <cstring>
+#include "environment.h"
+
+using namespace std;
+
+#define STATE_FIXED_PAGES ((sizeof(vram) + sizeof(wram) + sizeof(oam) + sizeof(io)) / STATE_PAGE)
+
+// Pages of writable memory in save-state order.
+size_t Environment::state_pages() {
+  size_t ram = cart ? cart->ram_size() : 0;
+  return STATE_FIXED_PAGES + ram / STATE_PAGE;
+}
+
+uint8_t *Environment::state_page(size_t i) {
+  size_t offs = i * STATE_PAGE;
+  if (offs < sizeof(vram)) return vram + offs;
+  offs -= sizeof(vram);
+  if (offs < sizeof(wram)) return wram + offs;
+  offs -= sizeof(wram);
+  if (offs < sizeof(oam)) return oam;
+  offs -= sizeof(oam);
+  if (offs < sizeof(io)) return io;
+  offs -= sizeof(io);
+  return cart->ram_data() + offs;
+}
+
+void Environment::save_machine(MachineState &state) {
+  memset(&state, 0, sizeof(state));
+  state.a = cpu.reg_a;
+  state.f = cpu.f();
+  state.b = cpu.reg_b;
+  state.c = cpu.reg_c;
+  state.d = cpu.reg_d;
+  state.e = cpu.reg_e;
+  state.h = cpu.reg_h;
+  state.l = cpu.reg_l;
+  state.sp = cpu.reg_sp;
+  state.pc = cpu.reg_pc;
+  state.ime = cpu.ime;
+  state.ime_pending = cpu.ime_pending;
+  state.halted = cpu.halted;
+  state.irq_check = irq_check;
+
+  state.t = t;
+  state.div_base = div_base;
+  state.timer_synced = timer_synced;
+  state.timer_period = timer_period;
+  for (size_t i = 0; i < EVENT_COUNT; i++) state.events[i] = sched.deadline((Event) i);
+
+  ppu.save_state(state.ppu);
+  if (cart) cart->save_state(state.cart);
+}
+
+// Expects the memory pages to be restored already: the memory map follows
+// the cartridge banks and the boot ROM register.
+void Environment::load_machine(const MachineState &state) {
+  cpu.reg_a = state.a;
+  cpu.set_f(state.f);
+  cpu.reg_b = state.b;
+  cpu.reg_c = state.c;
+  cpu.reg_d = state.d;
+  cpu.reg_e = state.e;
+  cpu.reg_h = state.h;
+  cpu.reg_l = state.l;
+  cpu.reg_sp = state.sp;
+  cpu.reg_pc = state.pc;
+  cpu.ime = state.ime;
+  cpu.ime_pending = state.ime_pending;
+  cpu.halted = state.halted;
+  irq_check = state.irq_check;
+
+  t = state.t;
+  div_base = state.div_base;
+  timer_synced = state.timer_synced;
+  timer_period = state.timer_period;
+  sched.reset();
+  for (size_t i = 0; i < EVENT_COUNT; i++) sched.schedule((Event) i, state.events[i]);
+
+  ppu.load_state(state.ppu);
+  if (cart) cart->load_state(state.cart);
+  reset_mem_map();
+
+  crashed = false;
+  crash_msg[0] = '\0';
+}
+
+void Environment::save_state(vector<uint8_t> &out) {
+  size_t pages = state_pages();
+  out.resize(sizeof(StateHeader) + sizeof(MachineState) + pages * STATE_PAGE);
+
+  StateHeader header = {};
+  header.magic = STATE_MAGIC;
+  header.version = STATE_VERSION;
+  header.kind = STATE_FULL;
+  header.size = out.size();
+  header.pages = pages;
+  memcpy(out.data(), &header, sizeof(header));
+
+  MachineState state;
+  save_machine(state);
+  memcpy(out.data() + sizeof(header), &state, sizeof(state));
+
+  uint8_t *page = out.data() + sizeof(header) + sizeof(state);
+  for (size_t i = 0; i < pages; i++, page += STATE_PAGE) memcpy(page, state_page(i), STATE_PAGE);
+}
+
+// Finds the dirty pages by comparing against the base rather than tracking
+// writes, so the store fast path stays a single indexed store.
+bool Environment::save_delta(const vector<uint8_t> &base, vector<uint8_t> &out) {
+  if (!check_state(base, STATE_FULL)) return false;
+
+  size_t pages = state_pages();
+  const uint8_t *base_page = base.data() + sizeof(StateHeader) + sizeof(MachineState);
+  MachineState base_state;
+  memcpy(&base_state, base.data() + sizeof(StateHeader), sizeof(base_state));
+
+  out.resize(sizeof(StateHeader) + sizeof(MachineState) + pages * sizeof(StatePage));
+  uint8_t *pos = out.data() + sizeof(StateHeader) + sizeof(MachineState);
+  uint32_t dirty = 0;
+  for (size_t i = 0; i < pages; i++, base_page += STATE_PAGE) {
+    const uint8_t *page = state_page(i);
+    if (memcmp(page, base_page, STATE_PAGE) == 0) continue;
+    StatePage entry;
+    entry.index = i;
+    memcpy(entry.data, page, STATE_PAGE);
+    memcpy(pos, &entry, sizeof(entry));
+    pos += sizeof(entry);
+    dirty++;
+  }
+  out.resize(pos - out.data());
+
+  StateHeader header = {};
+  header.magic = STATE_MAGIC;
+  header.version = STATE_VERSION;
+  header.kind = STATE_DELTA;
+  header.size = out.size();
+  header.pages = dirty;
+  header.base_cycle = base_state.t;
+  memcpy(out.data(), &header, sizeof(header));
+
+  MachineState state;
+  save_machine(state);
+  memcpy(out.data() + sizeof(header), &state, sizeof(state));
+  return true;
+}
+
+// A state only loads into a machine with the same cartridge RAM size.
+bool Environment::check_state(const vector<uint8_t> &buf, uint16_t kind) {
+  StateHeader header;
+  if (buf.size() < sizeof(header) + sizeof(MachineState)) return false;
+  memcpy(&header, buf.data(), sizeof(header));
+  if (header.magic != STATE_MAGIC || header.version != STATE_VERSION || header.kind != kind) return false;
+  if (header.size != buf.size()) return false;
+
+  size_t page_size = kind == STATE_FULL ? STATE_PAGE : sizeof(StatePage);
+  if (kind == STATE_FULL && header.pages != state_pages()) return false;
+  return buf.size() == sizeof(header) + sizeof(MachineState) + header.pages * page_size;
+}
+
+bool Environment::load_state(const vector<uint8_t> &buf) {
+  if (!check_state(buf, STATE_FULL)) return false;
+
+  const uint8_t *page = buf.data() + sizeof(StateHeader) + sizeof(MachineState);
+  size_t pages = state_pages();
+  for (size_t i = 0; i < pages; i++, page += STATE_PAGE) memcpy(state_page(i), page, STATE_PAGE);
+
+  MachineState state;
+  memcpy(&state, buf.data() + sizeof(StateHeader), sizeof(state));
+  load_machine(state);
+  return true;
+}
+
+bool Environment::load_delta(const vector<uint8_t> &base, const vector<uint8_t> &delta) {
+  if (!check_state(base, STATE_FULL) || !check_state(delta, STATE_DELTA)) return false;
+
+  StateHeader header;
+  MachineState state;
+  memcpy(&header, delta.data(), sizeof(header));
+  memcpy(&state, base.data() + sizeof(StateHeader), sizeof(state));
+  if (header.base_cycle != state.t) return false;
+
+  // Validate every page index before touching the machine.
+  size_t pages = state_pages();
+  const uint8_t *entries = delta.data() + sizeof(StateHeader) + sizeof(MachineState);
+  for (size_t i = 0; i < header.pages; i++) {
+    uint16_t index;
+    memcpy(&index, entries + i * sizeof(StatePage), sizeof(index));
+    if (index >= pages) return false;
+  }
+
+  const uint8_t *page = base.data() + sizeof(StateHeader) + sizeof(MachineState);
+  for (size_t i = 0; i < pages; i++, page += STATE_PAGE) memcpy(state_page(i), page, STATE_PAGE);
+  for (size_t i = 0; i < header.pages; i++) {
+    const uint8_t *entry = entries + i * sizeof(StatePage);
+    uint16_t index;
+    memcpy(&index, entry, sizeof(index));
+    memcpy(state_page(index), entry + offsetof(StatePage, data), STATE_PAGE);
+  }
+
+  memcpy(&state, delta.data() + sizeof(StateHeader), sizeof(state));
+  load_machine(state);
+  return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include "cartridge.h"
+#include "ppu.h"
+#include "scheduler.h"
+
+using namespace std;
+
+#define STATE_MAGIC   0x54534247  // "GBST"
+#define STATE_VERSION 1
+#define STATE_PAGE    0x100
+
+#define STATE_FULL  0
+#define STATE_DELTA 1
+
+// Save states are flat buffers in host byte order, without pointers:
+//
+//   StateHeader | MachineState | pages
+//
+// The pages are the machine's writable memory in 256-byte pages: VRAM, WRAM,
+// OAM, the I/O page (registers, HRAM and IE), then cartridge RAM. A full state
+// has all of them back to back. A delta state belongs to a full state and only
+// has the pages that differ from it, each as a StatePage.
+//
+// Structs are zeroed before they are filled, so equal machines give equal
+// buffers, padding included.
+struct StateHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t kind;        // STATE_FULL or STATE_DELTA.
+  uint32_t size;        // Whole buffer, header included.
+  uint32_t pages;       // Pages that follow the MachineState.
+  uint64_t base_cycle;  // Delta only: cycle of the full state it belongs to.
+};
+
+struct MachineState {
+  uint8_t a, f, b, c, d, e, h, l;
+  uint16_t sp, pc;
+  uint8_t ime, ime_pending, halted;
+  uint8_t irq_check;
+
+  uint64_t t;
+  uint64_t div_base;
+  uint64_t timer_synced;
+  uint16_t timer_period;
+  uint64_t events[EVENT_COUNT];  // Deadline of every event, CYCLE_NEVER if idle.
+
+  PPU::State ppu;
+  Cartridge::State cart;
+};
+
+struct StatePage {
+  uint16_t index;
+  uint8_t data[STATE_PAGE];
+};
+
+static_assert(sizeof(StatePage) == STATE_PAGE + 2, "Delta pages are packed back to back");
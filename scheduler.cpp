@@ -0,0 +1,95 @@
+#include "scheduler.h"
+
+using namespace std;
+
+Scheduler::Scheduler() {
+  reset();
+}
+
+void Scheduler::reset() {
+  size = 0;
+  for (size_t i = 0; i < EVENT_COUNT; i++) slot[i] = -1;
+  next = CYCLE_NEVER;
+}
+
+void Scheduler::schedule(Event event, uint64_t when) {
+  if (when == CYCLE_NEVER) {
+    cancel(event);
+    return;
+  }
+
+  int i = slot[(size_t) event];
+  if (i < 0) {
+    place(size++, { when, event });
+    sift_up(size - 1);
+  } else {
+    uint64_t old = heap[i].when;
+    heap[i].when = when;
+    if (when < old) {
+      sift_up(i);
+    } else {
+      sift_down(i);
+    }
+  }
+  next = heap[0].when;
+}
+
+void Scheduler::cancel(Event event) {
+  int i = slot[(size_t) event];
+  if (i >= 0) remove(i);
+}
+
+// Takes the earliest event if it is due at `now`.
+bool Scheduler::pop_due(uint64_t now, Event *event) {
+  if (size == 0 || heap[0].when > now) return false;
+  *event = heap[0].event;
+  remove(0);
+  return true;
+}
+
+uint64_t Scheduler::deadline(Event event) {
+  int i = slot[(size_t) event];
+  return i < 0 ? CYCLE_NEVER : heap[i].when;
+}
+
+void Scheduler::remove(size_t i) {
+  slot[(size_t) heap[i].event] = -1;
+  size--;
+  if (i < size) {
+    // Refill the hole with the last entry, which may need to go either way.
+    Event moved = heap[size].event;
+    place(i, heap[size]);
+    sift_up(i);
+    sift_down(slot[(size_t) moved]);
+  }
+  next = size ? heap[0].when : CYCLE_NEVER;
+}
+
+void Scheduler::sift_up(size_t i) {
+  Entry entry = heap[i];
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (heap[parent].when <= entry.when) break;
+    place(i, heap[parent]);
+    i = parent;
+  }
+  place(i, entry);
+}
+
+void Scheduler::sift_down(size_t i) {
+  Entry entry = heap[i];
+  for (;;) {
+    size_t child = i * 2 + 1;
+    if (child >= size) break;
+    if (child + 1 < size && heap[child + 1].when < heap[child].when) child++;
+    if (entry.when <= heap[child].when) break;
+    place(i, heap[child]);
+    i = child;
+  }
+  place(i, entry);
+}
+
+void Scheduler::place(size_t i, const Entry &entry) {
+  heap[i] = entry;
+  slot[(size_t) entry.event] = i;
+}
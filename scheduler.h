@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include "defines.h"
+
+using namespace std;
+
+// Timed hardware events. Each kind is scheduled at most once at a time.
+enum class Event : uint8_t {
+  Timer,   // TIMA overflow.
+  Ppu,     // PPU mode change.
+  Serial,  // End of a serial transfer.
+  Count,
+};
+
+#define EVENT_COUNT ((size_t) Event::Count)
+
+// Cycle-ordered event queue: a binary min-heap of (cycle, event) with the heap
+// slot of every event kind indexed, so rescheduling is a single sift.
+//
+// The earliest deadline is kept in `next`, so the CPU loop only compares the
+// cycle counter against one value per instruction.
+class Scheduler {
+public:
+  Scheduler();
+  void reset();
+
+  void schedule(Event, uint64_t);  // Moves the event if queued. CYCLE_NEVER cancels.
+  void cancel(Event);
+  bool pop_due(uint64_t, Event *);
+  uint64_t deadline(Event);
+
+  uint64_t next;  // Earliest deadline, CYCLE_NEVER when empty.
+
+private:
+  struct Entry {
+    uint64_t when;
+    Event event;
+  };
+
+  Entry heap[EVENT_COUNT];
+  size_t size;
+  int slot[EVENT_COUNT];  // Heap index of each event, -1 when not queued.
+
+  void remove(size_t);
+  void sift_up(size_t);
+  void sift_down(size_t);
+  void place(size_t, const Entry &);
+};
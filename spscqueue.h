@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Each side only writes its own index, so a push and a pop
+// never contend; N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  // Producer only. Fails when the queue is full.
+  bool push(const T &item) {
+    size_t at = tail.load(memory_order_relaxed);
+    if (at - head.load(memory_order_acquire) == N) return false;
+    items[at & (N - 1)] = item;
+    tail.store(at + 1, memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Fails when the queue is empty.
+  bool pop(T &item) {
+    size_t at = head.load(memory_order_relaxed);
+    if (at == tail.load(memory_order_acquire)) return false;
+    item = move(items[at & (N - 1)]);
+    head.store(at + 1, memory_order_release);
+    return true;
+  }
+
+  bool empty() {
+    return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+  }
+
+private:
+  T items[N];
+  atomic<size_t> head;  // Next item to pop, written by the consumer.
+  atomic<size_t> tail;  // Next slot to fill, written by the producer.
+};
@@ -0,0 +1,60 @@
+#include "stats.h"
+
+using namespace std;
+
+static const char *const region_names[MEM_REGIONS] = {
+  "rom", "vram", "cart_ram", "wram", "echo", "oam", "io", "hram",
+};
+
+void Stats::clear() {
+  *this = Stats();
+  frame_start = chrono::steady_clock::now();
+}
+
+void Stats::end_frame() {
+  auto now = chrono::steady_clock::now();
+  uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(now - frame_start).count();
+  frame_start = now;
+  frames++;
+  frame_ns += ns;
+  if (ns > frame_ns_max) frame_ns_max = ns;
+}
+
+static void write_regions(FILE *out, const char *name, const uint64_t *counts) {
+  fprintf(out, "  \"%s\": {", name);
+  for (int i = 0; i < MEM_REGIONS; i++) {
+    fprintf(out, "%s\"%s\": %lu", i ? ", " : "", region_names[i], (unsigned long) counts[i]);
+  }
+  fprintf(out, "},\n");
+}
+
+// Only the opcodes that ran, keyed by their hex value.
+static void write_opcodes(FILE *out, const char *name, const uint64_t *counts, bool last) {
+  fprintf(out, "  \"%s\": {", name);
+  bool first = true;
+  for (int op = 0; op < 0x100; op++) {
+    if (!counts[op]) continue;
+    fprintf(out, "%s\"0x%.2x\": %lu", first ? "" : ", ", op, (unsigned long) counts[op]);
+    first = false;
+  }
+  fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+void Stats::write_json(FILE *out, uint64_t cycles) const {
+  fprintf(out, "{\n");
+  fprintf(out, "  \"instructions\": %lu,\n", (unsigned long) instructions);
+  fprintf(out, "  \"cycles\": %lu,\n", (unsigned long) cycles);
+  fprintf(out, "  \"frames\": %lu,\n", (unsigned long) frames);
+  fprintf(out, "  \"host_ns_per_frame\": %lu,\n", (unsigned long) (frames ? frame_ns / frames : 0));
+  fprintf(out, "  \"host_ns_per_frame_max\": %lu,\n", (unsigned long) frame_ns_max);
+  fprintf(out, "  \"blocks\": %lu,\n", (unsigned long) blocks);
+  fprintf(out, "  \"native_blocks\": %lu,\n", (unsigned long) native_blocks);
+  fprintf(out, "  \"events\": %lu,\n", (unsigned long) events);
+  fprintf(out, "  \"interrupts\": %lu,\n", (unsigned long) interrupts);
+  fprintf(out, "  \"debugger\": %lu,\n", (unsigned long) debugger);
+  write_regions(out, "reads", reads);
+  write_regions(out, "writes", writes);
+  write_opcodes(out, "opcodes", opcodes, false);
+  write_opcodes(out, "cb_opcodes", cb_opcodes, true);
+  fprintf(out, "}\n");
+}
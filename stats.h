@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+using namespace std;
+
+// Regions of the memory map, as counted by get_mem() and set_mem().
+enum MemRegion : uint8_t {
+  RegionRom,
+  RegionVram,
+  RegionCartRam,
+  RegionWram,
+  RegionEcho,
+  RegionOam,
+  RegionIo,
+  RegionHram,
+  MEM_REGIONS,
+};
+
+inline MemRegion mem_region(uint16_t addr) {
+  if (addr < 0x8000) return RegionRom;
+  if (addr < 0xFE00) return MemRegion(RegionVram + ((addr - 0x8000) >> 13));
+  if (addr < 0xFF00) return RegionOam;
+  if (addr >= 0xFF80 && addr < 0xFFFF) return RegionHram;
+  return RegionIo;
+}
+
+// Counters of what the emulator itself does, per Environment. They are plain
+// increments, compiled in with STATS (see defines.h) and bumped through
+// STAT() so that other builds do not pay for them.
+struct Stats {
+  uint64_t instructions;
+  uint64_t opcodes[0x100];
+  uint64_t cb_opcodes[0x100];
+  uint64_t reads[MEM_REGIONS];
+  uint64_t writes[MEM_REGIONS];
+  uint64_t blocks;         // Runs of cached blocks...
+  uint64_t native_blocks;  // ...and of their native code.
+  uint64_t events;
+  uint64_t interrupts;
+  uint64_t debugger;       // Calls into the debugger.
+
+  // Host time per emulated frame, including any time stopped in the debugger.
+  uint64_t frames;
+  uint64_t frame_ns;
+  uint64_t frame_ns_max;
+  chrono::steady_clock::time_point frame_start;
+
+  void clear();
+  inline void retire(uint8_t opcode) {
+    instructions++;
+    opcodes[opcode]++;
+  }
+  void end_frame();
+  void write_json(FILE *, uint64_t) const;  // With the cycles emulated.
+};
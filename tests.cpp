@@ -1,6 +1,21 @@
 #include "tests.h"
 #include "util.h"
 #include "defines.h"
+#include "condition.h"
+#include "conform.h"
+#include "cpu.h"
+#include "environment.h"
+#include "cartridge.h"
+#include "opcodes.h"
+#include "ppu.h"
+#include "profiler.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "spscqueue.h"
+#include <cstddef>
+#include <cstdio>
+#include <unistd.h>
+#include <cstring>
 #include <cassert>
 
 void run_test() {
@@ -25,4 +40,480 @@ void run_test() {
   uint8_t a = 250;
   uint8_t b = 250;
   assert(a + b > 0xFF);
+
+  CPU cpu;
+  for (unsigned int f = 0; f <= 0xF0; f += 0x10) {
+    cpu.set_f(f);
+    assert(cpu.f() == f);
+  }
+  cpu.flag_z = 0x10;
+  cpu.flag_n = true;
+  cpu.flag_h = 0x0F ^ 0x01 ^ 0x10;
+  cpu.flag_c = 0x0F + 0x01;
+  assert(cpu.f() == 0b01100000);
+
+  // Echo RAM is the same storage as WRAM.
+  unique_ptr<uint8_t[]> rom(new uint8_t[ROM_SIZE]);
+  const uint8_t echo_prog[] = {
+    0x21, 0x23, 0xE1, // LD HL,$E123
+    0x36, 0x42,       // LD (HL),$42
+  };
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), echo_prog, sizeof(echo_prog));
+  unique_ptr<Environment> env(new Environment(move(rom)));
+  env->reset();
+  env->step();
+  env->step();
+  assert(env->peek_mem(0xC123) == 0x42);
+  assert(env->peek_mem(0xE123) == 0x42);
+
+  // A watched page still reads and writes the memory underneath.
+  env->watch_page(0xE1, WATCH_READ | WATCH_WRITE);
+  env->reset();
+  env->step();
+  env->step();
+  assert(env->peek_mem(0xC123) == 0x42);
+  assert(env->peek_mem(0xE123) == 0x42);
+  env->watch_page(0xE1, 0);
+
+  // Host counters, split by region: the echo write is not a WRAM one.
+  assert(mem_region(0x7FFF) == RegionRom && mem_region(0xA000) == RegionCartRam);
+  assert(mem_region(0xE123) == RegionEcho && mem_region(0xFE9F) == RegionOam);
+  assert(mem_region(0xFF80) == RegionHram && mem_region(0xFFFF) == RegionIo);
+  #ifdef STATS
+    char json[2048] = {};
+    FILE *json_file = fmemopen(json, sizeof(json) - 1, "w");
+    env->memory_hash();  // Peeks, so it counts no reads.
+    assert(env->write_stats(json_file));
+    fclose(json_file);
+    assert(strstr(json, "\"instructions\": 2,"));
+    assert(strstr(json, "\"reads\": {\"rom\": 0, \"vram\": 0, \"cart_ram\": 0, \"wram\": 0, \"echo\": 0, \"oam\": 0, \"io\": 0, \"hram\": 0}"));
+    assert(strstr(json, "\"writes\": {\"rom\": 0, \"vram\": 0, \"cart_ram\": 0, \"wram\": 0, \"echo\": 1,"));
+    assert(strstr(json, "\"opcodes\": {\"0x21\": 1, \"0x36\": 1}"));
+  #else
+    // Without counters, not even an empty file is written.
+    const char *stats_path = "/tmp/cppboy_no_stats.json";
+    unlink(stats_path);
+    assert(!env->save_stats(stats_path) && access(stats_path, F_OK) != 0);
+  #endif
+
+  #ifdef DEBUG
+    // HRAM is accessed inline, except while a watchpoint covers its page.
+    rom.reset(new uint8_t[ROM_SIZE]);
+    const uint8_t watch_prog[] = {
+      0x3E, 0x42, // LD A,$42
+      0xE0, 0x90, // LDH ($90),A
+    };
+    memset(rom.get(), 0, ROM_SIZE);
+    memcpy(rom.get(), watch_prog, sizeof(watch_prog));
+    env.reset(new Environment(move(rom)));
+    env->reset();
+    Watchpoint watch;
+    watch.start = watch.end = 0xFF90;
+    watch.kinds = WATCH_WRITE;
+    env->debugger().watch(watch);
+    // Past the stop at cycle 0, this only clears the attention set at startup.
+    env->debugger().service(1, env->registers());
+    env->step();
+    assert(!env->debugger().pending(0));
+    env->step();
+    assert(env->debugger().pending(0) && env->peek_mem(0xFF90) == 0x42);
+  #endif
+
+  // MBC1 bank switching through a write into ROM.
+  char cart_path[] = "/tmp/cppboy_cart_XXXXXX";
+  int fd = mkstemp(cart_path);
+  assert(fd >= 0);
+  vector<uint8_t> image(4 * CART_BANK_SIZE, 0);
+  for (int bank = 0; bank < 4; bank++) image[bank * CART_BANK_SIZE + 0x200] = bank;
+  image[CART_ADDR_TYPE] = 0x01;
+  image[CART_ADDR_ROM_SIZE] = 0x01;
+  assert(write(fd, image.data(), image.size()) == (ssize_t) image.size());
+  close(fd);
+
+  Cartridge cart;
+  assert(cart.load(cart_path));
+  unlink(cart_path);
+  assert(cart.mbc == Mbc::Mbc1);
+
+  rom.reset(new uint8_t[ROM_SIZE]);
+  const uint8_t mbc_prog[] = {
+    0x21, 0x00, 0x20, // LD HL,$2000
+    0x36, 0x03,       // LD (HL),$03
+    0x36, 0x00,       // LD (HL),$00
+    0x26, 0x60,       // LD H,$60
+    0x36, 0x01,       // LD (HL),$01 (mode 1)
+  };
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), mbc_prog, sizeof(mbc_prog));
+  env.reset(new Environment(move(rom)));
+  env->insert_cartridge(&cart);
+  env->reset();
+  assert(env->peek_mem(0x0200) == 0);
+  assert(env->peek_mem(0x4200) == 1);
+  env->step();
+  env->step();
+  assert(env->peek_mem(0x4200) == 3);
+  env->step();
+  assert(env->peek_mem(0x4200) == 1); // Bank 0 selects bank 1.
+  env->step();
+  env->step();
+  assert(env->peek_mem(0x0000) == 0x21); // The boot ROM stays over page 0.
+
+  // Scheduler: events come out in cycle order, rescheduling moves them.
+  Scheduler sched;
+  Event event;
+  sched.schedule(Event::Ppu, 300);
+  sched.schedule(Event::Timer, 100);
+  sched.schedule(Event::Serial, 200);
+  assert(sched.next == 100);
+  sched.schedule(Event::Timer, 400);
+  assert(sched.next == 200);
+  assert(!sched.pop_due(199, &event));
+  assert(sched.pop_due(300, &event) && event == Event::Serial);
+  assert(sched.pop_due(300, &event) && event == Event::Ppu);
+  assert(!sched.pop_due(300, &event));
+  sched.cancel(Event::Timer);
+  assert(sched.next == CYCLE_NEVER);
+
+  // Debugger command queue: FIFO, bounded, and wraps around.
+  SpscQueue<int, 4> queue;
+  int item;
+  assert(!queue.pop(item));
+  for (int i = 0; i < 4; i++) assert(queue.push(i));
+  assert(!queue.push(4));
+  assert(queue.pop(item) && item == 0);
+  assert(queue.push(4));
+  for (int i = 1; i <= 4; i++) assert(queue.pop(item) && item == i);
+  assert(queue.empty());
+
+  // Breakpoint conditions: compiled once, tested against the machine.
+  Condition condition;
+  cpu.reg_a = 0x10;
+  cpu.reg_h = 0xC1;
+  cpu.reg_l = 0x23;
+  assert(condition.compile("A==0x10 && HL>$C000"));
+  assert(condition.test(cpu, env.get()));
+  assert(condition.compile("[0xC123] == [HL] && !(A < 16)"));
+  assert(condition.test(cpu, env.get()));
+  assert(condition.compile("a != 16"));
+  assert(!condition.test(cpu, env.get()));
+  assert(condition.compile(" ") && condition.test(cpu, env.get()));
+  assert(!condition.compile("A == "));
+  assert(!condition.compile("(A == 1"));
+  assert(!condition.compile("Q == 1"));
+  string nested = string(COND_NESTING - 1, '(') + "A" + string(COND_NESTING - 1, ')');
+  assert(condition.compile(nested) && condition.test(cpu, env.get()));
+  assert(!condition.compile("(" + nested + ")"));
+  assert(!condition.compile(string(100000, '!') + "A") && strstr(condition.error.c_str(), "too deeply nested"));
+
+  // Profiler: a call charges its callee until SP is back above the return
+  // address; untaken branches change nothing.
+  Profiler profiler(0x0100);
+  cpu.reg_sp = 0xFFFC;
+  cpu.reg_pc = 0x0200;
+  profiler.record(0x0100, 0xCD, cpu, 24); // CALL $0200
+  cpu.reg_pc = 0x0201;
+  profiler.record(0x0200, 0x00, cpu, 4);  // NOP
+  cpu.reg_pc = 0x0204;
+  profiler.record(0x0201, 0xC4, cpu, 12); // CALL NZ, not taken
+  cpu.reg_sp = 0xFFFE;
+  cpu.reg_pc = 0x0106;
+  profiler.record(0x0204, 0xC9, cpu, 16); // RET
+  profiler.record(0x0106, 0x00, cpu, 4);
+  char folded_path[] = "/tmp/cppboy_folded_XXXXXX";
+  fd = mkstemp(folded_path);
+  assert(fd >= 0);
+  close(fd);
+  assert(profiler.save_folded(folded_path));
+  char folded[64] = {};
+  FILE *file = fopen(folded_path, "r");
+  assert(file && fread(folded, 1, sizeof(folded) - 1, file) > 0);
+  fclose(file);
+  unlink(folded_path);
+  assert(strcmp(folded, "0x0100 28\n0x0100;0x0200 32\n") == 0);
+
+  // Profiler on the machine: CALL and RST nest their callee, RET pops it.
+  #ifdef PROFILER
+    rom.reset(new uint8_t[ROM_SIZE]);
+    const uint8_t call_prog[] = {
+      0x31, 0xFE, 0xFF, // LD SP,$FFFE
+      0xCD, 0x10, 0x00, // CALL $0010
+      0xCF,             // RST 08H
+      0x00,             // NOP
+      0xC9,             // $0008: RET
+    };
+    memset(rom.get(), 0, ROM_SIZE);
+    memcpy(rom.get(), call_prog, sizeof(call_prog));
+    rom[0x11] = 0xC9; // $0010: NOP, RET
+    env.reset(new Environment(move(rom)));
+    env->reset();
+    assert(env->enable_profiler(true));
+    for (int i = 0; i < 7; i++) assert(env->step());
+    assert(env->registers().reg_pc == 0x0008 && env->registers().reg_sp == 0xFFFE);
+    char call_path[] = "/tmp/cppboy_folded_XXXXXX";
+    fd = mkstemp(call_path);
+    assert(fd >= 0);
+    close(fd);
+    assert(env->save_profile(call_path));
+    memset(folded, 0, sizeof(folded));
+    file = fopen(call_path, "r");
+    assert(file && fread(folded, 1, sizeof(folded) - 1, file) > 0);
+    fclose(file);
+    unlink(call_path);
+    assert(strcmp(folded, "0x0000 56\n0x0000;0x0010 20\n0x0000;0x0008 16\n") == 0);
+  #endif
+
+  // Code run from HRAM, which has no read pointer, returns to a cached page.
+  rom.reset(new uint8_t[ROM_SIZE]);
+  const uint8_t hram_prog[] = {
+    0x31, 0xFE, 0xFF, // LD SP,$FFFE
+    0x3E, 0xD9,       // LD A,$D9 (RETI)
+    0xE0, 0x80,       // LDH ($80),A
+    0xCD, 0x80, 0xFF, // CALL $FF80
+    0x3E, 0x42,       // LD A,$42
+  };
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), hram_prog, sizeof(hram_prog));
+  env.reset(new Environment(move(rom)));
+  env->reset();
+  for (int i = 0; i < 6; i++) assert(env->step());
+  assert(env->registers().reg_a == 0x42 && env->registers().reg_pc == sizeof(hram_prog));
+
+  // Timer: TIMA is only brought up to date when read, and overflows on time.
+  rom.reset(new uint8_t[ROM_SIZE]);
+  const uint8_t timer_prog[] = {
+    0x3E, 0xFE,       // LD A,$FE
+    0xE0, 0x05,       // LDH (TIMA),A
+    0x3E, 0x05,       // LD A,$05
+    0xE0, 0x07,       // LDH (TAC),A: start, 16 cycles per increment
+  };
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), timer_prog, sizeof(timer_prog));
+  env.reset(new Environment(move(rom)));
+  env->reset();
+  env->run_for(100);
+  assert(env->cycles() == 100);
+  assert(ISBITN(env->peek_mem(ADDR_IF), INT_TIMER));
+  assert(env->peek_mem(ADDR_TIMA) == 3); // Overflowed at 48, then 64, 80, 96.
+  assert(env->peek_mem(ADDR_DIV) == 0);
+  env->run_for(0x300);
+  assert(env->peek_mem(ADDR_DIV) == 3);
+
+  // HALT sleeps until the VBlank interrupt instead of stepping through the frame.
+  rom.reset(new uint8_t[ROM_SIZE]);
+  const uint8_t halt_prog[] = {
+    0x31, 0xFE, 0xFF, // 0x00 LD SP,$FFFE
+    0x3E, 0x91,       // 0x03 LD A,$91
+    0xE0, 0x40,       // 0x05 LDH (LCDC),A
+    0x3E, 0x01,       // 0x07 LD A,$01
+    0xE0, 0xFF,       // 0x09 LDH (IE),A: VBlank
+    0xFB,             // 0x0B EI
+    0x76,             // 0x0C HALT
+    0x20, 0xFD,       // 0x0D JR NZ,$0C
+  };
+  const uint8_t vblank_isr[] = {
+    0x21, 0x00, 0xC0, // 0x40 LD HL,$C000
+    0x34,             // 0x43 INC (HL)
+    0xD9,             // 0x44 RETI
+  };
+  memset(rom.get(), 0, ROM_SIZE);
+  memcpy(rom.get(), halt_prog, sizeof(halt_prog));
+  memcpy(rom.get() + 0x40, vblank_isr, sizeof(vblank_isr));
+  env.reset(new Environment(move(rom)));
+  env->reset();
+  uint64_t instructions = env->run_for(PPU_LINE_DOTS * PPU_LINES * 2);
+  assert(env->peek_mem(0xC000) == 2);
+  assert(instructions < 2000);
+
+  // Save states: loading one and running again repeats the run exactly.
+  vector<uint8_t> state, delta;
+  env->save_state(state);
+  env->run_for(env->cycles() + PPU_LINE_DOTS * PPU_LINES);
+  assert(env->save_delta(state, delta));
+  assert(delta.size() < state.size());
+  uint64_t regs = env->register_hash(), mem = env->memory_hash(), cycles = env->cycles();
+  env->run_for(cycles + PPU_LINE_DOTS * PPU_LINES);
+  assert(env->peek_mem(0xC000) == 4);
+  assert(env->load_state(state));
+  assert(env->peek_mem(0xC000) == 2);
+  env->run_for(cycles);
+  assert(env->cycles() == cycles && env->register_hash() == regs && env->memory_hash() == mem);
+  env->run_for(cycles + PPU_LINE_DOTS * PPU_LINES);
+  assert(env->load_delta(state, delta));
+  assert(env->cycles() == cycles && env->register_hash() == regs && env->memory_hash() == mem);
+  delta[0] ^= 1;
+  assert(!env->load_delta(state, delta));
+
+  // Rewind: five frames back lands on the fifth VBlank, before its ISR ran,
+  // and replaying from there gives the same machine again.
+  env->enable_rewind(1, 4);
+  env->reset();
+  env->run_for(PPU_LINE_DOTS * PPU_LINES * 10);
+  regs = env->register_hash();
+  mem = env->memory_hash();
+  cycles = env->cycles();
+  assert(env->peek_mem(0xC000) == 10);
+  assert(!env->rewind_frames(10));
+  assert(env->rewind_frames(5));
+  assert(env->peek_mem(0xC000) == 4);
+  env->run_for(cycles);
+  assert(env->register_hash() == regs && env->memory_hash() == mem);
+
+  // Block cache: a WRAM routine that rewrites an instruction of its own block
+  // runs the new instruction. It is started through a patched save state.
+  const uint8_t smc_prog[] = {
+    0x3E, 0x0C,       // C000 LD A,$0C: INC C
+    0x21, 0x08, 0xC0, // C002 LD HL,$C008
+    0x77,             // C005 LD (HL),A
+    0x06, 0x00,       // C006 LD B,$00
+    0x04,             // C008 INC B, rewritten to INC C
+    0x21, 0x00, 0xC1, // C009 LD HL,$C100
+    0x70,             // C00C LD (HL),B
+    0x2C,             // C00D INC L
+    0x71,             // C00E LD (HL),C
+    0x20, 0xFE,       // C00F JR NZ,$C00F
+  };
+  env->reset();
+  env->save_state(state);
+  uint16_t smc_pc = 0xC000;
+  memcpy(state.data() + sizeof(StateHeader) + offsetof(MachineState, pc), &smc_pc, sizeof(smc_pc));
+  memcpy(state.data() + sizeof(StateHeader) + sizeof(MachineState) + 0x2000, smc_prog, sizeof(smc_prog));
+  assert(env->load_state(state));
+  env->run_for(env->cycles() + 200);
+  assert(env->peek_mem(0xC100) == 0 && env->peek_mem(0xC101) == 1);
+
+  // JIT: a register-only loop checked against the interpreter on every native
+  // run, then compared with a run without the JIT.
+  const uint8_t jit_prog[] = {
+    0x3E, 0x01,       // C000 LD A,$01
+    0x06, 0x37,       // C002 LD B,$37
+    0x80,             // C004 ADD A,B
+    0xEE, 0x5A,       // C005 XOR $5A
+    0x4F,             // C007 LD C,A
+    0x04,             // C008 INC B
+    0x0D,             // C009 DEC C
+    0x89,             // C00A ADC A,C
+    0xDE, 0x11,       // C00B SBC A,$11
+    0x90,             // C00D SUB B
+    0xE6, 0xF3,       // C00E AND $F3
+    0xB2,             // C010 OR D
+    0xBB,             // C011 CP E
+    0x13,             // C012 INC DE
+    0x2B,             // C013 DEC HL
+    0xCB, 0xDB,       // C014 SET 3,E
+    0xCB, 0x82,       // C016 RES 0,D
+    0xCB, 0x7F,       // C018 BIT 7,A
+    0x20, 0xE8,       // C01A JR NZ,$C004
+    0x28, 0xE6,       // C01C JR Z,$C004
+  };
+  env->reset();
+  env->save_state(state);
+  memcpy(state.data() + sizeof(StateHeader) + offsetof(MachineState, pc), &smc_pc, sizeof(smc_pc));
+  memcpy(state.data() + sizeof(StateHeader) + sizeof(MachineState) + 0x2000, jit_prog, sizeof(jit_prog));
+  if (env->enable_jit(true, true)) {
+    assert(env->load_state(state));
+    env->run_for(env->cycles() + PPU_LINE_DOTS * PPU_LINES * 4);
+    assert(!env->crash_message());
+    regs = env->register_hash();
+    cycles = env->cycles();
+    env->enable_jit(false);
+    assert(env->load_state(state));
+    env->run_for(cycles);
+    assert(env->cycles() == cycles && env->register_hash() == regs);
+  }
+
+  // Opcode tables: every implemented instruction takes the cycles and bytes
+  // its entry gives, run once from WRAM with zero operands.
+  env->enable_jit(false);
+  env->reset();
+  env->save_state(state);
+  memcpy(state.data() + sizeof(StateHeader) + offsetof(MachineState, pc), &smc_pc, sizeof(smc_pc));
+  vector<uint8_t> after;
+  for (int page = 0; page < 2; page++) {
+    for (int op = 0; op < 0x100; op++) {
+      const uint8_t prog[] = { (uint8_t) (page ? 0xCB : op), (uint8_t) (page ? op : 0), 0 };
+      const OpInfo &info = decode_op(prog);
+      if (info.attrs & (OP_HALT | OP_ILLEGAL)) continue;
+      memcpy(state.data() + sizeof(StateHeader) + sizeof(MachineState) + 0x2000, prog, sizeof(prog));
+      assert(env->load_state(state));
+      cycles = env->cycles();
+      if (!env->step()) continue; // Not implemented yet.
+      cycles = env->cycles() - cycles;
+      env->save_state(after);
+      uint16_t pc;
+      memcpy(&pc, after.data() + sizeof(StateHeader) + offsetof(MachineState, pc), sizeof(pc));
+      assert(cycles == info.cycles || cycles == info.branch_cycles);
+      assert((info.attrs & OP_BRANCH) || pc == smc_pc + info.length);
+    }
+  }
+  char text[32];
+  const uint8_t jr[] = { 0x20, 0xFE }, ldh[] = { 0xE0, 0x40 }, bit[] = { 0xCB, 0x7C };
+  assert(disassemble(jr, 0xC00F, text, sizeof(text)) == 2 && strcmp(text, "JR NZ,$C00F") == 0);
+  assert(disassemble(ldh, 0, text, sizeof(text)) == 2 && strcmp(text, "LDH ($FF40),A") == 0);
+  assert(disassemble(bit, 0, text, sizeof(text)) == 2 && strcmp(text, "BIT 7,H") == 0);
+
+  // Single-step vectors: LD A,(HL-) decrements HL, CALL pushes the address
+  // after its operand, DAA fixes up a BCD add and ADD HL,SP carries from
+  // bit 11 into H.
+  const char *vectors = R"([
+    {"name": "3a", "initial": {"a": 0, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 193, "l": 0, "pc": 49152, "sp": 53248, "ime": 0,
+      "ram": [[49152, 58], [49408, 66]]},
+     "final": {"a": 66, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 192, "l": 255, "pc": 49153, "sp": 53248, "ime": 0,
+      "ram": [[49152, 58], [49408, 66]]},
+     "cycles": [null, null]},
+    {"name": "cd", "initial": {"a": 0, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 0, "l": 0, "pc": 49152, "sp": 53248, "ime": 0,
+      "ram": [[49152, 205], [49153, 52], [49154, 18]]},
+     "final": {"a": 0, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 0, "l": 0, "pc": 4660, "sp": 53246, "ime": 0,
+      "ram": [[53246, 3], [53247, 192]]},
+     "cycles": [null, null, null, null, null, null]},
+    {"name": "27", "initial": {"a": 60, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 0, "l": 0, "pc": 49152, "sp": 53248, "ime": 0,
+      "ram": [[49152, 39]]},
+     "final": {"a": 66, "b": 0, "c": 0, "d": 0, "e": 0, "f": 0, "h": 0, "l": 0, "pc": 49153, "sp": 53248, "ime": 0,
+      "ram": [[49152, 39]]},
+     "cycles": [null]},
+    {"name": "39", "initial": {"a": 0, "b": 0, "c": 0, "d": 0, "e": 0, "f": 128, "h": 15, "l": 255, "pc": 49152, "sp": 1, "ime": 0,
+      "ram": [[49152, 57]]},
+     "final": {"a": 0, "b": 0, "c": 0, "d": 0, "e": 0, "f": 160, "h": 16, "l": 0, "pc": 49153, "sp": 1, "ime": 0,
+      "ram": [[49152, 57]]},
+     "cycles": [null, null]}
+  ])";
+  JsonValue tests;
+  string json_error, diff;
+  assert(parse_json(vectors, tests, json_error) && tests.items.size() == 4);
+  ConformanceRunner conformance;
+  for (const JsonValue &test : tests.items) assert(conformance.run(test, diff));
+  JsonValue &final_ram = tests.items[1].members[2].second.members.back().second;
+  final_ram.items[0].items[1].number = 2;
+  assert(!conformance.run(tests.items[1], diff) && diff == "[0xcffe] 0x3 (expected 0x2)");
+  assert(!parse_json("[1, 2", tests, json_error));
+  assert(!parse_json("{\"a\": tru}", tests, json_error));
+  assert(parse_json(" {\"a\": [true, null, -1.5e1, \"x\\\"y\"]} ", tests, json_error));
+  assert(tests.get("a")->items[0].boolean && tests.get("a")->items[2].number == -15 && tests.get("a")->items[3].text == "x\"y");
+
+  // PPU: a background tile decoded from its two bit planes, then VBlank.
+  uint8_t vram[0x2000] = {}, oam[0x100] = {}, io[0x100] = {};
+  vram[0x10] = 0b01010101; // Tile 1, row 0: low plane...
+  vram[0x11] = 0b00110011; // ...and high plane.
+  vram[0x1800] = 1;        // Top-left entry of the tile map.
+  io[ADDR_LCDC & 0xFF] = 0x91;
+  io[ADDR_BGP & 0xFF] = 0b11100100;
+  PPU ppu(vram, oam, io);
+  ppu.reset();
+  ppu.sync(PPU_LINE_DOTS);
+  assert(io[ADDR_LY & 0xFF] == 1);
+  const uint8_t shades[] = {0, 1, 2, 3, 0, 1, 2, 3};
+  assert(memcmp(ppu.framebuffer, shades, sizeof(shades)) == 0);
+  ppu.sync(PPU_LINE_DOTS * SCREEN_H);
+  assert((io[ADDR_STAT & 0xFF] & 0b11) == PPU_MODE_VBLANK);
+  assert(ISBITN(io[ADDR_IF & 0xFF], INT_VBLANK));
+  assert(ppu.frames == 1);
+
+  // A write through the bus invalidates just that tile in the decode cache.
+  uint64_t misses = ppu.tile_misses;
+  ppu.write(0x8010, 0xFF);
+  ppu.sync(PPU_LINE_DOTS * (PPU_LINES + 1));
+  const uint8_t redrawn[] = {1, 1, 3, 3, 1, 1, 3, 3};
+  assert(memcmp(ppu.framebuffer, redrawn, sizeof(redrawn)) == 0);
+  assert(ppu.tile_misses == misses + 1);
 }
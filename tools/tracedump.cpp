@@ -0,0 +1,35 @@
+// Turns a binary instruction trace (see trace.h) back into text.
+//
+// Build with `make tools`, then: tools/tracedump trace.bin
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "../opcodes.h"
+#include "../trace.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s <trace file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  fstream file(argv[1], ios::binary | ios::in);
+  TraceFileHeader header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.entry_size != sizeof(TraceEntry)) {
+    printf("%s is not a trace file\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  TraceEntry e;
+  for (uint32_t i = 0; i < header.count && file.read(reinterpret_cast<char *>(&e), sizeof(e)); i++) {
+    printf("CMD 0x%.2x @ 0x%.4x (%d) CYCLE %lu %-12s | A=%.2x F=%.2x BC=%.2x%.2x DE=%.2x%.2x HL=%.2x%.2x SP=%.4x\n",
+      e.opcode, e.pc, e.pc, (unsigned long) e.cycle, (e.opcode == 0xCB ? cb_info[e.cb] : op_info[e.opcode]).mnemonic,
+      e.a, e.f, e.b, e.c, e.d, e.e, e.h, e.l, e.sp);
+  }
+  return EXIT_SUCCESS;
+}
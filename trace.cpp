@@ -0,0 +1,39 @@
+#include "trace.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include "defines.h"
+
+using namespace std;
+
+TraceBuffer::TraceBuffer() : head(0) {
+  #ifdef TRACE
+    entries.reset(new TraceEntry[TRACE_ENTRIES]);
+  #endif
+}
+
+void TraceBuffer::clear() {
+  head.store(0, memory_order_release);
+}
+
+bool TraceBuffer::save(const string &path) const {
+  if (!entries) return false;
+  uint64_t end = head.load(memory_order_acquire);
+  uint64_t start = end > TRACE_ENTRIES ? end - TRACE_ENTRIES : 0;
+
+  TraceFileHeader header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.entry_size = sizeof(TraceEntry);
+  header.count = end - start;
+
+  fstream file(path, ios::binary | ios::out | ios::trunc);
+  if (!file) {
+    ERR(printf("Cannot write trace to %s", path.c_str()));
+    return false;
+  }
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (uint64_t pos = start; pos < end; pos++) {
+    file.write(reinterpret_cast<const char *>(&entries[pos & (TRACE_ENTRIES - 1)]), sizeof(TraceEntry));
+  }
+  return bool(file);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "cpu.h"
+
+using namespace std;
+
+#define TRACE_ENTRIES (1 << 16) // Power of two, so the head wraps with a mask.
+#define TRACE_MAGIC   "GBTRACE1"
+
+// One executed instruction: the opcode and the registers before it ran.
+struct TraceEntry {
+  uint64_t cycle;
+  uint16_t pc;
+  uint16_t sp;
+  uint8_t  opcode;
+  uint8_t  a, f, b, c, d, e, h, l;
+  uint8_t  cb;  // The second byte of 0xCB instructions.
+  uint8_t  pad[2];
+};
+
+static_assert(sizeof(TraceEntry) == 24, "TraceEntry is written to disk as is");
+
+// Trace files are this header followed by `count` entries, oldest first.
+struct TraceFileHeader {
+  char     magic[8];
+  uint32_t entry_size;
+  uint32_t count;
+};
+
+// Fixed-size ring of the last TRACE_ENTRIES instructions, only allocated when
+// built with tracing.
+//
+// Recording is a handful of stores and a release store of the head, without
+// locks, so it can stay on in the interpreter loop. The emulation thread is
+// the only writer; save() may run elsewhere, and then entries that are being
+// overwritten during the copy can come out torn.
+class TraceBuffer {
+public:
+  TraceBuffer();
+  void clear();
+  bool save(const string &) const;
+
+  inline void record(uint64_t cycle, uint16_t pc, uint8_t opcode, CPU &cpu) {
+    uint64_t pos = head.load(memory_order_relaxed);
+    TraceEntry &entry = entries[pos & (TRACE_ENTRIES - 1)];
+    entry.cycle = cycle;
+    entry.pc = pc;
+    entry.sp = cpu.reg_sp;
+    entry.opcode = opcode;
+    entry.a = cpu.reg_a;
+    entry.f = cpu.f();
+    entry.b = cpu.reg_b;
+    entry.c = cpu.reg_c;
+    entry.d = cpu.reg_d;
+    entry.e = cpu.reg_e;
+    entry.h = cpu.reg_h;
+    entry.l = cpu.reg_l;
+    head.store(pos + 1, memory_order_release);
+  }
+
+  // Completes the last entry once a 0xCB prefix has read its opcode.
+  inline void record_cb(uint8_t opcode) {
+    entries[(head.load(memory_order_relaxed) - 1) & (TRACE_ENTRIES - 1)].cb = opcode;
+  }
+
+private:
+  unique_ptr<TraceEntry[]> entries;
+  atomic<uint64_t> head;  // Number of entries ever recorded.
+};